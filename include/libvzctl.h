@@ -110,6 +110,39 @@ struct vzctl_feature_param {
 	unsigned long long off;
 };
 
+/* Host capability bits */
+enum {
+	VZCTL_HOSTCAP_VZ		= (1U << 0), /* /proc/vz is present */
+	VZCTL_HOSTCAP_VZCTLDEV		= (1U << 1), /* /dev/vzctl ioctls */
+	VZCTL_HOSTCAP_NSOPS		= (1U << 2), /* namespace based ops */
+	VZCTL_HOSTCAP_CGROUP_V1		= (1U << 3),
+	VZCTL_HOSTCAP_CGROUP_V2		= (1U << 4),
+	VZCTL_HOSTCAP_MOUNT_API		= (1U << 5), /* fsopen/fsmount */
+};
+
+/* Host cgroup controller bits */
+enum {
+	VZCTL_HOSTCG_VE			= (1U << 0),
+	VZCTL_HOSTCG_CPU		= (1U << 1),
+	VZCTL_HOSTCG_CPUSET		= (1U << 2),
+	VZCTL_HOSTCG_MEMORY		= (1U << 3),
+	VZCTL_HOSTCG_BLKIO		= (1U << 4),
+	VZCTL_HOSTCG_DEVICES		= (1U << 5),
+	VZCTL_HOSTCG_FREEZER		= (1U << 6),
+	VZCTL_HOSTCG_NET_CLS		= (1U << 7),
+	VZCTL_HOSTCG_BEANCOUNTER	= (1U << 8),
+	VZCTL_HOSTCG_PIDS		= (1U << 9),
+};
+
+struct vzctl_host_caps {
+	char kver[65];			/* kernel release */
+	char arch[65];			/* machine */
+	unsigned long long tech;	/* supported VZ_T_* technologies */
+	unsigned int flags;		/* VZCTL_HOSTCAP_* */
+	unsigned int cgroups;		/* mounted VZCTL_HOSTCG_* controllers */
+	char dummy[64];
+};
+
 enum {
 	VZCTL_SKIP_NONE         = 0x00000,
 	VZCTL_SKIP_SETUP        = 0x00001,
@@ -365,6 +398,37 @@ struct vzctl_cpuinfo {
 	unsigned long long freq;
 };
 
+struct vzctl_node_meminfo {
+	unsigned long long ram_total;	/* host RAM in bytes */
+	unsigned long long swap_total;	/* host swap in bytes */
+	unsigned long long limit;	/* sum of CT RAM limits in bytes */
+	unsigned long long usage;	/* CT RAM usage in bytes */
+	unsigned long long swap_limit;	/* sum of CT RAM+swap limits in bytes */
+	unsigned long long swap_usage;	/* CT RAM+swap usage in bytes */
+	float overcommit;		/* limit / ram_total */
+	float swap_overcommit;		/* swap_limit / (ram_total + swap_total) */
+	int ncts;
+	int dummy[8];
+};
+
+struct vzctl_env_meminfo_stat {
+	ctid_t ctid;
+	unsigned long long limit;
+	unsigned long long usage;
+	unsigned long long swap_limit;
+	unsigned long long swap_usage;
+};
+
+#define VZCTL_FAILCNT_NAME_LEN	32
+struct vzctl_failcnt {
+	ctid_t ctid;
+	char name[VZCTL_FAILCNT_NAME_LEN];	/* beancounter or cgroup file */
+	unsigned long long failcnt;		/* current value */
+	unsigned long long delta;		/* since the previous call */
+};
+
+struct vzctl_failcnt_cursor;
+
 struct vzctl_disk_param {
 	char uuid[39];
 	int enabled;
@@ -378,9 +442,42 @@ struct vzctl_disk_param {
 	int use_device;
 	char *enc_keyid;
 	char *mnt_opts;
-	int dummy[32];
+	unsigned int iolimit;	/* B/s, 0 - unchanged */
+	unsigned int iopslimit;	/* 0 - unchanged */
+	int dummy[30];
 };
 
+/* drop the per-disk IO limit */
+#define VZCTL_DISK_IO_UNLIMITED	(~0U)
+
+struct vzctl_disk_iostat {
+	unsigned int iolimit;	/* B/s, 0 - unlimited */
+	unsigned int iopslimit;
+	unsigned long long read_bytes;
+	unsigned long long write_bytes;
+	unsigned long long read_ops;
+	unsigned long long write_ops;
+};
+
+#define VZCTL_RESIZE_PENDING	0
+#define VZCTL_RESIZE_RUNNING	1
+#define VZCTL_RESIZE_DONE	2
+#define VZCTL_RESIZE_FAILED	3
+
+#define VZCTL_RESIZE_MAX_JOBS	4
+
+struct vzctl_disk_resize_param {
+	char uuid[39];
+	unsigned long size;	/* new size in kilobytes */
+	int state;		/* out: VZCTL_RESIZE_xxx */
+	int err;		/* out: error code if state is VZCTL_RESIZE_FAILED */
+	int online;		/* out: resized on the mounted image via balloon */
+	int dummy[8];
+};
+
+typedef void (*vzctl_resize_progress_f)(struct vzctl_disk_resize_param *param,
+		void *data);
+
 struct vzctl_disk_stats {
 	char device[64];
 	unsigned long long total; // in kilobytes
@@ -431,6 +528,15 @@ struct vzctl_reg_param {
 	int dummy[32];
 };
 
+#define VZCTL_REG_MAX_JOBS	8
+struct vzctl_reg_batch_param {
+	const char *path;		/* VE private data root */
+	struct vzctl_reg_param param;
+	int err;			/* out: 0 on success, error code otherwise */
+	ctid_t ctid;			/* out: registered id */
+	int dummy[8];
+};
+
 #define VZCTL_MAX_NCPU        4096
 struct vzctl_cpumask
 {
@@ -484,6 +590,44 @@ struct vzctl_cpt_param {
 	int rst_fd;
 };
 
+enum {
+	VZCTL_CPT_STATS_DUMP	= 0,
+	VZCTL_CPT_STATS_RESTORE	= 1,
+};
+
+#define VZCTL_CPT_STATS_HOOKS	8
+
+struct vzctl_cpt_hook_stat {
+	char action[32];
+	unsigned long long start;	/* usec since the Epoch */
+	unsigned long long duration;	/* usec */
+};
+
+/* All times are in usec */
+struct vzctl_cpt_stats {
+	/* whole vzctl2_env_chkpnt/vzctl2_env_restore call */
+	unsigned long long start;
+	unsigned long long duration;
+	/* criu dump */
+	unsigned long long freezing_time;
+	unsigned long long frozen_time;
+	unsigned long long memdump_time;
+	unsigned long long memwrite_time;
+	unsigned long long pages_scanned;
+	unsigned long long pages_skipped_parent;
+	unsigned long long pages_written;
+	/* criu restore */
+	unsigned long long forking_time;
+	unsigned long long restore_time;
+	unsigned long long pages_compared;
+	unsigned long long pages_skipped_cow;
+	unsigned long long pages_restored;
+	/* restore start to the post-restore hook */
+	unsigned long long resume_latency;
+	int nhooks;
+	struct vzctl_cpt_hook_stat hooks[VZCTL_CPT_STATS_HOOKS];
+};
+
 enum {
 	VZCTL_ROOT_DISK_SKIP	= 1,
 	VZCTL_ROOT_DISK_BLANK	= 2,
@@ -513,7 +657,9 @@ struct vzctl_reinstall_param {
 	char *reinstall_scripts;
 	char *reinstall_opts;
 	char *ostemplate;
-	void *pad[32];
+	char *preserve_paths;	/* space separated CT paths carried over
+				   from the old root, e.g. "/var/lib/rpm" */
+	void *pad[31];
 };
 
 enum {
@@ -645,6 +791,27 @@ int vzctl2_vz_status(void);
  */
 int vzctl2_env_register(const char *path, struct vzctl_reg_param *param, int flags);
 
+/** Register a set of Containers in parallel
+ * Storage type and node identity are checked once per storage mount,
+ * per-Container outcome is reported in param[i].err and param[i].ctid
+ *
+ * @param param		array of n registration requests
+ * @param n		number of requests
+ * @param flags		registration flags, as for vzctl2_env_register()
+ * @param max_jobs	number of parallel workers, 0 for default
+ * @return		number of failed registrations, -1 on error
+ */
+int vzctl2_env_register_batch(struct vzctl_reg_batch_param *param, int n,
+		int flags, int max_jobs);
+
+/** Find Container private areas under dir
+ * @param dir		directory to scan, e.g. the shared storage root
+ * @param out		NULL terminated array of paths, free each entry
+ *			and the array with free()
+ * @return		number of entries found, -1 on error
+ */
+int vzctl2_env_find_private(const char *dir, char ***out);
+
 
 /** Unregister VE
  * @param path		VE private data root
@@ -679,6 +846,34 @@ int vzctl2_get_env_iostat(const ctid_t ctid, struct vzctl_iostat *stat, int size
 
 int vzctl2_get_env_meminfo(const ctid_t ctid, struct vzctl_meminfo *meminfo, int size);
 int vzctl2_get_env_total_meminfo(unsigned long *limit_bytes, unsigned long *usage_bytes);
+/** Get node-wide memory accounting of running CTs.
+ * Counters are read from the memory cgroups through file descriptors
+ * cached between calls. CT limits are capped to the host RAM/swap size.
+ *
+ * @param info		aggregate counters.
+ * @param size		sizeof(struct vzctl_node_meminfo).
+ * @param cts		optional per-CT breakdown, allocated by the library,
+ *			should be released by free().
+ * @param n		number of elements in cts.
+ * @return		0 on success
+ */
+int vzctl2_get_node_meminfo(struct vzctl_node_meminfo *info, int size,
+		struct vzctl_env_meminfo_stat **cts, int *n);
+
+/** Failure counters tracker
+ * Beancounter failcnt and memory cgroup failcnt/oom_kill counters of all
+ * running Containers are read in one pass and compared with the snapshot
+ * kept in the cursor. The first call reports all nonzero counters.
+ *
+ * @param c		cursor from vzctl2_failcnt_cursor_open()
+ * @param out		changed counters, should be released by free()
+ * @param n		number of elements in out
+ * @return		0 on success
+ */
+struct vzctl_failcnt_cursor *vzctl2_failcnt_cursor_open(void);
+void vzctl2_failcnt_cursor_close(struct vzctl_failcnt_cursor *c);
+int vzctl2_get_failcnt_delta(struct vzctl_failcnt_cursor *c,
+		struct vzctl_failcnt **out, int *n);
 void vzctl2_release_net_info(struct vzctl_net_info *info);
 int vzctl2_get_net_info(struct vzctl_env_handle *h, const char *ifname,
 		struct vzctl_net_info **info);
@@ -707,6 +902,17 @@ int vzctl2_set_iolimit(struct vzctl_env_handle *h, unsigned int limit);
 int vzctl2_get_iolimit(struct vzctl_env_handle *h, unsigned int *limit);
 int vzctl2_set_iopslimit(struct vzctl_env_handle *h, unsigned int limit);
 int vzctl2_get_iopslimit(struct vzctl_env_handle *h, unsigned int *limit);
+
+/** Get per-disk IO limits and usage of a running Container
+ * @param h		Container handle
+ * @param uuid		disk uuid
+ * @param out		limits and blkio counters, counters are 0
+ *			if the Container is not running
+ * @param size		sizeof(struct vzctl_disk_iostat)
+ * @return		0 on success
+ */
+int vzctl2_get_disk_iostat(struct vzctl_env_handle *h, const char *uuid,
+		struct vzctl_disk_iostat *out, int size);
 int vzctl2_clear_ve_netstat(struct vzctl_env_handle *h);
 int vzctl2_clear_all_ve_netstat(void);
 
@@ -896,6 +1102,14 @@ int vzctl2_env_auth(struct vzctl_env_handle *h, const char *user, const char *pa
 int vzctl2_get_free_envid(unsigned int *newid, const char *dst,
 		const char *unused);
 
+/* Get & lock n free Container ids for bulk creation
+ * @param ids		array of n ids to fill
+ * @param n		number of ids
+ * @param dst		check for /dst/$VEID
+ * @return		0 on success, on failure no ids are left locked
+ */
+int vzctl2_get_free_envids(unsigned int *ids, int n, const char *dst);
+
 
 /***************** Container's uptime *******************************/
 
@@ -905,6 +1119,15 @@ int vzctl2_get_free_envid(unsigned int *newid, const char *dst,
  */
 int vzctl2_env_reset_uptime(vzctl_env_handle_ptr h);
 
+/** Sync the uptime counters of all running Containers
+ * Run times are taken from a single /proc/vz/vestat read, the counter
+ * files are replaced atomically.
+ *
+ * @param nsynced	number of synced Containers, may be NULL
+ * @return		0 on success
+ */
+int vzctl2_sync_node_uptime(int *nsynced);
+
 /** Returns the Container uptime in seconds since some datetime and this
  *  datetime (in seconds since the Epoch)
  *
@@ -1031,6 +1254,20 @@ int vzctl2_env_resize_disk(struct vzctl_env_handle *h, const char *uuid,
 		unsigned long size, int offline);
 int vzctl2_env_encrypt_disk(struct vzctl_env_handle *h, const char *uuid,
 		const char *keyid, int flags);
+/** Resize a set of disks in parallel.
+ * Host free space is checked for all disks before any of them is touched.
+ *
+ * @param h		CT handle.
+ * @param param		array of disks to resize; state/err/online are filled in.
+ * @param n		number of elements in param.
+ * @param max_jobs	maximum number of parallel resizes (0 - default).
+ * @param cb		optional callback called on each disk state change.
+ * @param data		callback private data.
+ * @return		0 on success.
+ */
+int vzctl2_env_resize_disks(struct vzctl_env_handle *h,
+		struct vzctl_disk_resize_param *param, int n, int max_jobs,
+		vzctl_resize_progress_f cb, void *data);
 
 int vzctl2_env_get_disk_param(vzctl_disk_iterator it, struct vzctl_disk_param *out, int size);
 vzctl_disk_iterator vzctl2_env_get_disk(struct vzctl_env_param *env, vzctl_disk_iterator it);
@@ -1055,6 +1292,24 @@ int vzctl2_get_mount_opts(const char *mnt_opts, int user_quota, char *out, int s
 /***************** CPT *********************************/
 int vzctl2_env_chkpnt(struct vzctl_env_handle *h, int cmd, struct vzctl_cpt_param *param, int flags);
 int vzctl2_env_restore(struct vzctl_env_handle *h, struct vzctl_cpt_param *param, int flags);
+/** CRIU action hook, parameters are taken from the criu environment.
+ *
+ * @param action	CRTOOLS_SCRIPT_ACTION value.
+ * @return		0 on success, unknown actions are ignored.
+ */
+int vzctl2_criu_action(const char *action);
+/** Get statistics of the last dump or restore of the image.
+ *
+ * @param h		CT handle.
+ * @param param		checkpoint parameters, selects the image.
+ * @param type		VZCTL_CPT_STATS_DUMP or VZCTL_CPT_STATS_RESTORE.
+ * @param stats		output.
+ * @param size		sizeof(struct vzctl_cpt_stats).
+ * @return		0 on success.
+ */
+int vzctl2_env_get_cpt_stats(struct vzctl_env_handle *h,
+		struct vzctl_cpt_param *param, int type,
+		struct vzctl_cpt_stats *stats, int size);
 
 /**************** Exec *********************************/
 /** Execute command inside CT.
@@ -1114,6 +1369,12 @@ void vzctl2_env_unlock_prvt(const ctid_t ctid, int lckfd, const char *prvt);
 int vzctl2_env_set_node(struct vzctl_env_handle *h, struct vzctl_nodemask *nodemask,
 		struct vzctl_cpumask *cpumask);
 unsigned long vzctl2_check_tech(unsigned long mask);
+/** Get host capabilities, probed once per process.
+ */
+int vzctl2_get_host_caps(struct vzctl_host_caps *caps);
+/** Override host capabilities (NULL - probe the host again).
+ */
+void vzctl2_set_host_caps(const struct vzctl_host_caps *caps);
 unsigned long long vzctl2_name2tech(const char *name);
 const char *vzctl2_tech2name(unsigned long long id);
 int vzctl2_fstype2layout(unsigned long fstype);
@@ -0,0 +1,490 @@
+/*
+ * Copyright (c) 2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <ifaddrs.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <net/if_arp.h>
+#include <netpacket/packet.h>
+#include <sys/socket.h>
+
+#include "arpsend.h"
+#include "env.h"
+#include "net.h"
+#include "util.h"
+#include "logger.h"
+#include "vzerror.h"
+
+/* ARP payload for Ethernet/IPv4 following struct arphdr */
+struct arp_pkt {
+	struct arphdr hdr;
+	unsigned char sha[ETH_ALEN];
+	unsigned char spa[4];
+	unsigned char tha[ETH_ALEN];
+	unsigned char tpa[4];
+} __attribute__((packed));
+
+/* Unsolicited neighbour advertisement with the target lladdr option */
+struct na_pkt {
+	struct ip6_hdr ip6;
+	struct nd_neighbor_advert na;
+	struct nd_opt_hdr opt;
+	unsigned char lladdr[ETH_ALEN];
+} __attribute__((packed));
+
+static const unsigned char bcast_mac[ETH_ALEN] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+static const unsigned char allnodes_mac[ETH_ALEN] = {
+	0x33, 0x33, 0x00, 0x00, 0x00, 0x01};
+
+void arpsend_init(struct arpsend_ctx *ctx)
+{
+	list_head_init(&ctx->devs);
+	list_head_init(&ctx->targets);
+	ctx->arp_fd = -1;
+	ctx->nd_fd = -1;
+}
+
+void arpsend_free(struct arpsend_ctx *ctx)
+{
+	struct arpsend_target *t, *tt;
+	struct arpsend_dev *d, *dt;
+
+	list_for_each_safe(t, tt, &ctx->targets, list) {
+		list_del(&t->list);
+		free(t);
+	}
+	list_for_each_safe(d, dt, &ctx->devs, list) {
+		list_del(&d->list);
+		free(d);
+	}
+	if (ctx->arp_fd != -1)
+		close(ctx->arp_fd);
+	if (ctx->nd_fd != -1)
+		close(ctx->nd_fd);
+	ctx->arp_fd = ctx->nd_fd = -1;
+}
+
+static struct arpsend_dev *find_dev(struct arpsend_ctx *ctx, const char *name)
+{
+	struct arpsend_dev *d;
+
+	list_for_each(d, &ctx->devs, list)
+		if (!strcmp(d->name, name))
+			return d;
+
+	return NULL;
+}
+
+static struct arpsend_dev *add_dev(struct arpsend_ctx *ctx,
+		const struct ifaddrs *ifa)
+{
+	const struct sockaddr_ll *sll = (struct sockaddr_ll *)ifa->ifa_addr;
+	struct arpsend_dev *d;
+
+	if (sll->sll_hatype != ARPHRD_ETHER || sll->sll_halen != ETH_ALEN)
+		return NULL;
+
+	d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		vzctl_err(VZCTL_E_NOMEM, ENOMEM, "arpsend: add_dev");
+		return NULL;
+	}
+	snprintf(d->name, sizeof(d->name), "%s", ifa->ifa_name);
+	d->ifindex = sll->sll_ifindex;
+	memcpy(d->mac, sll->sll_addr, ETH_ALEN);
+	list_add_tail(&d->list, &ctx->devs);
+
+	return d;
+}
+
+static int add_target(struct arpsend_ctx *ctx, struct arpsend_dev *dev,
+		int family, const void *addr)
+{
+	struct arpsend_target *t;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "arpsend: add_target");
+	t->dev = dev;
+	t->family = family;
+	memcpy(t->addr, addr, family == AF_INET ? 4 : 16);
+	list_add_tail(&t->list, &ctx->targets);
+
+	return 0;
+}
+
+static int is_global_addr(const struct sockaddr *sa)
+{
+	if (sa == NULL)
+		return 0;
+	if (sa->sa_family == AF_INET)
+		return 1;
+	if (sa->sa_family == AF_INET6)
+		return !IN6_IS_ADDR_LINKLOCAL(
+				&((struct sockaddr_in6 *)sa)->sin6_addr);
+	return 0;
+}
+
+/* Same device selection as vzgetnetdev: UP uplinks carrying a global address */
+static int is_node_uplink(const char *name)
+{
+	char path[PATH_MAX];
+	const char *attr[] = {"device", "bridge"};
+	int i;
+
+	for (i = 0; i < sizeof(attr) / sizeof(attr[0]); i++) {
+		snprintf(path, sizeof(path), "/sys/class/net/%s/%s",
+				name, attr[i]);
+		if (access(path, F_OK) == 0)
+			return 1;
+	}
+	snprintf(path, sizeof(path), "/proc/net/vlan/%s", name);
+	if (access(path, F_OK) == 0)
+		return 1;
+
+	return !strncmp(name, "bond", 4);
+}
+
+int arpsend_add_node_devs(struct arpsend_ctx *ctx)
+{
+	struct ifaddrs *ifaddr, *ifa, *a;
+	unsigned int skip = IFF_LOOPBACK | IFF_SLAVE | IFF_NOARP;
+
+	/* Open vSwitch uplinks are mapped to bridges by ovs-vsctl */
+	if (access("/sys/module/openvswitch", F_OK) == 0)
+		return -1;
+
+	if (getifaddrs(&ifaddr))
+		return vzctl_err(-1, errno, "getifaddrs");
+
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL ||
+				ifa->ifa_addr->sa_family != AF_PACKET ||
+				!(ifa->ifa_flags & IFF_UP) ||
+				(ifa->ifa_flags & skip) ||
+				!is_node_uplink(ifa->ifa_name))
+			continue;
+
+		for (a = ifaddr; a != NULL; a = a->ifa_next)
+			if (!strcmp(a->ifa_name, ifa->ifa_name) &&
+					is_global_addr(a->ifa_addr))
+				break;
+		if (a != NULL && find_dev(ctx, ifa->ifa_name) == NULL)
+			add_dev(ctx, ifa);
+	}
+	freeifaddrs(ifaddr);
+
+	return 0;
+}
+
+int arpsend_add_ips(struct arpsend_ctx *ctx, list_head_t *ip)
+{
+	struct arpsend_dev *d;
+	struct vzctl_ip_param *it;
+	unsigned int addr[4];
+	int family;
+
+	list_for_each(it, ip, list) {
+		family = get_netaddr(it->ip, addr);
+		if (family == -1)
+			return -1;
+
+		list_for_each(d, &ctx->devs, list)
+			if (add_target(ctx, d, family, addr))
+				return VZCTL_E_NOMEM;
+	}
+
+	return 0;
+}
+
+/* Every address of every broadcast device in the current network namespace,
+ * root is used to look up sysfs of the namespace owner.
+ */
+int arpsend_add_env_addrs(struct arpsend_ctx *ctx, const char *root)
+{
+	struct ifaddrs *ifaddr, *ifa;
+	struct arpsend_dev *d;
+	char path[PATH_MAX];
+	const void *addr;
+	int ret = 0;
+
+	if (getifaddrs(&ifaddr))
+		return vzctl_err(-1, errno, "getifaddrs");
+
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL ||
+				ifa->ifa_addr->sa_family != AF_PACKET ||
+				(ifa->ifa_flags & (IFF_LOOPBACK | IFF_POINTOPOINT)))
+			continue;
+		snprintf(path, sizeof(path), "%s/sys/class/net/%s/bridge",
+				root, ifa->ifa_name);
+		if (access(path, F_OK) == 0)
+			continue;
+		add_dev(ctx, ifa);
+	}
+
+	for (ifa = ifaddr; ifa != NULL && ret == 0; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL ||
+				(d = find_dev(ctx, ifa->ifa_name)) == NULL)
+			continue;
+
+		if (ifa->ifa_addr->sa_family == AF_INET)
+			addr = &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+		else if (ifa->ifa_addr->sa_family == AF_INET6)
+			addr = &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+		else
+			continue;
+		ret = add_target(ctx, d, ifa->ifa_addr->sa_family, addr);
+	}
+	freeifaddrs(ifaddr);
+
+	return ret;
+}
+
+static int send_pkt(int fd, struct arpsend_dev *dev, int proto,
+		const unsigned char *dst, const void *pkt, int len)
+{
+	struct sockaddr_ll sll = {
+		.sll_family = AF_PACKET,
+		.sll_protocol = htons(proto),
+		.sll_ifindex = dev->ifindex,
+		.sll_halen = ETH_ALEN,
+	};
+
+	memcpy(sll.sll_addr, dst, ETH_ALEN);
+	if (sendto(fd, pkt, len, 0, (struct sockaddr *)&sll, sizeof(sll)) != len)
+		return vzctl_err(-1, errno, "Failed to send %s packet on %s",
+				proto == ETH_P_ARP ? "ARP" : "ND", dev->name);
+
+	return 0;
+}
+
+static int send_arp(int fd, struct arpsend_target *t, int mode)
+{
+	struct arp_pkt p = {
+		.hdr = {
+			.ar_hrd = htons(ARPHRD_ETHER),
+			.ar_pro = htons(ETH_P_IP),
+			.ar_hln = ETH_ALEN,
+			.ar_pln = 4,
+			.ar_op = htons(mode == ARPSEND_REPLY ?
+					ARPOP_REPLY : ARPOP_REQUEST),
+		},
+	};
+
+	memcpy(p.sha, t->dev->mac, ETH_ALEN);
+	memcpy(p.tpa, t->addr, 4);
+	switch (mode) {
+	case ARPSEND_DETECT:
+		/* RFC 5227 probe: zero sender address */
+		break;
+	case ARPSEND_REPLY:
+		memcpy(p.spa, t->addr, 4);
+		memcpy(p.tha, t->dev->mac, ETH_ALEN);
+		break;
+	case ARPSEND_UPDATE:
+		memcpy(p.spa, t->addr, 4);
+		memcpy(p.tha, bcast_mac, ETH_ALEN);
+		break;
+	}
+
+	return send_pkt(fd, t->dev, ETH_P_ARP, bcast_mac, &p, sizeof(p));
+}
+
+static unsigned short csum_add(unsigned int sum, const void *data, int len)
+{
+	const unsigned short *p = data;
+
+	for (; len > 1; len -= 2)
+		sum += *p++;
+	if (len)
+		sum += *(const unsigned char *)p;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+static int send_na(int fd, struct arpsend_target *t)
+{
+	struct na_pkt p = {};
+	unsigned int sum;
+	struct {
+		struct in6_addr src;
+		struct in6_addr dst;
+		unsigned int len;
+		unsigned char zero[3];
+		unsigned char nxt;
+	} __attribute__((packed)) ph = {};
+
+	p.ip6.ip6_flow = htonl(6 << 28);
+	p.ip6.ip6_plen = htons(sizeof(p) - sizeof(p.ip6));
+	p.ip6.ip6_nxt = IPPROTO_ICMPV6;
+	p.ip6.ip6_hlim = 255;
+	memcpy(&p.ip6.ip6_src, t->addr, 16);
+	inet_pton(AF_INET6, "ff02::1", &p.ip6.ip6_dst);
+
+	p.na.nd_na_type = ND_NEIGHBOR_ADVERT;
+	p.na.nd_na_flags_reserved = ND_NA_FLAG_OVERRIDE;
+	memcpy(&p.na.nd_na_target, t->addr, 16);
+	p.opt.nd_opt_type = ND_OPT_TARGET_LINKADDR;
+	p.opt.nd_opt_len = 1;
+	memcpy(p.lladdr, t->dev->mac, ETH_ALEN);
+
+	ph.src = p.ip6.ip6_src;
+	ph.dst = p.ip6.ip6_dst;
+	ph.len = htonl(sizeof(p) - sizeof(p.ip6));
+	ph.nxt = IPPROTO_ICMPV6;
+	sum = csum_add(0, &ph, sizeof(ph));
+	sum = csum_add(sum, &p.na, sizeof(p) - sizeof(p.ip6));
+	p.na.nd_na_cksum = ~sum & 0xffff;
+
+	return send_pkt(fd, t->dev, ETH_P_IPV6, allnodes_mac, &p, sizeof(p));
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Collect replies to the probes until timeout, return conflicts count */
+static int collect_replies(struct arpsend_ctx *ctx, int fd, int timeout)
+{
+	struct arpsend_target *t;
+	struct arp_pkt p;
+	struct sockaddr_ll sll;
+	socklen_t len;
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	long long end = now_ms() + timeout;
+	char ip[INET_ADDRSTRLEN];
+	int n, left, conflicts = 0;
+
+	while ((left = end - now_ms()) > 0) {
+		n = poll(&pfd, 1, left);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return vzctl_err(-1, errno, "arpsend: poll");
+		} else if (n == 0)
+			break;
+
+		len = sizeof(sll);
+		n = recvfrom(fd, &p, sizeof(p), MSG_DONTWAIT,
+				(struct sockaddr *)&sll, &len);
+		if (n < (int)sizeof(p) || p.hdr.ar_op != htons(ARPOP_REPLY) ||
+				p.hdr.ar_pro != htons(ETH_P_IP))
+			continue;
+
+		list_for_each(t, &ctx->targets, list) {
+			if (t->family != AF_INET ||
+					t->dev->ifindex != sll.sll_ifindex ||
+					memcmp(t->addr, p.spa, 4) ||
+					!memcmp(t->dev->mac, p.sha, ETH_ALEN))
+				continue;
+
+			logger(0, 0, "Warning: ip address %s is already in use"
+					" on %s by %02x:%02x:%02x:%02x:%02x:%02x",
+					inet_ntop(AF_INET, t->addr, ip, sizeof(ip)),
+					t->dev->name, p.sha[0], p.sha[1],
+					p.sha[2], p.sha[3], p.sha[4], p.sha[5]);
+			/* report each conflicting address once */
+			t->family = AF_UNSPEC;
+			conflicts++;
+		}
+	}
+
+	return conflicts;
+}
+
+/* Open the packet sockets, the caller can check with it that
+ * the packets can be sent natively before relying on arpsend_run()
+ */
+int arpsend_open(struct arpsend_ctx *ctx)
+{
+	if (ctx->arp_fd == -1) {
+		ctx->arp_fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC,
+				htons(ETH_P_ARP));
+		if (ctx->arp_fd == -1)
+			return vzctl_err(-1, errno, "Unable to create ARP socket");
+	}
+
+	if (ctx->nd_fd == -1) {
+		ctx->nd_fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (ctx->nd_fd == -1)
+			return vzctl_err(-1, errno, "Unable to create ND socket");
+	}
+
+	return 0;
+}
+
+/* Send ARP/ND packets for all targets from one socket per protocol,
+ * no forks and no ip_nonlocal_bind: packets are built at link level.
+ * For ARPSEND_DETECT the number of detected conflicts is returned,
+ * -1 if the sockets can not be opened or no packet could be sent.
+ */
+int arpsend_run(struct arpsend_ctx *ctx, int mode, int timeout)
+{
+	struct arpsend_target *t;
+	int queued = 0, sent = 0;
+
+	if (list_empty(&ctx->targets))
+		return 0;
+
+	if (arpsend_open(ctx))
+		return -1;
+
+	list_for_each(t, &ctx->targets, list) {
+		if (t->family == AF_INET) {
+			queued++;
+			if (send_arp(ctx->arp_fd, t, mode) == 0)
+				sent++;
+		} else if (t->family == AF_INET6 && mode != ARPSEND_DETECT) {
+			queued++;
+			if (send_na(ctx->nd_fd, t) == 0)
+				sent++;
+		}
+	}
+
+	if (queued && !sent)
+		return vzctl_err(-1, 0, "arpsend: no packets were sent");
+
+	if (mode == ARPSEND_DETECT && sent)
+		return collect_replies(ctx, ctx->arp_fd, timeout);
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+#ifndef __ARPSEND_H__
+#define __ARPSEND_H__
+
+#include "list.h"
+
+/* Wait time for address conflict replies, ms */
+#define ARPSEND_DETECT_TIMEOUT	1000
+
+enum {
+	ARPSEND_DETECT,		/* probe for conflicting owners */
+	ARPSEND_REPLY,		/* gratuitous ARP reply + unsolicited NA */
+	ARPSEND_UPDATE,		/* gratuitous ARP request + unsolicited NA */
+};
+
+struct arpsend_dev {
+	list_elem_t list;
+	char name[16];
+	int ifindex;
+	unsigned char mac[6];
+};
+
+struct arpsend_target {
+	list_elem_t list;
+	struct arpsend_dev *dev;
+	int family;
+	unsigned char addr[16];
+};
+
+struct arpsend_ctx {
+	list_head_t devs;
+	list_head_t targets;
+	int arp_fd;
+	int nd_fd;
+};
+
+void arpsend_init(struct arpsend_ctx *ctx);
+void arpsend_free(struct arpsend_ctx *ctx);
+int arpsend_add_node_devs(struct arpsend_ctx *ctx);
+int arpsend_add_ips(struct arpsend_ctx *ctx, list_head_t *ip);
+int arpsend_add_env_addrs(struct arpsend_ctx *ctx, const char *root);
+int arpsend_open(struct arpsend_ctx *ctx);
+int arpsend_run(struct arpsend_ctx *ctx, int mode, int timeout);
+
+#endif /* __ARPSEND_H__ */
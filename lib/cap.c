@@ -187,8 +187,8 @@ void build_cap_str(struct vzctl_cap_param *new, char *buf, int len)
 			op = 2;
 		else
 			continue;
-		r = snprintf(sp, ep - sp,  "%s:%s ", cap_names[i],
-			op == 1 ? "on" : "off");
+		r = snprintf(sp, ep - sp,  "%s%s:%s", sp == buf ? "" : " ",
+			cap_names[i], op == 1 ? "on" : "off");
 		if (r < 0 || sp + r >= ep)
 			break;
 		sp += r;
@@ -211,7 +211,7 @@ int parse_cap(struct vzctl_cap_param *cap, const char *str, int replace)
 	char *p, *token;
 	char cap_nm[128];
 	unsigned long *mask;
-	char *tmp = strdup(str);
+	char *tmp;
 	char *savedptr;
 
 	if (replace) {
@@ -219,8 +219,12 @@ int parse_cap(struct vzctl_cap_param *cap, const char *str, int replace)
 		cap->off = 0;
 	}
 
-	if ((token = strtok_r(tmp, LIST_DELIMITERS, &savedptr)) == NULL)
+	if ((tmp = strdup(str)) == NULL)
+		return VZCTL_E_NOMEM;
+	if ((token = strtok_r(tmp, LIST_DELIMITERS, &savedptr)) == NULL) {
+		free(tmp);
 		return 0;
+	}
 	do {
 		if ((p = strrchr(token, ':')) == NULL) {
 			logger(-1, 0, "Invalid syntaxes in %s:"
@@ -248,6 +252,11 @@ int parse_cap(struct vzctl_cap_param *cap, const char *str, int replace)
 			ret = VZCTL_E_INVAL;
 			break;
 		}
+		/* the last setting of a capability wins */
+		if (mask == &cap->on)
+			cap->off &= ~cap->on;
+		else
+			cap->on &= ~cap->off;
 	} while ((token = strtok_r(NULL, LIST_DELIMITERS, &savedptr)));
 	free(tmp);
 	return ret;
@@ -258,10 +267,18 @@ int vzctl2_env_set_cap(vzctl_env_handle_ptr h, vzctl_env_param_ptr env, unsigned
 	struct vzctl_cap_param *cap = env->cap;
 	unsigned long old_capmask;
 
+	capmask &= 0xffffffff;
 	old_capmask = make_cap_mask(CAPDEFAULTMASK, h->env_param->cap->on, h->env_param->cap->off);
+	if (capmask == old_capmask)
+		return 0;
 
-	cap->on = capmask & ~old_capmask;
-	cap->off = old_capmask & ~capmask;
+	/* CAPABILITY replaces the saved value, keep it relative to the
+	 * default mask; the default itself is stored as its own bits.
+	 */
+	cap->on = capmask & ~CAPDEFAULTMASK;
+	cap->off = CAPDEFAULTMASK & ~capmask;
+	if (cap->on == 0 && cap->off == 0)
+		cap->on = capmask;
 
 	return 0;
 }
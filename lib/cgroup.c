@@ -279,6 +279,24 @@ int cg_get_path(const char *ctid, const char *subsys, const char *name,
 	return 0;
 }
 
+int cg_get_slice_path(const char *subsys, char *out, int size)
+{
+	int ret;
+	struct cg_ctl *ctl;
+
+	ret = cg_get_ctl(subsys, &ctl);
+	if (ret)
+		return ret;
+
+	if (ctl->is_prvt || cg_is_systemd(ctl->subsys))
+		snprintf(out, size, "%s", ctl->mount_path);
+	else
+		snprintf(out, size, "%s/%s", ctl->mount_path,
+				cg_get_slice_name());
+
+	return 0;
+}
+
 int cg_set_param(const char *ctid, const char *subsys, const char *name, const char *data)
 {
 	int ret;
@@ -51,9 +51,12 @@
 struct vzctl_env_handle;
 
 const char *cg_get_slice_name(void);
+int cg_get_slice_path(const char *subsys, char *out, int size);
 int cg_get_path(const char *ctid, const char *subsys, const char *name,
 		char *out, int size);
 int write_data(const char *path, const char *data);
+int do_write_data(const int fd, const char *fname, const char *data,
+		const int len);
 int cg_get_cgroup_env_param(const char *ctid, char *out, int size);
 int cg_new_cgroup(const char *ctid);
 int cg_destroy_cgroup(const char *ctid);
@@ -21,9 +21,13 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
-#include <mntent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/ipc.h>
@@ -58,21 +62,283 @@ static int is_in_exclude_list(const char *mnt)
 	return 0;
 }
 
-static int read_shared_fs(list_head_t *head)
+struct mnt_entry {
+	int mnt_id;
+	long f_type;		/* statfs() magic, 0 if not known yet */
+	char *target;
+	char *fstype;
+};
+
+/* Per-process mount table cache.
+ * The table is read from /proc/self/mountinfo and kept until the kernel
+ * reports a mount table change on the mountinfo fd (POLLPRI|POLLERR),
+ * or the process is forked or enters another mount namespace.
+ * The mounts are indexed by mount id and keep the statfs() magic,
+ * so a lookup resolves the path to its mount id and statfs() is done
+ * once per mount.
+ */
+static struct {
+	int fd;
+	pid_t pid;
+	int n;
+	struct mnt_entry *mnts;
+	struct mnt_entry **by_id;
+} mnt_cache = {
+	.fd = -1,
+};
+static pthread_mutex_t mnt_cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void unescape_mnt(char *s)
+{
+	char *d = s;
+
+	while (*s != '\0') {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+				s[2] >= '0' && s[2] <= '7' &&
+				s[3] >= '0' && s[3] <= '7')
+		{
+			*d++ = ((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0');
+			s += 4;
+		} else
+			*d++ = *s++;
+	}
+	*d = '\0';
+}
+
+static void free_mnt_cache(void)
+{
+	int i;
+
+	for (i = 0; i < mnt_cache.n; i++) {
+		free(mnt_cache.mnts[i].target);
+		free(mnt_cache.mnts[i].fstype);
+	}
+	free(mnt_cache.mnts);
+	mnt_cache.mnts = NULL;
+	free(mnt_cache.by_id);
+	mnt_cache.by_id = NULL;
+	mnt_cache.n = 0;
+}
+
+static void close_mnt_cache(void)
+{
+	free_mnt_cache();
+	if (mnt_cache.fd != -1) {
+		close(mnt_cache.fd);
+		mnt_cache.fd = -1;
+	}
+}
+
+static int cmp_mnt_id(const void *a, const void *b)
+{
+	const struct mnt_entry *x = *(struct mnt_entry * const *)a;
+	const struct mnt_entry *y = *(struct mnt_entry * const *)b;
+
+	return (x->mnt_id > y->mnt_id) - (x->mnt_id < y->mnt_id);
+}
+
+static int load_mnt_cache(void)
 {
 	FILE *fp;
-	struct mntent *mnt;
-	int ret = 0;
+	char buf[PATH_MAX * 2];
+	char target[PATH_MAX];
+	char fstype[64];
+	int id, i;
+	struct mnt_entry *tmp;
+	int fd, size = 0;
 
-	if ((fp = setmntent("/proc/mounts", "r")) == NULL) {
-		logger(-1, errno, "Unable to open /proc/mounts");
+	if (mnt_cache.fd == -1) {
+		mnt_cache.fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+		if (mnt_cache.fd == -1)
+			return vzctl_err(-1, errno, "Can't open /proc/self/mountinfo");
+		mnt_cache.pid = getpid();
+	}
+
+	/* Reading the table to the end rearms the change notification */
+	if (lseek(mnt_cache.fd, 0, SEEK_SET) == -1)
+		return vzctl_err(-1, errno, "lseek /proc/self/mountinfo");
+
+	fd = dup(mnt_cache.fd);
+	if (fd == -1)
+		return vzctl_err(-1, errno, "dup");
+
+	fp = fdopen(fd, "r");
+	if (fp == NULL) {
+		close(fd);
+		return vzctl_err(-1, errno, "fdopen /proc/self/mountinfo");
+	}
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		char *p;
+
+		/* 36 35 98:0 /mnt1 /mnt/parent rw,noatime master:1 - ext3 /dev/root rw */
+		if (sscanf(buf, "%d %*u %*u:%*u %*s %4095s", &id, target) != 2)
+			continue;
+		p = strstr(buf, " - ");
+		if (p == NULL || sscanf(p, " - %63s", fstype) != 1)
+			continue;
+
+		if (mnt_cache.n == size) {
+			size = size ? size * 2 : 64;
+			tmp = realloc(mnt_cache.mnts, size * sizeof(struct mnt_entry));
+			if (tmp == NULL)
+				goto err;
+			mnt_cache.mnts = tmp;
+		}
+
+		unescape_mnt(target);
+		tmp = &mnt_cache.mnts[mnt_cache.n];
+		tmp->mnt_id = id;
+		tmp->f_type = 0;
+		tmp->target = strdup(target);
+		tmp->fstype = strdup(fstype);
+		mnt_cache.n++;
+		if (tmp->target == NULL || tmp->fstype == NULL)
+			goto err;
+	}
+	fclose(fp);
+
+	mnt_cache.by_id = malloc((mnt_cache.n + 1) * sizeof(struct mnt_entry *));
+	if (mnt_cache.by_id == NULL) {
+		free_mnt_cache();
+		return vzctl_err(-1, ENOMEM, "load_mnt_cache");
+	}
+	for (i = 0; i < mnt_cache.n; i++)
+		mnt_cache.by_id[i] = &mnt_cache.mnts[i];
+	qsort(mnt_cache.by_id, mnt_cache.n, sizeof(struct mnt_entry *),
+			cmp_mnt_id);
+
+	return 0;
+
+err:
+	fclose(fp);
+	free_mnt_cache();
+	return vzctl_err(-1, ENOMEM, "load_mnt_cache");
+}
+
+static int is_mnt_cache_changed(void)
+{
+	struct pollfd pfd = {
+		.fd = mnt_cache.fd,
+		.events = POLLPRI,
+	};
+
+	if (mnt_cache.fd == -1)
+		return 1;
+
+	if (poll(&pfd, 1, 0) == -1)
+		return 1;
+
+	return (pfd.revents & (POLLPRI | POLLERR)) ? 1 : 0;
+}
+
+/* Revalidate the cache, the mnt_cache_mtx must be held */
+static int get_mnt_cache(void)
+{
+	/* The mountinfo fd inherited over fork() is shared with the parent,
+	 * reading it would consume the parent's change notification.
+	 */
+	if (mnt_cache.fd != -1 && mnt_cache.pid != getpid())
+		close_mnt_cache();
+
+	if (mnt_cache.mnts != NULL && !is_mnt_cache_changed())
+		return 0;
+
+	free_mnt_cache();
+
+	return load_mnt_cache();
+}
+
+static struct mnt_entry *find_mnt_by_id(int mnt_id)
+{
+	struct mnt_entry key = { .mnt_id = mnt_id }, *k = &key, **m;
+
+	m = bsearch(&k, mnt_cache.by_id, mnt_cache.n,
+			sizeof(struct mnt_entry *), cmp_mnt_id);
+
+	return m ? *m : NULL;
+}
+
+/* Mount id of the object fd refers to */
+static int get_mnt_id(int fd, int *mnt_id)
+{
+	union {
+		struct file_handle fh;
+		char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+	} h;
+
+	h.fh.handle_bytes = MAX_HANDLE_SZ;
+
+	return name_to_handle_at(fd, "", &h.fh, mnt_id, AT_EMPTY_PATH);
+}
+
+void drop_mnt_cache(void)
+{
+	pthread_mutex_lock(&mnt_cache_mtx);
+	close_mnt_cache();
+	pthread_mutex_unlock(&mnt_cache_mtx);
+}
+
+/* Get filesystem magic for the path:
+ * the path is opened once, so the mount id and the statfs() result
+ * belong to the same resolved object, symlinks included. The magic
+ * is cached per mount until the mount table is changed.
+ *
+ * @return	0 on success, -1 on error (errno is set)
+ */
+static int get_fs_magic(const char *path, long *magic)
+{
+	int fd, ret = 0, mnt_id;
+	struct statfs sf;
+	struct mnt_entry *m = NULL;
+
+	fd = open(path, O_PATH | O_CLOEXEC);
+	if (fd == -1)
 		return -1;
+
+	pthread_mutex_lock(&mnt_cache_mtx);
+	/* the file systems without file handles are not cached */
+	if (get_mnt_cache() == 0 && get_mnt_id(fd, &mnt_id) == 0)
+		m = find_mnt_by_id(mnt_id);
+
+	if (m != NULL && m->f_type != 0) {
+		*magic = m->f_type;
+	} else if (fstatfs(fd, &sf) == 0) {
+		*magic = sf.f_type;
+		if (m != NULL)
+			m->f_type = sf.f_type;
+	} else
+		ret = -1;
+	pthread_mutex_unlock(&mnt_cache_mtx);
+
+	if (ret)
+		ret = errno;
+	close(fd);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int read_shared_fs(list_head_t *head)
+{
+	int i, ret = 0;
+
+	pthread_mutex_lock(&mnt_cache_mtx);
+	if (get_mnt_cache()) {
+		ret = -1;
+		goto out;
 	}
-	while ((mnt = getmntent(fp)) != NULL) {
-		if (is_in_exclude_list(mnt->mnt_dir))
+
+	for (i = 0; i < mnt_cache.n; i++) {
+		struct mnt_entry *m = &mnt_cache.mnts[i];
+
+		if (is_in_exclude_list(m->target))
 			continue;
-		if (is_shared_fs_type(mnt->mnt_type)) {
-			if (add_str_param(head, mnt->mnt_dir) == NULL) {
+		if (is_shared_fs_type(m->fstype)) {
+			if (add_str_param(head, m->target) == NULL) {
 				logger(-1, ENOMEM, "%s", __func__);
 				free_str(head);
 				ret = -1;
@@ -80,7 +346,9 @@ static int read_shared_fs(list_head_t *head)
 			}
 		}
 	}
-	endmntent(fp);
+out:
+	pthread_mutex_unlock(&mnt_cache_mtx);
+
 	return ret;
 }
 
@@ -131,11 +399,11 @@ char **vzctl2_get_storage(void)
 
 static int check_fs_type(const char *path, long magic)
 {
-	struct statfs st;
+	long f_type;
 
-	if (statfs(path, &st) != 0)
+	if (get_fs_magic(path, &f_type))
 		return vzctl_err(-1, errno, "statfs '%s'", path);
-	if (st.f_type == magic)
+	if (f_type == magic)
 		return 1;
 	return 0;
 }
@@ -157,14 +425,15 @@ int is_pcs(const char *path)
 
 int is_shared_fs(const char *path)
 {
-	struct statfs st;
+	long f_type;
 
-	if (statfs(path, &st)) {
+	if (get_fs_magic(path, &f_type)) {
 		if (errno != ENOENT)
 			logger(-1, errno, "statfs '%s'", path);
 		return -1;
 	}
-	return (st.f_type == GFS2_MAGIC ||
-			st.f_type == NFS_SUPER_MAGIC ||
-			st.f_type == FUSE_SUPER_MAGIC);
+
+	return (f_type == GFS2_MAGIC ||
+			f_type == NFS_SUPER_MAGIC ||
+			f_type == FUSE_SUPER_MAGIC);
 }
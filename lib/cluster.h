@@ -37,6 +37,7 @@ char **vzctl_get_storage(void);
 int is_nfs(const char *path);
 int is_pcs(const char *path);
 int is_shared_fs(const char *path);
+void drop_mnt_cache(void);
 
 #ifdef __cplusplus
 }
@@ -22,13 +22,21 @@
  */
 
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stddef.h>
+#include <sched.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/sysmacros.h>
 
 #include "libvzctl.h"
 #include "disk.h"
@@ -128,6 +136,491 @@ static int make_ploop_dev_args(struct vzctl_env_handle *h, char *out, int size)
 	return 0;
 }
 
+/* CT virtualization properties saved with the dump.
+ * vz_ve_state.img: "version N", one "<property> <value>" line per
+ * property and "csum <hex>" of all preceding lines.
+ */
+#define VE_STATE_IMG		"vz_ve_state.img"
+#define VE_STATE_VERSION	1
+
+static struct {
+	const char *env;
+	const char *name;
+	const char *img;
+} ve_state_params[] = {
+	{"VE_CLOCK_BOOTBASED",	"ve.clock_bootbased",	"vz_clock_bootbased.img"},
+	{"VE_CLOCK_MONOTONIC",	"ve.clock_monotonic",	"vz_clock_monotonic.img"},
+	{"VE_IPTABLES_MASK",	"ve.iptables_mask",	"vz_iptables_mask.img"},
+	{"VE_FEATURES",		"ve.features",		"vz_features.img"},
+	{"VE_AIO_MAX_NR",	"ve.aio_max_nr",	"vz_aio_max_nr.img"},
+	/* set after namespaces are set up */
+	{"VE_OS_RELEASE",	"ve.os_release",	"vz_os_release.img"},
+	{"VE_PID_MAX",		"ve.pid_max",		"vz_pid_max.img"},
+};
+#define VE_STATE_NR		(sizeof(ve_state_params) / sizeof(ve_state_params[0]))
+#define VE_STATE_NS_NR		5
+
+struct ve_state {
+	int loaded;
+	char val[VE_STATE_NR][STR_SIZE];
+};
+
+static struct {
+	const char *img;
+	const char *path;
+} ve_sysctl_imgs[] = {
+	{"vz_core_pattern.img",		"/proc/sys/kernel/core_pattern"},
+	{"vz_fsync-enable.img",		"/proc/sys/fs/fsync-enable"},
+	{"vz_odirect_enable.img",	"/proc/sys/fs/odirect_enable"},
+	{"vz_randomize_va_space.img",	"/proc/sys/kernel/randomize_va_space"},
+};
+
+static int read_file(const char *path, char *buf, int size)
+{
+	int fd, n;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	n = TEMP_FAILURE_RETRY(read(fd, buf, size - 1));
+	close(fd);
+	if (n < 0)
+		return -1;
+	buf[n] = '\0';
+
+	return n;
+}
+
+static int write_file(const char *path, const char *buf, int len)
+{
+	int fd, n;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return vzctl_err(-1, errno, "Can't open %s", path);
+	n = TEMP_FAILURE_RETRY(write(fd, buf, len));
+	if (close(fd) || n != len)
+		return vzctl_err(-1, errno, "Can't write %s", path);
+
+	return 0;
+}
+
+static int open_ve_cg(const char *ctid)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	if (cg_get_path(ctid, CG_VE, "", path, sizeof(path)))
+		return -1;
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return vzctl_err(-1, errno, "Can't open %s", path);
+
+	return fd;
+}
+
+static int write_ve_state(const char *ctid, const char *dir)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	char buf[VE_STATE_NR * STR_SIZE];
+	char val[STR_SIZE];
+	int i, n, fd, cg, len;
+
+	cg = open_ve_cg(ctid);
+	if (cg == -1)
+		return -1;
+
+	len = snprintf(buf, sizeof(buf), "version %d\n", VE_STATE_VERSION);
+	for (i = 0; i < VE_STATE_NR; i++) {
+		fd = openat(cg, ve_state_params[i].name, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			/* not supported by the kernel */
+			if (errno == ENOENT)
+				continue;
+			close(cg);
+			return vzctl_err(-1, errno, "Can't open %s",
+					ve_state_params[i].name);
+		}
+		n = TEMP_FAILURE_RETRY(read(fd, val, sizeof(val) - 1));
+		close(fd);
+		if (n < 0) {
+			close(cg);
+			return vzctl_err(-1, errno, "Can't read %s",
+					ve_state_params[i].name);
+		}
+		val[n] = '\0';
+		val[strcspn(val, "\n")] = '\0';
+		len += snprintf(buf + len, sizeof(buf) - len, "%s %s\n",
+				ve_state_params[i].name, val);
+	}
+	close(cg);
+	len += snprintf(buf + len, sizeof(buf) - len, "csum %08x\n",
+			fnv_hash(buf, len));
+
+	snprintf(path, sizeof(path), "%s/" VE_STATE_IMG, dir);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (write_file_atomic(path, tmp, buf, len, NULL))
+		return vzctl_err(-1, 0, "Failed to store %s", path);
+
+	return 0;
+}
+
+/* Returns 0 with st->loaded unset for dumps without the record */
+static int read_ve_state(const char *dir, struct ve_state *st)
+{
+	char path[PATH_MAX];
+	char buf[VE_STATE_NR * STR_SIZE];
+	char *p, *ep, *sp;
+	unsigned int csum;
+	int i, n, version;
+
+	memset(st, 0, sizeof(*st));
+	snprintf(path, sizeof(path), "%s/" VE_STATE_IMG, dir);
+	n = read_file(path, buf, sizeof(buf));
+	if (n < 0) {
+		if (errno == ENOENT)
+			return 0;
+		return vzctl_err(-1, errno, "Can't read %s", path);
+	}
+
+	if (sscanf(buf, "version %d", &version) != 1)
+		return vzctl_err(-1, 0, "Invalid %s", path);
+	if (version > VE_STATE_VERSION)
+		return vzctl_err(-1, 0, "Unsupported %s version %d",
+				path, version);
+
+	for (p = strchr(buf, '\n'); p != NULL && *++p != '\0'; p = ep) {
+		ep = strchr(p, '\n');
+		if (ep == NULL)
+			break;
+		if (sscanf(p, "csum %x", &csum) == 1) {
+			if (csum != fnv_hash(buf, p - buf))
+				break;
+			st->loaded = 1;
+			return 0;
+		}
+		*ep = '\0';
+		sp = strchr(p, ' ');
+		if (sp != NULL) {
+			*sp++ = '\0';
+			for (i = 0; i < VE_STATE_NR; i++)
+				if (!strcmp(p, ve_state_params[i].name))
+					snprintf(st->val[i], sizeof(st->val[i]),
+							"%s", sp);
+			sp[-1] = ' ';
+		}
+		*ep = '\n';
+	}
+
+	return vzctl_err(-1, 0, "%s is corrupted", path);
+}
+
+/* Apply saved properties [first, last) through a single ve cgroup fd.
+ * VE_* environment variables override the record, dumps without the
+ * record fall back to per-property images.
+ */
+static int apply_ve_state(const char *ctid, const char *dir,
+		struct ve_state *st, int first, int last)
+{
+	char path[PATH_MAX];
+	char buf[STR_SIZE];
+	const char *val;
+	int i, fd, cg, ret = 0;
+
+	cg = open_ve_cg(ctid);
+	if (cg == -1)
+		return -1;
+
+	for (i = first; i < last; i++) {
+		val = getenv(ve_state_params[i].env);
+		if (val == NULL && st->loaded)
+			val = st->val[i];
+		else if (val == NULL && dir != NULL) {
+			snprintf(path, sizeof(path), "%s/%s", dir,
+					ve_state_params[i].img);
+			if (read_file(path, buf, sizeof(buf)) > 0) {
+				buf[strcspn(buf, "\n")] = '\0';
+				val = buf;
+			}
+		}
+		if (val == NULL || *val == '\0')
+			continue;
+
+		fd = openat(cg, ve_state_params[i].name, O_WRONLY | O_CLOEXEC);
+		if (fd == -1 || TEMP_FAILURE_RETRY(write(fd, val, strlen(val))) < 0) {
+			ret = vzctl_err(-1, errno, "Failed to set %s=%s",
+					ve_state_params[i].name, val);
+			if (fd != -1)
+				close(fd);
+			break;
+		}
+		close(fd);
+	}
+	close(cg);
+
+	return ret;
+}
+
+/* C/R statistics: criu stats-dump/stats-restore images and
+ * vz_stats-dump/vz_stats-restore with "cpt <start> <duration>" and
+ * "hook <action> <start> <duration>" lines, usec since the Epoch.
+ */
+#define CRIU_IMG_SERVICE_MAGIC	0x55105940
+#define CRIU_STATS_MAGIC	0x57093306
+#define VZ_STATS_PREFIX		"vz_stats-"
+
+static const char *cpt_stats_type[] = {"dump", "restore"};
+
+struct pb_field {
+	int id;
+	size_t off;
+};
+
+/* criu/images/stats.proto */
+static struct pb_field dump_stats_fields[] = {
+	{1, offsetof(struct vzctl_cpt_stats, freezing_time)},
+	{2, offsetof(struct vzctl_cpt_stats, frozen_time)},
+	{3, offsetof(struct vzctl_cpt_stats, memdump_time)},
+	{4, offsetof(struct vzctl_cpt_stats, memwrite_time)},
+	{5, offsetof(struct vzctl_cpt_stats, pages_scanned)},
+	{6, offsetof(struct vzctl_cpt_stats, pages_skipped_parent)},
+	{7, offsetof(struct vzctl_cpt_stats, pages_written)},
+	{0, 0},
+};
+
+static struct pb_field restore_stats_fields[] = {
+	{1, offsetof(struct vzctl_cpt_stats, pages_compared)},
+	{2, offsetof(struct vzctl_cpt_stats, pages_skipped_cow)},
+	{3, offsetof(struct vzctl_cpt_stats, forking_time)},
+	{4, offsetof(struct vzctl_cpt_stats, restore_time)},
+	{5, offsetof(struct vzctl_cpt_stats, pages_restored)},
+	{0, 0},
+};
+
+static unsigned long long get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void add_cpt_stat(const char *path, const char *tag,
+		unsigned long long start)
+{
+	char buf[STR_SIZE];
+	int fd, len;
+
+	len = snprintf(buf, sizeof(buf), "%s %llu %llu\n", tag, start,
+			get_time_us() - start);
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return;
+	if (write(fd, buf, len) != len)
+		logger(0, errno, "Failed to write %s", path);
+	close(fd);
+}
+
+static int pb_get_varint(const unsigned char **p, const unsigned char *end,
+		unsigned long long *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; *p < end && shift < 64; shift += 7) {
+		unsigned char c = *(*p)++;
+
+		*v |= (unsigned long long)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 0;
+	}
+
+	return -1;
+}
+
+/* Decode a protobuf message; varint fields found in the map are stored,
+ * length-delimited fields are passed to sub when set.
+ */
+static int pb_parse(const unsigned char *p, const unsigned char *end,
+		struct pb_field *map, struct vzctl_cpt_stats *st,
+		int (*sub)(int id, const unsigned char *p,
+			const unsigned char *end, struct vzctl_cpt_stats *st))
+{
+	unsigned long long key, v;
+	int i;
+
+	while (p < end) {
+		if (pb_get_varint(&p, end, &key))
+			return -1;
+		switch (key & 7) {
+		case 0:
+			if (pb_get_varint(&p, end, &v))
+				return -1;
+			for (i = 0; map != NULL && map[i].id != 0; i++)
+				if (map[i].id == (key >> 3))
+					*(unsigned long long *)((char *)st +
+							map[i].off) = v;
+			break;
+		case 1:
+			p += 8;
+			break;
+		case 2:
+			if (pb_get_varint(&p, end, &v) || v > end - p)
+				return -1;
+			if (sub != NULL && sub(key >> 3, p, p + v, st))
+				return -1;
+			p += v;
+			break;
+		case 5:
+			p += 4;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return p == end ? 0 : -1;
+}
+
+static int parse_stats_entry(int id, const unsigned char *p,
+		const unsigned char *end, struct vzctl_cpt_stats *st)
+{
+	if (id == 1)
+		return pb_parse(p, end, dump_stats_fields, st, NULL);
+	else if (id == 2)
+		return pb_parse(p, end, restore_stats_fields, st, NULL);
+	return 0;
+}
+
+static int read_criu_stats(const char *dir, int type,
+		struct vzctl_cpt_stats *st)
+{
+	char path[PATH_MAX];
+	unsigned char buf[4096];
+	unsigned int *hdr = (unsigned int *)buf;
+	int n, off = 0;
+
+	snprintf(path, sizeof(path), "%s/stats-%s", dir, cpt_stats_type[type]);
+	n = read_file(path, (char *)buf, sizeof(buf));
+	if (n < 0)
+		return errno == ENOENT ? 1 : vzctl_err(-1, errno,
+				"Can't read %s", path);
+
+	if (n >= 4 && hdr[0] == CRIU_IMG_SERVICE_MAGIC)
+		off = 1;
+	if (n < (off + 2) * 4 || hdr[off] != CRIU_STATS_MAGIC ||
+			hdr[off + 1] > n - (off + 2) * 4 ||
+			pb_parse(buf + (off + 2) * 4,
+				buf + (off + 2) * 4 + hdr[off + 1],
+				NULL, st, parse_stats_entry))
+		return vzctl_err(-1, 0, "Invalid %s", path);
+
+	return 0;
+}
+
+static int read_vz_stats(const char *dir, int type,
+		struct vzctl_cpt_stats *st)
+{
+	char path[PATH_MAX];
+	char buf[STR_SIZE];
+	char action[32];
+	unsigned long long start, duration;
+	struct vzctl_cpt_hook_stat *hook;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/" VZ_STATS_PREFIX "%s", dir,
+			cpt_stats_type[type]);
+	fp = fopen(path, "re");
+	if (fp == NULL)
+		return errno == ENOENT ? 1 : vzctl_err(-1, errno,
+				"Can't open %s", path);
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (sscanf(buf, "cpt %llu %llu", &start, &duration) == 2) {
+			st->start = start;
+			st->duration = duration;
+		} else if (sscanf(buf, "hook %31s %llu %llu", action, &start,
+					&duration) == 3 &&
+				st->nhooks < VZCTL_CPT_STATS_HOOKS)
+		{
+			hook = &st->hooks[st->nhooks++];
+			snprintf(hook->action, sizeof(hook->action), "%s", action);
+			hook->start = start;
+			hook->duration = duration;
+		}
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+static int get_cpt_stats(const char *dir, int type, struct vzctl_cpt_stats *st)
+{
+	int i, ret, ret2;
+
+	memset(st, 0, sizeof(*st));
+	ret = read_criu_stats(dir, type, st);
+	if (ret == -1)
+		return -1;
+	ret2 = read_vz_stats(dir, type, st);
+	if (ret2 == -1)
+		return -1;
+	if (ret && ret2)
+		return 1;
+
+	for (i = 0; i < st->nhooks; i++) {
+		if (!strcmp(st->hooks[i].action, "post-restore") &&
+				st->hooks[i].start > st->start)
+			st->resume_latency = st->hooks[i].start - st->start;
+	}
+
+	return 0;
+}
+
+static void log_cpt_stats(const char *dir, int type)
+{
+	struct vzctl_cpt_stats st;
+
+	if (get_cpt_stats(dir, type, &st))
+		return;
+
+	if (type == VZCTL_CPT_STATS_DUMP)
+		logger(1, 0, "Dump: %llu ms, frozen %llu ms, memory written"
+				" %llu pages", st.duration / 1000,
+				st.frozen_time / 1000, st.pages_written);
+	else
+		logger(1, 0, "Restore: %llu ms, resume latency %llu ms,"
+				" memory restored %llu pages", st.duration / 1000,
+				st.resume_latency / 1000, st.pages_restored);
+}
+
+int vzctl2_env_get_cpt_stats(struct vzctl_env_handle *h,
+		struct vzctl_cpt_param *param, int type,
+		struct vzctl_cpt_stats *stats, int size)
+{
+	char dir[PATH_MAX];
+	struct vzctl_cpt_stats st;
+	int ret;
+
+	if (type != VZCTL_CPT_STATS_DUMP && type != VZCTL_CPT_STATS_RESTORE)
+		return vzctl_err(VZCTL_E_INVAL, 0, "Invalid statistics type %d",
+				type);
+
+	get_dumpfile(h, param, dir, sizeof(dir));
+	ret = get_cpt_stats(dir, type, &st);
+	if (ret == -1)
+		return VZCTL_E_SYSTEM;
+	else if (ret)
+		return vzctl_err(VZCTL_E_SYSTEM, 0, "No %s statistics in %s",
+				cpt_stats_type[type], dir);
+
+	memcpy(stats, &st, size < sizeof(st) ? size : sizeof(st));
+
+	return 0;
+}
+
 static int dump(struct vzctl_env_handle *h, int cmd,
 		struct vzctl_cpt_param *param)
 {
@@ -135,9 +628,10 @@ static int dump(struct vzctl_env_handle *h, int cmd,
 	char buf[PATH_MAX];
 	char script[PATH_MAX];
 	char *arg[2];
-	char *env[13] = {};
+	char *env[14] = {};
 	int ret, i = 0;
 	pid_t pid;
+	unsigned long long start = get_time_us();
 
 	ret = cg_env_get_init_pid(EID(h), &pid);
 	if (ret)
@@ -156,6 +650,7 @@ static int dump(struct vzctl_env_handle *h, int cmd,
 	env[i++] = strdup(buf);
 	snprintf(buf, sizeof(buf), "VE_PID=%d", pid);
 	env[i++] = strdup(buf);
+	env[i++] = strdup("VE_CPT_STATS=" VZ_STATS_PREFIX "dump");
 	snprintf(buf, sizeof(buf), "CRIU_LOGLEVEL=%d",
 		vzctl2_get_log_verbose() + 1);
 	env[i++] = strdup(buf);
@@ -205,6 +700,12 @@ static int dump(struct vzctl_env_handle *h, int cmd,
 	ret = vzctl2_wrap_exec_script(arg, env, 0);
 	if (ret)
 		ret = VZCTL_E_CHKPNT;
+	else {
+		get_dumpfile(h, param, path, sizeof(path));
+		snprintf(buf, sizeof(buf), "%s/" VZ_STATS_PREFIX "dump", path);
+		add_cpt_stat(buf, "cpt", start);
+		log_cpt_stats(path, VZCTL_CPT_STATS_DUMP);
+	}
 
 err:
 	free_ar_str(env);
@@ -312,19 +813,31 @@ static int restore(struct vzctl_env_handle *h, struct vzctl_cpt_param *param,
 	char path[PATH_MAX];
 	char script[PATH_MAX];
 	char buf[PATH_MAX];
+	char stats[PATH_MAX];
 	char *arg[2];
-	char *env[20] = {};
+	char *env[21] = {};
 	struct vzctl_veth_dev *veth;
 	int ret, i = 0;
 	char *pbuf, *ep, *s;
+	struct ve_state st;
+	unsigned long long start = get_time_us();
 
 	ret = restore_ini(h, param, &dumpdir, &workdir, &logfile);
 	if (ret)
 		return ret;
 
+	if (read_ve_state(dumpdir, &st)) {
+		ret = VZCTL_E_RESTORE;
+		goto err;
+	}
+
 	logger(3, 0, "Open the dump file %s", dumpdir);
+	snprintf(stats, sizeof(stats), "%s/" VZ_STATS_PREFIX "restore", dumpdir);
+	unlink(stats);
+
 	snprintf(buf, sizeof(buf), "VE_DUMP_DIR=%s", dumpdir);
 	env[i++] = strdup(buf);
+	env[i++] = strdup("VE_CPT_STATS=" VZ_STATS_PREFIX "restore");
 	snprintf(buf, sizeof(buf), "VE_WORK_DIR=%s", workdir);
 	env[i++] = strdup(buf);
 	snprintf(buf, sizeof(buf), "VE_RESTORE_LOG_PATH=%s", logfile);
@@ -410,6 +923,9 @@ static int restore(struct vzctl_env_handle *h, struct vzctl_cpt_param *param,
 	if (vzctl2_wrap_exec_script(arg, env, 0)) {
 		unlink(get_criu_pidfile(h->ctid, path));
 		ret = VZCTL_E_RESTORE;
+	} else {
+		add_cpt_stat(stats, "cpt", start);
+		log_cpt_stats(dumpdir, VZCTL_CPT_STATS_RESTORE);
 	}
 
 	restore_fin(dumpdir, workdir, logfile, ret);
@@ -453,3 +969,368 @@ int criu_cmd(struct vzctl_env_handle *h, int cmd,
 			"Unsupported criu command %d", cmd);
 	}
 }
+
+/* CRIU action hooks, run by criu through the criu_action helper.
+ * The hooks write cgroup and sysctl files directly instead of forking
+ * cgset/cgexec/nsenter from a shell script.
+ */
+/* Exchange the zero status with the waiting party over a pair of fds */
+static int action_handshake(const char *wr_env, const char *rd_env)
+{
+	const char *s;
+	int fd, status = 0;
+
+	if ((s = getenv(wr_env)) != NULL) {
+		fd = atoi(s);
+		if (write(fd, &status, sizeof(status)) != sizeof(status))
+			return vzctl_err(-1, errno, "Failed to write %s", wr_env);
+	}
+
+	if ((s = getenv(rd_env)) != NULL) {
+		fd = atoi(s);
+		if (TEMP_FAILURE_RETRY(read(fd, &status, sizeof(status))) !=
+				sizeof(status))
+			return vzctl_err(-1, errno, "Failed to read %s", rd_env);
+	}
+
+	return status;
+}
+
+/* Copy ve sysctls between /proc/sys and the images from inside the ve
+ * cgroup context, single child for all of them
+ */
+static int ve_sysctl_ctl(const char *ctid, const char *dir, int dump)
+{
+	char img[PATH_MAX];
+	char buf[4096];
+	int i, n, ret = 0;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return vzctl_err(-1, errno, "Unable to fork");
+	if (pid == 0) {
+		if (cg_set_ul(ctid, CG_VE, "tasks", getpid()))
+			_exit(1);
+
+		for (i = 0; i < sizeof(ve_sysctl_imgs) / sizeof(ve_sysctl_imgs[0]); i++) {
+			snprintf(img, sizeof(img), "%s/%s", dir,
+					ve_sysctl_imgs[i].img);
+			if (dump) {
+				n = read_file(ve_sysctl_imgs[i].path, buf, sizeof(buf));
+				if (n < 0 || write_file(img, buf, n)) {
+					ret = vzctl_err(1, errno, "Failed to dump %s",
+							ve_sysctl_imgs[i].path);
+					break;
+				}
+			} else {
+				n = read_file(img, buf, sizeof(buf));
+				if (n < 0)
+					continue;
+				if (write_data(ve_sysctl_imgs[i].path, buf)) {
+					ret = vzctl_err(1, 0, "Failed to restore %s",
+							ve_sysctl_imgs[i].path);
+					break;
+				}
+			}
+		}
+		_exit(ret);
+	}
+
+	return env_wait(pid, 0, NULL);
+}
+
+/* VE_PLOOP_DEVS=UUID@ploopN:major:minor:[root] as built by
+ * make_ploop_dev_args()
+ */
+struct ploop_dev_ent {
+	char uuid[64];
+	char name[64];
+	dev_t dev;
+};
+
+static int parse_ploop_dev_map(const char *str, struct ploop_dev_ent **out)
+{
+	struct ploop_dev_ent *map = NULL, *tmp;
+	unsigned int major, minor;
+	const char *p;
+	int n = 0;
+
+	for (p = str; *p != '\0'; p += strcspn(p, "\n"), p += (*p == '\n')) {
+		tmp = realloc(map, (n + 1) * sizeof(*map));
+		if (tmp == NULL) {
+			free(map);
+			return vzctl_err(-1, ENOMEM, "parse_ploop_dev_map");
+		}
+		map = tmp;
+		if (sscanf(p, "%63[^@]@%63[^:]:%u:%u", map[n].uuid, map[n].name,
+					&major, &minor) != 4)
+			continue;
+		map[n++].dev = makedev(major, minor);
+	}
+	*out = map;
+
+	return n;
+}
+
+/* Create all missing directories of the path relative to dfd */
+static int mkdirat_p(int dfd, char *path)
+{
+	char *p;
+
+	for (p = strchr(path, '/'); p != NULL; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdirat(dfd, path, 0755) && errno != EEXIST) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+
+	return 0;
+}
+
+static int mknodat_blk(int dfd, const char *name, dev_t dev)
+{
+	char path[PATH_MAX];
+
+	/* relative to the root fd */
+	snprintf(path, sizeof(path), "%s", name + strspn(name, "/"));
+	unlinkat(dfd, path, 0);
+	if (mknodat(dfd, path, S_IFBLK | 0600, dev) == 0)
+		return 0;
+	if (errno != ENOENT || mkdirat_p(dfd, path) ||
+			mknodat(dfd, path, S_IFBLK | 0600, dev))
+		return vzctl_err(-1, errno, "Failed to create %s", name);
+
+	return 0;
+}
+
+/* Recreate ploop device nodes for the dev/<uuid> links in every restored
+ * mount namespace root, the links point to the devices of the dumped node
+ */
+static int restore_devices(pid_t init_pid)
+{
+	struct ploop_dev_ent *map;
+	char *roots, *root, *sp;
+	char link[PATH_MAX], old[PATH_MAX];
+	const char *s;
+	int i, n, dfd, ret = 0;
+	pid_t pid;
+
+	if ((s = getenv("VE_PLOOP_DEVS")) == NULL)
+		return 0;
+
+	pid = fork();
+	if (pid < 0)
+		return vzctl_err(-1, errno, "Unable to fork");
+	if (pid)
+		return env_wait(pid, 0, NULL);
+
+	if (set_ns(init_pid, "mnt", CLONE_NEWNS))
+		_exit(1);
+
+	n = parse_ploop_dev_map(s, &map);
+	roots = strdup(getenv("CRIU_MNT_NS_ROOTS") ?: "");
+	if (n < 0 || roots == NULL)
+		_exit(1);
+
+	for (root = strtok_r(roots, " \n", &sp); root != NULL && ret == 0;
+			root = strtok_r(NULL, " \n", &sp))
+	{
+		dfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dfd == -1) {
+			ret = vzctl_err(1, errno, "Can't open %s", root);
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			snprintf(link, sizeof(link), "dev/%s", map[i].uuid);
+			ret = readlinkat(dfd, link, old, sizeof(old) - 1);
+			if (ret <= 0) {
+				ret = 0;
+				continue;
+			}
+			old[ret] = '\0';
+
+			logger(5, 0, "%s: %s -> %s", root, map[i].uuid,
+					map[i].name);
+			if (mknodat_blk(dfd, old, map[i].dev) ||
+					mknodat_blk(dfd, map[i].name, map[i].dev))
+			{
+				ret = 1;
+				break;
+			}
+			ret = 0;
+			unlinkat(dfd, link, 0);
+		}
+		close(dfd);
+	}
+
+	_exit(ret);
+}
+
+static int action_setup_ns(const char *ctid)
+{
+	const char *s, *dir;
+	char buf[STR_SIZE];
+	struct ve_state st = {};
+	pid_t pid;
+
+	if ((s = getenv("CRTOOLS_INIT_PID")) == NULL)
+		return vzctl_err(-1, 0, "Missing parameter CRTOOLS_INIT_PID");
+	pid = atoi(s);
+
+	if ((s = getenv("VE_NETNS_FILE")) != NULL) {
+		snprintf(buf, sizeof(buf), "/proc/%d/ns/net", pid);
+		if (symlink(buf, s))
+			return vzctl_err(-1, errno, "Failed to create %s", s);
+	}
+
+	if (ctid == NULL)
+		return 0;
+
+	dir = getenv("VE_DUMP_DIR");
+	if (dir != NULL && read_ve_state(dir, &st))
+		return -1;
+	if (apply_ve_state(ctid, dir, &st, 0, VE_STATE_NS_NR))
+		return -1;
+
+	snprintf(buf, sizeof(buf), "START %d", pid);
+	if (cg_set_param(ctid, CG_VE, "ve.state", buf))
+		return vzctl_err(-1, 0, "Failed to start %s", ctid);
+
+	return 0;
+}
+
+static int action_post_setup_ns(const char *ctid)
+{
+	const char *s, *dir;
+	struct ve_state st = {};
+	int ret;
+
+	if (ctid == NULL)
+		return 0;
+
+	if ((s = getenv("CRTOOLS_INIT_PID")) == NULL)
+		return vzctl_err(-1, 0, "Missing parameter CRTOOLS_INIT_PID");
+
+	ret = restore_devices(atoi(s));
+	if (ret)
+		return ret;
+
+	dir = getenv("VE_DUMP_DIR");
+	if (dir != NULL && read_ve_state(dir, &st))
+		return -1;
+
+	return apply_ve_state(ctid, dir, &st, VE_STATE_NS_NR, VE_STATE_NR);
+}
+
+static int action_post_restore(const char *ctid)
+{
+	const char *dir;
+
+	if ((dir = getenv("CRTOOLS_IMAGE_DIR")) == NULL)
+		return vzctl_err(-1, 0, "Missing parameter CRTOOLS_IMAGE_DIR");
+
+	if (ctid != NULL) {
+		if (ve_sysctl_ctl(ctid, dir, 0))
+			return -1;
+		if (cg_set_param(ctid, CG_VE, "ve.pseudosuper", "0"))
+			return vzctl_err(-1, 0, "Failed to drop pseudosuper on %s",
+					ctid);
+	}
+
+	if (action_handshake("CRIU_ACTION_POST_RESUME_READ_FD",
+				"CRIU_ACTION_POST_RESUME_WRITE_FD"))
+		return vzctl_err(-1, 0, "Failed on action script in post-restore"
+				" for %s", ctid ?: "");
+
+	if (action_handshake("STATUSFD", "WAITFD"))
+		return vzctl_err(-1, 0, "Failed on post-restore for %s",
+				ctid ?: "");
+
+	return 0;
+}
+
+static int action_pre_dump(const char *ctid)
+{
+	const char *dir;
+	const char *names[] = {"memory.limit_in_bytes",
+		"memory.memsw.limit_in_bytes"};
+	char path[PATH_MAX];
+	char buf[STR_SIZE];
+	char *p;
+	int i;
+
+	if ((dir = getenv("CRTOOLS_IMAGE_DIR")) == NULL)
+		return vzctl_err(-1, 0, "Missing parameter CRTOOLS_IMAGE_DIR");
+	if (ctid == NULL)
+		return 0;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (cg_get_param(ctid, CG_MEMORY, names[i], buf, sizeof(buf)))
+			return vzctl_err(-1, 0, "Failed to dump %s", names[i]);
+		snprintf(path, sizeof(path), "%s/vz_%s.img", dir, names[i]);
+		/* vz_memory.limit_in_bytes.img -> vz_memory_limit_in_bytes.img */
+		for (p = path + strlen(dir); *p != '\0'; p++)
+			if (*p == '.' && strcmp(p, ".img"))
+				*p = '_';
+		strcat(buf, "\n");
+		if (write_file(path, buf, strlen(buf)))
+			return -1;
+	}
+
+	return write_ve_state(ctid, dir);
+}
+
+static int action_post_dump(const char *ctid)
+{
+	const char *dir;
+
+	if ((dir = getenv("CRTOOLS_IMAGE_DIR")) == NULL)
+		return vzctl_err(-1, 0, "Missing parameter CRTOOLS_IMAGE_DIR");
+
+	if (ctid != NULL && ve_sysctl_ctl(ctid, dir, 1))
+		return -1;
+
+	return action_handshake("STATUSFD", "WAITFD");
+}
+
+int vzctl2_criu_action(const char *action)
+{
+	const char *ctid = getenv("VEID");
+	const char *dir, *stats;
+	char path[PATH_MAX];
+	char tag[64];
+	unsigned long long start;
+	int ret;
+
+	if (action == NULL)
+		return vzctl_err(-1, 0, "Missing parameter CRTOOLS_SCRIPT_ACTION");
+
+	logger(3, 0, "criu action %s", action);
+	start = get_time_us();
+	if (!strcmp(action, "setup-namespaces"))
+		ret = action_setup_ns(ctid);
+	else if (!strcmp(action, "post-setup-namespaces"))
+		ret = action_post_setup_ns(ctid);
+	else if (!strcmp(action, "post-restore"))
+		ret = action_post_restore(ctid);
+	else if (!strcmp(action, "pre-dump"))
+		ret = action_pre_dump(ctid);
+	else if (!strcmp(action, "post-dump"))
+		ret = action_post_dump(ctid);
+	else
+		return 0;
+
+	dir = getenv("CRTOOLS_IMAGE_DIR");
+	stats = getenv("VE_CPT_STATS");
+	if (dir != NULL && stats != NULL) {
+		snprintf(path, sizeof(path), "%s/%s", dir, stats);
+		snprintf(tag, sizeof(tag), "hook %s", action);
+		add_cpt_stat(path, tag, start);
+	}
+
+	return ret;
+}
@@ -20,6 +20,7 @@
  * Schaffhausen, Switzerland.
  *
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -57,6 +58,7 @@
 #include "disk.h"
 #include "exec.h"
 #include "snapshot.h"
+#include "extract.h"
 #include "disk.h"
 
 #define REINSTALL_OLD_MNT	"/mnt"
@@ -298,14 +300,9 @@ static int create_private_ploop(struct vzctl_env_handle *h, const char *dst,
 		const char *tarball, int layout, int flags)
 {
 	char buf[PATH_MAX];
-	char script[PATH_MAX];
 	char data_root[PATH_MAX];
-	char private_template[PATH_MAX];
-	char ve_prvt[PATH_MAX];
+	unsigned long long reserved = CREATE_RESERVED_DISKSPACE;
 	int ret;
-	char *arg[2];
-	char *env[5];
-	int i = 0;
 
 	switch (layout) {
 	case VZCTL_LAYOUT_5:
@@ -323,19 +320,10 @@ static int create_private_ploop(struct vzctl_env_handle *h, const char *dst,
 	if (ret)
 		return ret;
 
-	arg[0] = get_script_path(VZCTL_CREATE_PRVT, script, sizeof(script));
-	arg[1] = NULL;
-
-	snprintf(private_template, sizeof(private_template), "PRIVATE_TEMPLATE=%s", tarball);
-	env[i++] = private_template;
-	snprintf(ve_prvt, sizeof(ve_prvt), "VE_PRVT=%s", data_root);
-	env[i++] = ve_prvt;
-	env[i++] = ENV_PATH;
 	if ((flags & VZCTL_FORCE) || is_pcs(dst) == 0)
-		env[i++] = "RESERVED_DISKSPACE=0";
+		reserved = 0;
 
-	env[i] = NULL;
-	ret = vzctl2_wrap_exec_script(arg, env, 0);
+	ret = extract_cache(tarball, data_root, reserved);
 	if (ret)
 		return ret;
 
@@ -1203,6 +1191,133 @@ static int reinstall_post(struct vzctl_env_handle *h, list_head_t *reinstall_scr
 	return 0;
 }
 
+/* Open the parent directory of path inside root. Symlinks are not
+ * followed, so the Container can not redirect the lookup out of root.
+ * Missing directories are created if requested. On success the last
+ * path component is returned in name.
+ */
+static int open_parent_in_root(const char *root, const char *path,
+		int create, char *name, int size)
+{
+	char buf[PATH_MAX];
+	char *p, *next;
+	int fd, dfd;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	for (p = buf + strlen(buf) - 1; p > buf && *p == '/'; p--)
+		*p = '\0';
+
+	dfd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (dfd == -1)
+		return vzctl_err(-1, errno, "Unable to open %s", root);
+
+	for (p = buf; *p == '/'; p++);
+	while ((next = strchr(p, '/')) != NULL) {
+		*next++ = '\0';
+		fd = openat(dfd, p, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd == -1 && errno == ENOENT && create) {
+			if (mkdirat(dfd, p, 0755) && errno != EEXIST) {
+				logger(-1, errno, "Unable to create %s", p);
+				close(dfd);
+				return -1;
+			}
+			fd = openat(dfd, p, O_PATH | O_DIRECTORY | O_NOFOLLOW |
+					O_CLOEXEC);
+		}
+		close(dfd);
+		if (fd == -1) {
+			if (errno == ENOTDIR || errno == ELOOP)
+				logger(-1, 0, "Unable to preserve %s: %s is not"
+						" a directory", path, p);
+			else if (errno != ENOENT || create)
+				logger(-1, errno, "Unable to open %s", p);
+			return -1;
+		}
+		dfd = fd;
+		for (p = next; *p == '/'; p++);
+	}
+	snprintf(name, size, "%s", p);
+
+	return dfd;
+}
+
+/* Copy the selected paths from the old root over the freshly created
+ * ones. Both trees are walked by descriptor without following symlinks,
+ * the existing destination is removed and the source is copied through
+ * /proc/<pid>/fd with reflinks where the file system supports them.
+ */
+static int reinstall_preserve_paths(struct vzctl_env_handle *h,
+		const char *old_root, const char *paths)
+{
+	char name[NAME_MAX + 1];
+	char src[PATH_MAX];
+	char dst[PATH_MAX];
+	char *cp[] = {"/bin/cp", "-ax", "--reflink=auto", src, dst, NULL};
+	char *rm[] = {"/bin/rm", "-rf", "--one-file-system", dst, NULL};
+	struct vzctl_str_param *it;
+	struct stat st;
+	const char *root = h->env_param->fs->ve_root;
+	int sfd = -1, dfd = -1, ret = 0;
+	LIST_HEAD(list);
+
+	if (parse_str_param(&list, paths))
+		return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "parse_str_param");
+
+	list_for_each(it, &list, list) {
+		if (it->str[0] != '/' || strstr(it->str, "..") != NULL) {
+			ret = vzctl_err(VZCTL_E_INVAL, 0,
+					"Invalid path to preserve: %s", it->str);
+			break;
+		}
+
+		sfd = open_parent_in_root(old_root, it->str, 0,
+				name, sizeof(name));
+		if (sfd == -1) {
+			if (errno == ENOENT)
+				continue;
+			ret = VZCTL_E_REINSTALL;
+			break;
+		}
+		if (name[0] == '\0' ||
+				fstatat(sfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+			close(sfd);
+			sfd = -1;
+			continue;
+		}
+
+		dfd = open_parent_in_root(root, it->str, 1, name, sizeof(name));
+		if (dfd == -1) {
+			ret = VZCTL_E_REINSTALL;
+			break;
+		}
+
+		logger(0, 0, "Preserving %s", it->str);
+		snprintf(src, sizeof(src), "/proc/%d/fd/%d/%s",
+				getpid(), sfd, name);
+		snprintf(dst, sizeof(dst), "/proc/%d/fd/%d/%s",
+				getpid(), dfd, name);
+		if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+				vzctl2_wrap_exec_script(rm, NULL, 0)) {
+			ret = VZCTL_E_REINSTALL;
+			break;
+		}
+		ret = vzctl2_wrap_exec_script(cp, NULL, 0);
+		if (ret)
+			break;
+
+		close(sfd);
+		close(dfd);
+		sfd = dfd = -1;
+	}
+	if (sfd != -1)
+		close(sfd);
+	if (dfd != -1)
+		close(dfd);
+	free_str(&list);
+
+	return ret;
+}
+
 static const char *get_ostmpl(struct vzctl_env_handle *h)
 {
 	const char *s = h->env_param->tmpl->ostmpl;
@@ -1221,6 +1336,8 @@ int vzctl2_env_reinstall(struct vzctl_env_handle *h,
 	char old_root[PATH_MAX];
 	char new_disk[PATH_MAX];
 	char new_prvt[PATH_MAX];
+	char snap_guid[64] = "";
+	ctid_t uuid;
 	struct vzctl_mount_param mount_param = {};
 	char vzpkg_src_conf[STR_SIZE];
 	char c_configure_script[PATH_MAX];
@@ -1328,11 +1445,29 @@ skip_create:
 	if (make_dir(old_root, 1))
 		goto err;
 
+	/* Changes made to the old root by the reinstall scripts go to
+	 * a temporary delta which is dropped on failure
+	 */
+	vzctl2_generate_ctid(uuid);
+	snprintf(snap_guid, sizeof(snap_guid), "{%s}", uuid);
+	ret = vzctl2_create_disk_snapshot(old_disk, snap_guid);
+	if (ret) {
+		snap_guid[0] = '\0';
+		goto err;
+	}
+
 	mount_param.target = old_root;
 	ret = vzctl2_mount_disk_image(old_disk, &mount_param);
 	if (ret)
 		goto err;
 
+	if (param->preserve_paths != NULL) {
+		ret = reinstall_preserve_paths(h, old_root,
+				param->preserve_paths);
+		if (ret)
+			goto err;
+	}
+
 	/* Start Container */
 	if (!param->resetpwdb || c_configure || !list_empty(&app_list)) {
 		flags = VZCTL_SKIP_MOUNT | (list_empty(&app_list) ?
@@ -1426,6 +1561,8 @@ skip_create:
 			logger(-1, errno, "rolback failed %s -> %s", tmp, old_disk);
 		goto err1;
 	}
+	/* the temporary delta is gone with the old image */
+	snap_guid[0] = '\0';
 
 	destroydir(new_prvt);
 	destroydir(tmp);
@@ -1453,6 +1590,22 @@ err:
 	if (vzctl2_is_image_mounted(new_prvt))
 		vzctl2_umount_disk_image(new_prvt);
 err1:
+	if (snap_guid[0] != '\0') {
+		/* drop the changes made to the old root */
+		if (vzctl2_is_image_mounted(old_disk))
+			vzctl2_umount_disk_image(old_disk);
+		if (vzctl2_is_image_mounted(old_disk))
+			logger(-1, 0, "Unable to roll back %s: the image is"
+					" still mounted, the temporary snapshot"
+					" %s is left", old_disk, snap_guid);
+		else if (vzctl2_switch_disk_snapshot(old_disk, snap_guid,
+					NULL, 0))
+			logger(-1, 0, "Unable to roll back %s to the temporary"
+					" snapshot %s", old_disk, snap_guid);
+		else if (vzctl2_delete_disk_snapshot(old_disk, snap_guid))
+			logger(-1, 0, "Unable to delete the temporary snapshot"
+					" %s of %s", snap_guid, old_disk);
+	}
 	destroydir(new_prvt);
 
 	free_str(&app_list);
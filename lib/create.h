@@ -24,6 +24,9 @@
 #ifndef __CREATE_H__
 #define __CREATE_H__
 
+/* 10G kept free on the storage when a private area is created */
+#define CREATE_RESERVED_DISKSPACE	(10ULL << 30)
+
 struct vzctl_create_param {
 	char *ostemplate;
 	char *config;
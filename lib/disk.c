@@ -33,6 +33,7 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/vfs.h>
 #include <libgen.h>
 #include <dirent.h>
 #include <string.h>
@@ -55,6 +56,7 @@
 #include "cluster.h"
 #include "cgroup.h"
 #include "sysfs_perm.h"
+#include "io.h"
 #include "exec.h"
 #include "disk.h"
 
@@ -448,6 +450,14 @@ static int parse_disk_str(const char *str, struct vzctl_disk *disk)
 			disk->autocompact = yesno2id(tmp);
 			if (disk->autocompact == -1)
 				logger(-1, 0, "Incorrect autocompact=%s", tmp);
+		} else if (!strncmp("iolimit=", p, 8)) {
+			GET_PARAM_VAL(p, "iolimit=")
+			if (parse_io_uint(&disk->iolimit, tmp))
+				logger(-1, 0, "Incorrect iolimit=%s", tmp);
+		} else if (!strncmp("iopslimit=", p, 10)) {
+			GET_PARAM_VAL(p, "iopslimit=")
+			if (parse_io_uint(&disk->iopslimit, tmp))
+				logger(-1, 0, "Incorrect iopslimit=%s", tmp);
 		} else if (!strncmp("storage_url=", p, 12)) {
 			GET_PARAM_VAL(p, "storage_url=")
 			ret = xstrdup(&disk->storage_url, tmp);
@@ -578,6 +588,19 @@ char *disk2str(struct vzctl_env_handle *h, struct vzctl_env_disk *env_disk)
 				break;
 		}
 
+		if (it->iolimit) {
+			sp += snprintf(sp, ep - sp, "iolimit=%u,", it->iolimit);
+			if (sp >= ep)
+				break;
+		}
+
+		if (it->iopslimit) {
+			sp += snprintf(sp, ep - sp, "iopslimit=%u,",
+					it->iopslimit);
+			if (sp >= ep)
+				break;
+		}
+
 		if (it->use_device)
 			sp += snprintf(sp, ep - sp, "device=%s;", it->path);
 		else
@@ -1019,10 +1042,12 @@ int configure_disk_perm(struct vzctl_env_handle *h, struct vzctl_disk *disk,
 	return 0;
 }
 
-static int configure_sysfsperm(struct vzctl_env_handle *h, struct vzctl_disk *d,
-		int del)
+/* Collect ve.sysfs_permissions rules for the disk into the set,
+ * the caller applies them with sysfs_perm_apply()
+ */
+static int configure_sysfsperm(struct vzctl_disk *d, int del,
+		struct sysfs_perm_set *set)
 {
-	char buf[STR_SIZE];
 	char sys_dev[PATH_MAX];
 	char sys_part[PATH_MAX];
 	char sys_dm[PATH_MAX];
@@ -1045,44 +1070,37 @@ static int configure_sysfsperm(struct vzctl_env_handle *h, struct vzctl_disk *d,
 	}
 
 	if (del) {
-		snprintf(buf, sizeof(buf), "%s -", sys_dev);
-		if (cg_set_param(EID(h), CG_VE, "ve.sysfs_permissions", buf))
+		if (sysfs_perm_add(set, sys_dev, "-") ||
+				sysfs_perm_add(set, sys_part, "-"))
 			return VZCTL_E_DISK_CONFIGURE;
 
-		snprintf(buf, sizeof(buf), "%s -", sys_part);
-		if (cg_set_param(EID(h), CG_VE, "ve.sysfs_permissions", buf))
+		if (d->dmname && sysfs_perm_add(set, sys_dm, "-"))
 			return VZCTL_E_DISK_CONFIGURE;
 
-		if (d->dmname) {
-			snprintf(buf, sizeof(buf), "%s -", sys_dm);
-			if (cg_set_param(EID(h), CG_VE, "ve.sysfs_permissions", buf))
-				return VZCTL_E_DISK_CONFIGURE;
-		}
-
 		return 0;
 	}
 
-	if (cg_set_param(EID(h), CG_VE, "ve.sysfs_permissions", "block rx"))
+	if (sysfs_perm_add(set, "block", "rx"))
 		return VZCTL_E_DISK_CONFIGURE;
 
-	if (add_sysfs_dir(h, sys_dev, NULL, "rx"))
+	if (sysfs_perm_add_dir(set, sys_dev, NULL, "rx"))
 		return VZCTL_E_DISK_CONFIGURE;
 
-	ret = add_sysfs_entry(h, sys_dev);
+	ret = sysfs_perm_add_entry(set, sys_dev);
 	if (ret)
 		return ret;
 
-	ret = add_sysfs_entry(h, sys_part);
+	ret = sysfs_perm_add_entry(set, sys_part);
 	if (ret)
 		return ret;
 
 	if (d->dmname != NULL) {
-		ret = add_sysfs_entry(h, sys_dm);
+		ret = sysfs_perm_add_entry(set, sys_dm);
 		if (ret)
 			return ret;
 
 		strcat(sys_dm, "/dm");
-		ret = add_sysfs_entry(h, sys_dm);
+		ret = sysfs_perm_add_entry(set, sys_dm);
 		if (ret)
 			return ret;
 	}
@@ -1090,8 +1108,8 @@ static int configure_sysfsperm(struct vzctl_env_handle *h, struct vzctl_disk *d,
 	return 0;
 }
 
-static int do_setup_disk(struct vzctl_env_handle *h, struct vzctl_disk *disk,
-		int flags, int automount)
+static int prepare_disk(struct vzctl_env_handle *h, struct vzctl_disk *disk,
+		int flags, struct sysfs_perm_set *perms)
 {
 	int ret;
 	int root = is_root_disk(disk);
@@ -1119,12 +1137,26 @@ static int do_setup_disk(struct vzctl_env_handle *h, struct vzctl_disk *disk,
 	if (ret)
 		return ret;
 
-	ret = configure_sysfsperm(h, disk, 0);
+	return configure_sysfsperm(disk, 0, perms);
+}
+
+static int do_setup_disk(struct vzctl_env_handle *h, struct vzctl_disk *disk,
+		int flags, int automount, int defer_mnt_configure)
+{
+	int ret;
+	struct sysfs_perm_set perms;
+
+	sysfs_perm_init(&perms);
+	ret = prepare_disk(h, disk, flags, &perms);
+	if (ret == 0 && sysfs_perm_apply(h, &perms))
+		ret = VZCTL_E_DISK_CONFIGURE;
+	sysfs_perm_free(&perms);
 	if (ret)
 		return ret;
 
-	if (!skip_configure) {
-		ret = configure_disk(h, disk, flags, automount);
+	if (!(flags & VZCTL_SKIP_CONFIGURE)) {
+		ret = configure_disk(h, disk, flags, automount,
+				defer_mnt_configure);
 		if (ret)
 			return ret;
 	}
@@ -1145,7 +1177,7 @@ static int enable_disk(struct vzctl_env_handle *h, struct vzctl_disk *d)
 			return ret;
 	}
 
-	ret = do_setup_disk(h, d, 0, 1);
+	ret = do_setup_disk(h, d, 0, 1, 0);
 	if (ret && !d->use_device)
 		vzctl2_umount_disk_image(d->path);
 
@@ -1357,6 +1389,7 @@ static int env_umount(void *data)
 static int del_disk(struct vzctl_env_handle *h, struct vzctl_disk *d)
 {
 	int ret;
+	struct sysfs_perm_set perms;
 
 	ret = update_disk_info(h, d);
 	if (ret == VZCTL_E_FS_NOT_MOUNTED)
@@ -1373,7 +1406,11 @@ static int del_disk(struct vzctl_env_handle *h, struct vzctl_disk *d)
 		if (ret)
 			return ret;
 
-		ret = configure_sysfsperm(h, d, 1);
+		sysfs_perm_init(&perms);
+		ret = configure_sysfsperm(d, 1, &perms);
+		if (ret == 0 && sysfs_perm_apply(h, &perms))
+			ret = VZCTL_E_DISK_CONFIGURE;
+		sysfs_perm_free(&perms);
 		if (ret)
 			return ret;
 	}
@@ -1492,6 +1529,234 @@ int vzctl2_resize_disk(struct vzctl_env_handle *h, const char *guid,
 	return 0;
 }
 
+struct resize_job {
+	struct vzctl_env_handle *h;
+	struct vzctl_disk *d;
+	struct vzctl_disk_resize_param *param;
+	pid_t mntns_pid;
+	vzctl_resize_progress_f cb;
+	void *data;
+};
+
+static void set_resize_state(struct resize_job *job, int state, int err)
+{
+	job->param->state = state;
+	job->param->err = err;
+	if (job->cb != NULL)
+		job->cb(job->param, job->data);
+}
+
+/* Check the host free space for all disks in one pass:
+ * the required growth is summed up per host filesystem.
+ */
+static int check_resize_space(struct resize_job *jobs, int n)
+{
+	int i, j;
+	struct statfs *st;
+	unsigned long long *need;
+	int *fs_idx;
+	int nfs = 0, ret = 0;
+
+	st = calloc(n, sizeof(struct statfs));
+	need = calloc(n, sizeof(unsigned long long));
+	fs_idx = calloc(n, sizeof(int));
+	if (st == NULL || need == NULL || fs_idx == NULL) {
+		ret = vzctl_err(VZCTL_E_NOMEM, ENOMEM, "check_resize_space");
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct statfs fs;
+
+		if (jobs[i].param->size <= jobs[i].d->size)
+			continue;
+
+		if (statfs(jobs[i].d->path, &fs)) {
+			ret = vzctl_err(VZCTL_E_SYSTEM, errno, "statfs %s",
+					jobs[i].d->path);
+			goto out;
+		}
+
+		for (j = 0; j < nfs; j++)
+			if (!memcmp(&st[j].f_fsid, &fs.f_fsid, sizeof(fs.f_fsid)))
+				break;
+		if (j == nfs)
+			memcpy(&st[nfs++], &fs, sizeof(fs));
+
+		fs_idx[j] = i;
+		need[j] += jobs[i].param->size - jobs[i].d->size;
+	}
+
+	for (j = 0; j < nfs; j++) {
+		unsigned long long avail = (unsigned long long)st[j].f_bavail *
+				st[j].f_bsize / 1024;
+
+		if (need[j] > avail) {
+			ret = vzctl_err(VZCTL_E_FS_NO_DISK_SPACE, 0,
+					"Not enough free space on the host to resize"
+					" disks: %lluK required, %lluK available on %s",
+					need[j], avail, jobs[fs_idx[j]].d->path);
+			goto out;
+		}
+	}
+
+out:
+	free(st);
+	free(need);
+	free(fs_idx);
+
+	return ret;
+}
+
+static int is_disk_image_mounted(struct vzctl_disk *d)
+{
+	int ret;
+	char dev[64];
+	struct ploop_disk_images_data *di;
+
+	if (open_dd(d->path, &di))
+		return 0;
+	ret = ploop_get_dev(di, dev, sizeof(dev));
+	ploop_close_dd(di);
+
+	return ret == 0;
+}
+
+static int resize_job_fn(void *data)
+{
+	struct resize_job *job = data;
+
+	return resize_disk_image(job->d->path, job->param->size, 0,
+			job->mntns_pid);
+}
+
+static void resize_job_started(struct vzctl_exec_task *t)
+{
+	set_resize_state(t->data, VZCTL_RESIZE_RUNNING, 0);
+}
+
+static void resize_job_finished(struct vzctl_exec_task *t)
+{
+	struct resize_job *job = t->data;
+
+	if (t->status) {
+		set_resize_state(job, VZCTL_RESIZE_FAILED, t->status);
+		return;
+	}
+
+	if (is_root_disk(job->d)) {
+		char s[64];
+
+		snprintf(s, sizeof(s), "%lu:%lu", job->param->size,
+				job->param->size);
+		vzctl2_env_set_param(job->h, "DISKSPACE", s);
+	}
+	job->d->size = job->param->size;
+
+	set_resize_state(job, VZCTL_RESIZE_DONE, 0);
+}
+
+int vzctl2_resize_disks(struct vzctl_env_handle *h,
+		struct vzctl_disk_resize_param *param, int n, int max_jobs,
+		vzctl_resize_progress_f cb, void *data)
+{
+	int i, j, ret, failed = 0;
+	pid_t pid = 0;
+	struct resize_job *jobs;
+	struct vzctl_exec_task *tasks;
+
+	if (n <= 0)
+		return 0;
+	if (max_jobs <= 0)
+		max_jobs = VZCTL_RESIZE_MAX_JOBS;
+
+	jobs = calloc(n, sizeof(struct resize_job));
+	tasks = calloc(n, sizeof(struct vzctl_exec_task));
+	if (jobs == NULL || tasks == NULL) {
+		ret = vzctl_err(VZCTL_E_NOMEM, ENOMEM, "vzctl2_resize_disks");
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct vzctl_disk *d;
+
+		param[i].state = VZCTL_RESIZE_PENDING;
+		param[i].err = 0;
+		param[i].online = 0;
+
+		d = find_disk(h->env_param->disk, param[i].uuid);
+		if (d == NULL) {
+			ret = vzctl_err(VZCTL_E_INVAL, 0,
+					"Unable to resize the disk with uuid %s:"
+					" no such disk", param[i].uuid);
+			goto out;
+		}
+		if (d->use_device) {
+			ret = vzctl_err(VZCTL_E_INVAL, 0,
+					"Unable to resize the disk with uuid %s:"
+					" disk is a device", param[i].uuid);
+			goto out;
+		}
+		/* two workers must never resize the same image */
+		for (j = 0; j < i; j++) {
+			if (jobs[j].d == d) {
+				ret = vzctl_err(VZCTL_E_INVAL, 0,
+						"Unable to resize the disk with uuid %s:"
+						" the disk is specified more than once",
+						param[i].uuid);
+				goto out;
+			}
+		}
+		param[i].size = get_disk_size(param[i].size);
+		jobs[i].h = h;
+		jobs[i].d = d;
+		jobs[i].param = &param[i];
+		jobs[i].cb = cb;
+		jobs[i].data = data;
+	}
+
+	ret = check_resize_space(jobs, n);
+	if (ret)
+		goto out;
+
+	if (is_env_run(h)) {
+		ret = cg_env_get_init_pid(EID(h), &pid);
+		if (ret)
+			goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		jobs[i].param->online = is_disk_image_mounted(jobs[i].d);
+		logger(0, 0, "Resize the disk %s to %luK%s", jobs[i].param->uuid,
+				jobs[i].param->size,
+				jobs[i].param->online ? " online" : "");
+	}
+
+	for (i = 0; i < n; i++) {
+		jobs[i].mntns_pid = is_root_disk(jobs[i].d) ? 0 : pid;
+		tasks[i].fn = resize_job_fn;
+		tasks[i].data = &jobs[i];
+		tasks[i].started = resize_job_started;
+		tasks[i].finished = resize_job_finished;
+	}
+
+	vzctl2_exec_tasks(tasks, n, max_jobs);
+
+	for (i = 0; i < n; i++)
+		if (param[i].state != VZCTL_RESIZE_DONE)
+			failed++;
+
+	if (failed)
+		ret = vzctl_err(VZCTL_E_RESIZE_IMAGE, 0,
+				"Failed to resize %d of %d disk(s)", failed, n);
+
+out:
+	free(jobs);
+	free(tasks);
+
+	return ret;
+}
+
 int vzctl2_set_disk(struct vzctl_env_handle *h, struct vzctl_disk_param *param)
 {
 	int ret;
@@ -1534,6 +1799,12 @@ int vzctl2_set_disk(struct vzctl_env_handle *h, struct vzctl_disk_param *param)
 	if (param->autocompact)
 		d->autocompact = param->autocompact;
 
+	if (param->iolimit || param->iopslimit) {
+		ret = set_disk_io_limit(h, d, param->iolimit, param->iopslimit);
+		if (ret)
+			return ret;
+	}
+
 	if (param->path) {
 		logger(0, 0, "Update image path %s -> %s",
 				d->path, param->path);
@@ -1556,28 +1827,96 @@ int vzctl_setup_disk(struct vzctl_env_handle *h, struct vzctl_env_disk *env_disk
 {
 	int ret;
 	struct vzctl_disk *disk;
+	struct sysfs_perm_set perms;
 	int configured = 0;
+	/* fstab and mount units are reconciled for all disks at once
+	 * by fin_configure_disk()
+	 */
+	int defer = !(flags & VZCTL_RESTORE);
 
 	if (env_disk == NULL || list_empty(&env_disk->disks))
 		return 0;
 
+	/* Collect sysfs permissions of all disks and push them in one go,
+	 * they have to be in place before the in-CT configuration.
+	 */
+	sysfs_perm_init(&perms);
 	list_for_each(disk, &env_disk->disks, list) {
+		disk->configured = 0;
 		if (disk->enabled == VZCTL_PARAM_OFF)
 			continue;
 
+		perms.owner = disk;
+		ret = prepare_disk(h, disk, flags, &perms);
+		if (ret && is_permanent_disk(disk))
+			goto err;
+
+		disk->configured = (ret == 0);
+		/* do not expose sysfs of the disk that is skipped */
+		if (!disk->configured)
+			sysfs_perm_drop(&perms, disk);
+	}
+
+	/* The rules are applied best effort, a failure is accounted
+	 * to the disk the rule belongs to.
+	 */
+	sysfs_perm_apply(h, &perms);
+	list_for_each(disk, &env_disk->disks, list) {
+		if (!disk->configured || !sysfs_perm_failed(&perms, disk))
+			continue;
+
+		if (is_permanent_disk(disk)) {
+			ret = VZCTL_E_DISK_CONFIGURE;
+			goto err;
+		}
+		disk->configured = 0;
+	}
+	sysfs_perm_free(&perms);
+
+	list_for_each(disk, &env_disk->disks, list) {
+		if (!disk->configured)
+			continue;
+
+		/* the in-CT configuration is skipped, keep the disk out of
+		 * the IO limits and the fstab/mount unit reconcile
+		 */
+		if (flags & VZCTL_SKIP_CONFIGURE) {
+			disk->configured = 0;
+			continue;
+		}
+
+		configured = 1;
+
 		int automount = (disk->dmname && !is_root_disk(disk)) ? 1 : 0;
 
-		ret = do_setup_disk(h, disk, flags, automount);
+		ret = configure_disk(h, disk, flags, automount, defer);
 		if (ret && is_permanent_disk(disk))
 			return ret;
 
-		configured = 1;
+		disk->configured = (ret == 0);
 	}
 
-	if (!(flags & VZCTL_RESTORE) && configured)
-		fin_configure_disk(h, env_disk);
+	ret = apply_disk_io_limits(h, env_disk);
+	if (ret)
+		return ret;
+
+	if (defer && configured) {
+		ret = fin_configure_disk(h, env_disk);
+		if (ret) {
+			/* the disks are finalized at once, fail if any of
+			 * them is permanent as configure_disk() used to */
+			list_for_each(disk, &env_disk->disks, list)
+				if (disk->configured && is_permanent_disk(disk))
+					return ret;
+		}
+	}
 
 	return 0;
+
+err:
+	sysfs_perm_free(&perms);
+
+	return ret;
 }
 
 int is_external_disk(const char *path)
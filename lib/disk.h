@@ -64,7 +64,10 @@ struct vzctl_disk {
 	dev_t dm_dev;
 	char *enc_keyid;
 	int updated;
+	int configured;		/* set up on the last vzctl_setup_disk() */
 	disk_type type;
+	unsigned int iolimit;	/* B/s, 0 - unlimited */
+	unsigned int iopslimit;
 };
 
 struct vzctl_env_disk {
@@ -78,13 +81,14 @@ const char *get_fs_partname(struct vzctl_disk *disk);
 dev_t get_fs_partdev(struct vzctl_disk *disk);
 int configure_mount_opts(struct vzctl_env_handle *h, struct vzctl_disk *disk);
 int configure_disk(struct vzctl_env_handle *h, struct vzctl_disk *disk,
-		int flags, int automount);
+		int flags, int automount, int defer_mnt_configure);
 void free_disk_param(struct vzctl_disk_param *disk);
 void free_disk(struct vzctl_disk *disk);
 void free_env_disk(struct vzctl_env_disk *env_disk);
 int configure_disk_perm(struct vzctl_env_handle *h, struct vzctl_disk *disk,
 		int del);
 int update_disk_info(struct vzctl_env_handle *h, struct vzctl_disk *disk);
+struct vzctl_disk *find_disk(struct vzctl_env_disk *env_disk, const char *uuid);
 struct vzctl_env_disk *alloc_env_disk(void);
 struct vzctl_disk *find_root_disk(const struct vzctl_env_disk *env_disk);
 int is_secondary_disk_present(const struct vzctl_env_disk *env_disk);
@@ -100,6 +104,9 @@ int vzctl2_del_disk(struct vzctl_env_handle *h, const char *guid, int flags);
 int vzctl2_set_disk(struct vzctl_env_handle *h, struct vzctl_disk_param *param);
 int vzctl2_resize_disk(struct vzctl_env_handle *h, const char *guid,
 		unsigned long size, int offline);
+int vzctl2_resize_disks(struct vzctl_env_handle *h,
+		struct vzctl_disk_resize_param *param, int n, int max_jobs,
+		vzctl_resize_progress_f cb, void *data);
 int vzctl_setup_disk(struct vzctl_env_handle *h, struct vzctl_env_disk *env_disk, int flags);
 int get_fs_uuid(const char *device, struct vzctl_disk *disk);
 int env_fin_configure_disk(struct vzctl_env_disk *disk);
@@ -51,6 +51,14 @@ struct exec_disk_param {
 	int automount;
 	char *partname;
 	dev_t partdev;
+	int defer_mnt_configure;
+};
+
+struct exec_fin_disk_param {
+	struct vzctl_env_disk *env_disk;
+	struct vzctl_disk **disks;	/* disks to configure mount entry for */
+	int n;
+	int configure_unit;
 };
 
 int get_fs_uuid(const char *device, struct vzctl_disk *disk)
@@ -99,9 +107,19 @@ int get_fs_uuid(const char *device, struct vzctl_disk *disk)
 	return 0;
 }
 
+static void get_fstab_entry(char *buf, int size, const char *uuid,
+		const char *mnt, const char *opts)
+{
+	snprintf(buf, size, "UUID=%s %s ext4 %s 0 0\n", uuid, mnt,
+			opts ? opts : "defaults");
+}
+
 static int write_fstab_entry(FILE *fp, const char *uuid, const char *mnt, const char *opts)
 {
-	if (fprintf(fp, "UUID=%s %s ext4 %s 0 0\n", uuid, mnt, opts ? opts : "defaults") == -1)
+	char buf[4096];
+
+	get_fstab_entry(buf, sizeof(buf), uuid, mnt, opts);
+	if (fputs(buf, fp) == EOF)
 		return vzctl_err(-1, errno, "Failed to update /etc/fstab");
 	return 0;
 }
@@ -229,13 +247,35 @@ static void get_systemd_mount_unit_name(const char *mnt, char *name)
 	strcat(name, SYSTEMD_MOUNT_UNIT_SUFFIX);
 }
 
+static int get_systemd_unit_data(const char *uuid, const char *mnt,
+		const char *opts, char *buf, int size)
+{
+	char options[PATH_MAX] = "";
+
+	if (opts)
+		snprintf(options, sizeof(options), "Options=%s\n", opts);
+
+	return snprintf(buf, size, "[Unit]\n" \
+SYSTEMD_UNIT_DESC "%s mount unit\n" \
+"DefaultDependencies=no\n" \
+"Before=vzfifo.service\n" \
+"\n" \
+"[Mount]\n" \
+"What=/dev/disk/by-uuid/%s\n" \
+"Where=%s\n" \
+"%s" \
+"\n" \
+"[Install]\n" \
+"WantedBy=multi-user.target\n", uuid, uuid, mnt, options);
+}
+
 static int env_configure_systemd_unit(const char *uuid, const char *mnt, const char *opts)
 {
 	int err = -1;
 	char systemd_unit_name[PATH_MAX];
 	char systemd_unit_path[PATH_MAX];
 	char systemd_link_path[PATH_MAX];
-	char options[PATH_MAX] = "";
+	char data[PATH_MAX * 2];
 	FILE *wfp;
 
 	logger(1, 0, "Configure systemd mount unit uuid=%s %s", uuid, mnt);
@@ -250,21 +290,8 @@ static int env_configure_systemd_unit(const char *uuid, const char *mnt, const c
 	if (wfp == NULL)
 		return vzctl_err(-1, errno, "Unable to create %s", systemd_unit_path);
 
-	if (opts)
-		snprintf(options, sizeof(options), "Options=%s\n", opts);
-
-	if (fprintf(wfp, "[Unit]\n" \
-SYSTEMD_UNIT_DESC "%s mount unit\n" \
-"DefaultDependencies=no\n" \
-"Before=vzfifo.service\n" \
-"\n" \
-"[Mount]\n" \
-"What=/dev/disk/by-uuid/%s\n" \
-"Where=%s\n" \
-"%s" \
-"\n" \
-"[Install]\n" \
-"WantedBy=multi-user.target\n", uuid, uuid, mnt, options) == -1) {
+	get_systemd_unit_data(uuid, mnt, opts, data, sizeof(data));
+	if (fputs(data, wfp) == EOF) {
 		logger(-1,  errno, "Unable to write to %s", systemd_unit_path);
 		goto err;
 	}
@@ -403,7 +430,7 @@ static int env_configure_disk(struct exec_disk_param *param)
 		if (access(disk->mnt, F_OK))
 			make_dir(disk->mnt, 1);
 
-		if (disk->dmname)
+		if (disk->dmname || param->defer_mnt_configure)
 			goto skip_configure;
 
 		if (is_systemd()) {
@@ -431,7 +458,7 @@ skip_configure:
 }
 
 int configure_disk(struct vzctl_env_handle *h, struct vzctl_disk *disk,
-		int flags, int automount)
+		int flags, int automount, int defer_mnt_configure)
 {
 	char partname[PATH_MAX + 1];
 	struct exec_disk_param param = {
@@ -440,6 +467,7 @@ int configure_disk(struct vzctl_env_handle *h, struct vzctl_disk *disk,
 		.automount = (flags & VZCTL_RESTORE) ? 0 : automount,
 		.partname = partname,
 		.partdev = get_fs_partdev(disk),
+		.defer_mnt_configure = defer_mnt_configure,
 	};
 
 	if (realpath(get_fs_partname(disk), partname) == NULL)
@@ -463,64 +491,194 @@ static struct vzctl_disk *find_disk_by_fsuuid(struct vzctl_env_disk *env_disk, c
 	return NULL;
 }
 
-static int env_fin_configure_fstab(struct vzctl_env_disk *env_disk)
+static int is_mnt_configurable(struct vzctl_disk *disk)
 {
-	FILE *rfp = NULL, *wfp;
+	return (disk->mnt != NULL && !is_root_disk(disk) &&
+			disk->dmname == NULL && disk->fsuuid[0] != '\0');
+}
+
+static int find_fin_disk(struct exec_fin_disk_param *param, const char *fsuuid)
+{
+	int i;
+
+	for (i = 0; i < param->n; i++)
+		if (!strcmp(param->disks[i]->fsuuid, fsuuid))
+			return i;
+
+	return -1;
+}
+
+/* Compute the desired /etc/fstab for the whole disk set and rewrite
+ * the file once, only if it differs:
+ *  - entries of configured disks are added or updated
+ *  - entries of unknown ploop disks are removed
+ */
+static int env_reconcile_fstab(struct exec_fin_disk_param *param, int configure)
+{
+	FILE *rfp, *mfp;
 	struct stat st;
-	int err = -1;
+	int i, err = -1, changed = 0;
 	char buf[4096];
+	char entry[4096];
 	char fsuuid[39];
+	char *data = NULL;
+	size_t len = 0;
+	char *done;
 
-	rfp = fopen("/etc/fstab", "r");
-	if (rfp == NULL)
+	done = calloc(param->n + 1, 1);
+	if (done == NULL)
+		return vzctl_err(-1, ENOMEM, "env_reconcile_fstab");
+
+	rfp = fopen("/etc/fstab", configure ? "a+" : "r");
+	if (rfp == NULL) {
+		free(done);
 		return vzctl_err(-1, errno, "Unable to open /etc/fstab");
+	}
 
 	if (fstat(fileno(rfp), &st)) {
-		fclose(rfp);
-		return vzctl_err(-1, errno, "Failed to stat /etc/fstab");
+		logger(-1, errno, "Failed to stat /etc/fstab");
+		goto err_close;
 	}
 
-	wfp = fopen("/etc/fstab.tmp", "w+");
-	if (wfp == NULL) {
-		fclose(rfp);
-		return vzctl_err(-1, errno, "Unable to create /etc/fstab.tmp");
+	mfp = open_memstream(&data, &len);
+	if (mfp == NULL) {
+		logger(-1, errno, "open_memstream");
+		goto err_close;
 	}
 
-	set_fattr(fileno(wfp), &st);
-
-	while (!feof(rfp)) {
-		if (fgets(buf, sizeof(buf), rfp) == NULL) {
-			if (ferror(rfp)) {
-				logger(-1, 0, "Failed to read /etc/fstab");
-				goto err;
-			}
-			break;
+	while (fgets(buf, sizeof(buf), rfp) != NULL) {
+		if (get_fsuuid(buf, fsuuid) == NULL) {
+			fputs(buf, mfp);
+			continue;
 		}
 
-		if (get_fsuuid(buf, fsuuid) == NULL ||
-				find_disk_by_fsuuid(env_disk, fsuuid) != NULL)
-		{
-			if (fprintf(wfp, "%s", buf) == -1) {
-				logger(-1,  errno, "Unable to write to /etc/fstab.tmp");
-				goto err;
+		i = configure ? find_fin_disk(param, fsuuid) : -1;
+		if (i != -1) {
+			struct vzctl_disk *d = param->disks[i];
+
+			if (done[i]) {
+				/* drop duplicate */
+				changed = 1;
+				continue;
 			}
-		}
+			done[i] = 1;
+			get_fstab_entry(entry, sizeof(entry), d->fsuuid,
+					d->mnt, d->mnt_opts);
+			if (strcmp(entry, buf))
+				changed = 1;
+			if (write_fstab_entry(mfp, d->fsuuid, d->mnt, d->mnt_opts))
+				goto err;
+		} else if (find_disk_by_fsuuid(param->env_disk, fsuuid) != NULL) {
+			fputs(buf, mfp);
+		} else
+			changed = 1;
 	}
 
-	if (rename("/etc/fstab.tmp", "/etc/fstab")) {
-		logger(-1, errno, "Failed to rename  /etc/fstab.tmp");
+	if (ferror(rfp)) {
+		logger(-1, 0, "Failed to read /etc/fstab");
 		goto err;
 	}
 
+	for (i = 0; configure && i < param->n; i++) {
+		if (done[i])
+			continue;
+		logger(1, 0, "Configure fstab uuid=%s %s",
+				param->disks[i]->fsuuid, param->disks[i]->mnt);
+		if (write_fstab_entry(mfp, param->disks[i]->fsuuid,
+					param->disks[i]->mnt,
+					param->disks[i]->mnt_opts))
+			goto err;
+		changed = 1;
+	}
+
+	if (fclose(mfp)) {
+		mfp = NULL;
+		logger(-1, errno, "Failed to update /etc/fstab");
+		goto err;
+	}
+	mfp = NULL;
+
 	err = 0;
+	if (changed)
+		err = write_file_atomic("/etc/fstab", "/etc/fstab.tmp",
+				data, len, &st);
+
 err:
-	fclose(wfp);
+	if (mfp != NULL)
+		fclose(mfp);
+	free(data);
+err_close:
 	fclose(rfp);
-	unlink("/etc/fstab.tmp");
+	free(done);
 
 	return err;
 }
 
+/* Write the unit only if its content is changed,
+ * @return 1 if the unit directory was updated.
+ */
+static int env_reconcile_systemd_unit(struct vzctl_disk *disk)
+{
+	char name[PATH_MAX];
+	char path[PATH_MAX];
+	char link[PATH_MAX];
+	char tmp[PATH_MAX];
+	char data[PATH_MAX * 2];
+	char cur[PATH_MAX * 2];
+	int n, fd, updated = 0;
+
+	get_systemd_mount_unit_name(disk->mnt, name);
+	snprintf(path, sizeof(path), SYSTEMD_DIR "/%s", name);
+	snprintf(link, sizeof(link), SYSTEMD_TARGET_DIR "/%s", name);
+
+	n = get_systemd_unit_data(disk->fsuuid, disk->mnt, disk->mnt_opts,
+			data, sizeof(data));
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		int r = read(fd, cur, sizeof(cur));
+
+		close(fd);
+		if (r == n && memcmp(cur, data, n) == 0)
+			goto link;
+	}
+
+	logger(1, 0, "Configure systemd mount unit uuid=%s %s",
+			disk->fsuuid, disk->mnt);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (write_file_atomic(path, tmp, data, n, NULL))
+		return -1;
+	updated = 1;
+
+link:
+	n = readlink(link, cur, sizeof(cur) - 1);
+	if (n > 0) {
+		cur[n] = '\0';
+		if (!strcmp(cur, path))
+			return updated;
+	}
+
+	unlink(link);
+	if (symlink(path, link))
+		logger(-1, errno, "Failed to create link %s", link);
+
+	return 1;
+}
+
+static int sync_dir(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return vzctl_err(-1, errno, "Unable to open %s", path);
+	if (fsync(fd))
+		logger(-1, errno, "Unable to fsync %s", path);
+	close(fd);
+
+	return 0;
+}
+
 static int is_ploop_unit(const char *path)
 {
 	FILE *rfp = NULL;
@@ -616,23 +774,79 @@ static int env_fin_configure_systemd_unit(struct vzctl_env_disk *env_disk)
 	return err;
 }
 
-int env_fin_configure_disk(struct vzctl_env_disk *disk)
+static int env_reconcile_disk(struct exec_fin_disk_param *param)
 {
+	int i, ret, updated = 0;
+
 	if (is_systemd()) {
-		if (env_fin_configure_systemd_unit(disk))
+		for (i = 0; param->configure_unit && i < param->n; i++) {
+			ret = env_reconcile_systemd_unit(param->disks[i]);
+			if (ret == -1)
+				return VZCTL_E_DISK_CONFIGURE;
+			updated |= ret;
+		}
+
+		if (env_fin_configure_systemd_unit(param->env_disk))
 			return VZCTL_E_DISK_CONFIGURE;
-	}
 
-	if (access("/etc/fstab", F_OK) == 0 && env_fin_configure_fstab(disk))
-		return VZCTL_E_DISK_CONFIGURE;
+		if (updated) {
+			sync_dir(SYSTEMD_DIR);
+			sync_dir(SYSTEMD_TARGET_DIR);
+		}
+
+		if (access("/etc/fstab", F_OK) == 0 &&
+				env_reconcile_fstab(param, 0))
+			return VZCTL_E_DISK_CONFIGURE;
+	} else {
+		if ((param->n || access("/etc/fstab", F_OK) == 0) &&
+				env_reconcile_fstab(param, 1))
+			return VZCTL_E_DISK_CONFIGURE;
+	}
 
 	return 0;
 }
 
+int env_fin_configure_disk(struct vzctl_env_disk *disk)
+{
+	struct exec_fin_disk_param param = {
+		.env_disk = disk,
+	};
+
+	return env_reconcile_disk(&param);
+}
+
+/* Finalize in-CT mount configuration for the whole disk set:
+ * fstab entries and systemd mount units of the configured disks are
+ * reconciled in a single pass, the stale ones are removed.
+ */
 int fin_configure_disk(struct vzctl_env_handle *h, struct vzctl_env_disk *disk)
 {
-	if (vzctl_env_exec_fn(h, (execFn) env_fin_configure_disk, disk,
-				VZCTL_SCRIPT_EXEC_TIMEOUT))
+	int ret, n = 0;
+	struct vzctl_disk *d;
+	struct exec_fin_disk_param param = {
+		.env_disk = disk,
+		/* skip unit configure for runing CT #PSBM-33596 */
+		.configure_unit = (h->ctx->state == VZCTL_STATE_STARTING),
+	};
+
+	list_for_each(d, &disk->disks, list)
+		n++;
+
+	param.disks = calloc(n + 1, sizeof(struct vzctl_disk *));
+	if (param.disks == NULL)
+		return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "fin_configure_disk");
+
+	list_for_each(d, &disk->disks, list) {
+		if (d->enabled == VZCTL_PARAM_OFF || !d->configured ||
+				!is_mnt_configurable(d))
+			continue;
+		param.disks[param.n++] = d;
+	}
+
+	ret = vzctl_env_exec_fn(h, (execFn) env_reconcile_disk, &param,
+				VZCTL_SCRIPT_EXEC_TIMEOUT);
+	free(param.disks);
+	if (ret)
 		return vzctl_err(VZCTL_E_DISK_CONFIGURE, 0,
 				"Failed to finalize disk configure");
 	return 0;
@@ -41,7 +41,6 @@
 #include <sys/personality.h>
 #include <time.h>
 #include <grp.h>
-#include <sys/utsname.h>
 #include <mntent.h>
 #include <uuid/uuid.h>
 #include <ext2fs/ext2_fs.h>
@@ -64,6 +63,8 @@
 #include "vzctl_param.h"
 #include "veth.h"
 #include "ub.h"
+#include "hostcap.h"
+#include "arpsend.h"
 #include "dist.h"
 #include "vztypes.h"
 #include "lock.h"
@@ -146,10 +147,39 @@ static int run_start_script(struct vzctl_env_handle *h)
 	return vzctl2_wrap_exec_script(arg, env, 0);
 }
 
+/* Remove node routes and proxy entries of the IPs saved by vz-net_add */
+static int release_venet_routes(struct vzctl_env_handle *h)
+{
+	char fname[PATH_MAX];
+	char buf[4096];
+	FILE *fp;
+	int ret = 0;
+	LIST_HEAD(ip);
+
+	snprintf(fname, sizeof(fname), VE_STATE_DIR "/%s", EID(h));
+	fp = fopen(fname, "r");
+	if (fp == NULL)
+		return errno == ENOENT ? 0 : -1;
+
+	while (fscanf(fp, "%4095s", buf) == 1) {
+		if (add_ip_param_str(&ip, buf) == NULL) {
+			ret = -1;
+			break;
+		}
+	}
+	fclose(fp);
+
+	if (ret == 0)
+		ret = venet_ip_ctl(VE_IP_DEL, &ip, NULL);
+	free_ip(&ip);
+
+	return ret;
+}
+
 int run_stop_script(struct vzctl_env_handle *h)
 {
 	char buf[STR_SIZE];
-	char *env[4];
+	char *env[5];
 	char s_veid[STR_SIZE];
 	char env_bandwidth[STR_SIZE];
 	int i = 0;
@@ -158,6 +188,8 @@ int run_stop_script(struct vzctl_env_handle *h)
 
 	snprintf(s_veid, sizeof(s_veid), "VEID=%s", EID(h));
 	env[i++] = s_veid;
+	if (release_venet_routes(h) == 0)
+		env[i++] = "VENET_ROUTE=native";
 	if (h->env_param->vz->tc->traffic_shaping == VZCTL_PARAM_ON) {
 		env[i++] = "TRAFFIC_SHAPING=yes";
 		/* BANDWIDTH is needed for tc class removal */
@@ -333,15 +365,15 @@ static int get_virt_osrelease(struct vzctl_env_handle *h)
 	int cur_a, cur_b, cur_c;
 	char tm_osrelease[STR_SIZE];
 	char osrelease[STR_SIZE];
-	struct utsname utsbuf;
+	const char *kver = get_host_caps()->kver;
 	const char *tail;
 	const char *ostmpl = h->env_param->tmpl->ostmpl;
 
 	if (h->env_param->tmpl->osrelease != NULL || ostmpl == NULL)
 		return 0;
 
-	if (uname(&utsbuf) != 0)
-		return vzctl_err(-1, errno, "uname() failed");
+	if (kver[0] == '\0')
+		return vzctl_err(-1, 0, "Unable to get node release");
 
 	ret = vztmpl_get_osrelease(ostmpl, tm_osrelease, sizeof(tm_osrelease));
 	if (ret)
@@ -351,11 +383,11 @@ static int get_virt_osrelease(struct vzctl_env_handle *h)
 		return 0;
 
 	logger(2, 0, "Template %s osrelease: %s", ostmpl, tm_osrelease);
-	ret = sscanf(utsbuf.release, "%d.%d.%d",
+	ret = sscanf(kver, "%d.%d.%d",
 			&cur_a, &cur_b, &cur_c);
 	if (ret != 3)
 		return vzctl_err(-1, 0, "Unable to parse node release: %s",
-				utsbuf.release);
+				kver);
 
 	ret = sscanf(tm_osrelease, "%d.%d.%d:%d.%d.%d",
 			&min_a, &min_b, &min_c,
@@ -371,7 +403,7 @@ static int get_virt_osrelease(struct vzctl_env_handle *h)
 	}
 
 	/* Make kernel version Vz specific like A.B.C-028stab070.1 */
-	tail = strchr(utsbuf.release, '-');
+	tail = strchr(kver, '-');
 
 	snprintf(osrelease, sizeof(osrelease), "%d.%d.%d%s",
 			cur_a, cur_b, cur_c, tail ? tail : "");
@@ -1170,6 +1202,25 @@ static int _announce_ips(pid_t pid)
 	return vzctl2_wrap_exec_script(arg, NULL, 0);
 }
 
+/* Send gratuitous ARP and unsolicited NA for all CT addresses
+ * from the CT network namespace
+ */
+static int _announce_ips_native(pid_t pid)
+{
+	char root[PATH_MAX];
+	struct arpsend_ctx arp;
+	int ret;
+
+	snprintf(root, sizeof(root), "/proc/%d/root", pid);
+	arpsend_init(&arp);
+	ret = arpsend_add_env_addrs(&arp, root);
+	if (ret == 0)
+		ret = arpsend_run(&arp, ARPSEND_UPDATE, 0);
+	arpsend_free(&arp);
+
+	return ret;
+}
+
 static int announce_ips(struct vzctl_env_handle *h)
 {
 	int ret;
@@ -1178,7 +1229,7 @@ static int announce_ips(struct vzctl_env_handle *h)
 	pid = fork();
 	if (pid == 0) {
 		ret = enter_net_ns(h, &ct_pid);
-		if (ret == 0)
+		if (ret == 0 && _announce_ips_native(ct_pid))
 			ret = _announce_ips(ct_pid);
 
 		_exit(ret);
@@ -2478,6 +2529,8 @@ int vzctl2_env_get_disk_param(struct vzctl_disk *disk, struct vzctl_disk_param *
 	tmp.storage_url = disk->storage_url;
 	tmp.use_device = disk->use_device;
 	tmp.enc_keyid = disk->enc_keyid;
+	tmp.iolimit = disk->iolimit;
+	tmp.iopslimit = disk->iopslimit;
 
 	memcpy(out, &tmp, size);
 
@@ -2594,6 +2647,19 @@ int vzctl2_env_resize_disk(struct vzctl_env_handle *h, const char *uuid,
 	return save_disk_param(h);
 }
 
+int vzctl2_env_resize_disks(struct vzctl_env_handle *h,
+		struct vzctl_disk_resize_param *param, int n, int max_jobs,
+		vzctl_resize_progress_f cb, void *data)
+{
+	int ret, ret2;
+
+	ret = vzctl2_resize_disks(h, param, n, max_jobs, cb, data);
+	/* save sizes of the disks that were resized */
+	ret2 = save_disk_param(h);
+
+	return ret ? ret : ret2;
+}
+
 int vzctl2_env_get_ostemplate(struct vzctl_env_param *env, const char **res)
 {
 	if (env->tmpl->ostmpl == NULL)
@@ -3085,86 +3151,104 @@ static unsigned long long get_env_run_uptime(struct vzctl_env_handle *h)
 }
 
 #define CT_UPTIME_FILENAME	".uptime"
+#define PROC_VESTAT		"/proc/vz/vestat"
 
-static int get_env_uptime(struct vzctl_env_handle *h,
-	unsigned long long *uptime, unsigned long long *start_time,
-	unsigned long long *run_uptime_jif)
+/* .uptime layout: run-time watermark, uptime, start date and
+ * "csum <hex>" of the first three lines; files written before the
+ * checksum was introduced have no fourth line.
+ */
+static int read_uptime_file(const char *ve_private,
+	unsigned long long *run_uptime, unsigned long long *uptime,
+	unsigned long long *start_time)
 {
-	int i, found, expected;
-	char buf[4096];
-	FILE *f;
+	char fname[PATH_MAX];
+	char buf[256];
+	unsigned int csum;
+	int len, fd, n;
+	char *p;
 
-	snprintf(buf, sizeof(buf), "%s/%s", h->env_param->fs->ve_private,
-			CT_UPTIME_FILENAME);
-	f = fopen(buf, "r");
-	if (!f) {
+	snprintf(fname, sizeof(fname), "%s/" CT_UPTIME_FILENAME, ve_private);
+	fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
 		if (errno == ENOENT)
 			return VZCTL_E_SYSTEM;
 		return vzctl_err(VZCTL_E_SYSTEM, errno,
 			"Uptime information can't be read from disk");
 	}
+	len = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf) - 1));
+	close(fd);
+	if (len < 0)
+		return vzctl_err(VZCTL_E_SYSTEM, errno,
+			"Uptime information can't be read from disk");
+	buf[len] = '\0';
 
-	expected = 0;
-	if (uptime)
-		expected++;
-	if (start_time)
-		expected++;
-	if (run_uptime_jif)
-		expected++;
-	found = 0;
-	for (i = 0; !feof(f) && i < 3; i++) {
-		if (!fgets(buf, sizeof(buf), f))
-			break;
+	if (sscanf(buf, "%llu\n%llu\n%llu\n%n", run_uptime, uptime,
+				start_time, &n) != 3)
+		return vzctl_err(VZCTL_E_SYSTEM, ENOENT,
+			"Uptime information is incomplete");
 
-		if (i == 0 && run_uptime_jif) {
-			*run_uptime_jif = atoll(buf);
-			found++;
-		} else if (i == 1 && uptime) {
-			*uptime = atoll(buf);
-			found++;
-		} else if (i == 2 && start_time) {
-			*start_time = atoll(buf);
-			found++;
-		}
+	p = buf + n;
+	if (*p != '\0') {
+		if (sscanf(p, "csum %x", &csum) != 1 ||
+				csum != fnv_hash(buf, n))
+			return vzctl_err(VZCTL_E_SYSTEM, 0,
+				"Uptime information is corrupted");
 	}
-	fclose(f);
 
-	if (found != expected)
-		return vzctl_err(VZCTL_E_SYSTEM, ENOENT,
-			"Uptime information is incomplete");
 	return 0;
 }
 
-int vzctl2_env_set_uptime(struct vzctl_env_handle *h, unsigned long long uptime,
+static int write_uptime_file(const char *ve_private,
+	unsigned long long run_uptime, unsigned long long uptime,
 	unsigned long long start_date)
 {
-	char buf[4096];
-	FILE *f;
-
-	snprintf(buf, sizeof(buf), "%s/%s", h->env_param->fs->ve_private,
-			CT_UPTIME_FILENAME);
-	f = fopen(buf, "w+");
-	if (!f)
-		return vzctl_err(VZCTL_E_SYSTEM, errno,
+	char fname[PATH_MAX];
+	char tmp[PATH_MAX];
+	char buf[256];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%llu\n%llu\n%llu\n",
+			run_uptime, uptime, start_date);
+	len += snprintf(buf + len, sizeof(buf) - len, "csum %08x\n",
+			fnv_hash(buf, len));
+
+	snprintf(fname, sizeof(fname), "%s/" CT_UPTIME_FILENAME, ve_private);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+	if (write_file_atomic(fname, tmp, buf, len, NULL))
+		return vzctl_err(VZCTL_E_SYSTEM, 0,
 			"Uptime information can't be stored to disk");
 
-	/* current run-time watermark */
-	snprintf(buf, sizeof(buf), "%llu\n",
-		get_env_run_uptime(h));
-	fputs(buf, f);
+	return 0;
+}
 
-	/* save uptime */
-	snprintf(buf, sizeof(buf), "%llu\n", uptime);
-	fputs(buf, f);
+static int get_env_uptime(struct vzctl_env_handle *h,
+	unsigned long long *uptime, unsigned long long *start_time,
+	unsigned long long *run_uptime_jif)
+{
+	unsigned long long run, up, start;
+	int ret;
+
+	ret = read_uptime_file(h->env_param->fs->ve_private, &run, &up, &start);
+	if (ret)
+		return ret;
 
-	/* reset start date */
-	snprintf(buf, sizeof(buf), "%llu\n", start_date);
-	fputs(buf, f);
+	if (uptime)
+		*uptime = up;
+	if (start_time)
+		*start_time = start;
+	if (run_uptime_jif)
+		*run_uptime_jif = run;
 
-	fclose(f);
 	return 0;
 }
 
+int vzctl2_env_set_uptime(struct vzctl_env_handle *h, unsigned long long uptime,
+	unsigned long long start_date)
+{
+	return write_uptime_file(h->env_param->fs->ve_private,
+			get_env_run_uptime(h), uptime, start_date);
+}
+
 int vzctl2_env_reset_uptime(struct vzctl_env_handle *h)
 {
 	return vzctl2_env_set_uptime(h, 0, time(NULL));
@@ -3176,24 +3260,93 @@ int vzctl2_env_get_uptime(struct vzctl_env_handle *h, unsigned long long *uptime
 	return get_env_uptime(h, uptime, date_time, NULL);
 }
 
-int vzctl2_env_sync_uptime(struct vzctl_env_handle *h)
+static int sync_uptime(const char *ve_private, unsigned long long run_uptime)
 {
-	unsigned long long uptime, start_date;
-	unsigned long long old_run_uptime, run_uptime;
-	int ret;
+	unsigned long long uptime, start_date, old_run_uptime;
 
-	ret = get_env_uptime(h, &uptime, &start_date, &old_run_uptime);
-	if (ret) {
+	if (read_uptime_file(ve_private, &old_run_uptime, &uptime, &start_date))
 		/* failed to retrieve uptime - initialize it */
-		return vzctl2_env_set_uptime(h, 0, time(NULL));
-	}
+		return write_uptime_file(ve_private, run_uptime, 0, time(NULL));
 
-	run_uptime = get_env_run_uptime(h);
 	if (run_uptime < old_run_uptime)
 		old_run_uptime = 0; /* restart detected */
 	uptime += run_uptime - old_run_uptime;
 
-	return vzctl2_env_set_uptime(h, uptime, start_date);
+	return write_uptime_file(ve_private, run_uptime, uptime, start_date);
+}
+
+int vzctl2_env_sync_uptime(struct vzctl_env_handle *h)
+{
+	return sync_uptime(h->env_param->fs->ve_private, get_env_run_uptime(h));
+}
+
+static char *get_env_private(const ctid_t ctid, const char *ve_private_orig)
+{
+	char path[PATH_MAX];
+	struct vzctl_conf_simple conf = {};
+	char *ve_private = NULL;
+
+	vzctl2_get_env_conf_path(ctid, path, sizeof(path));
+	if (vzctl_parse_conf_simple(ctid, path, &conf))
+		return NULL;
+
+	if (conf.ve_private != NULL)
+		ve_private = strdup(conf.ve_private);
+	else if (ve_private_orig != NULL)
+		ve_private = subst_VEID(ctid, ve_private_orig);
+	vzctl_free_conf_simple(&conf);
+
+	return ve_private;
+}
+
+int vzctl2_sync_node_uptime(int *nsynced)
+{
+	FILE *fp;
+	char buf[512];
+	char id[STR_SIZE];
+	unsigned long long user, nice, system, uptime_jif;
+	struct vzctl_conf_simple g_conf = {};
+	long clk_tck = sysconf(_SC_CLK_TCK);
+	int failed = 0, synced = 0;
+	ctid_t ctid = {};
+
+	/* one status sweep for all running Containers */
+	fp = fopen(PROC_VESTAT, "r");
+	if (fp == NULL)
+		return vzctl_err(VZCTL_E_SYSTEM, errno,
+				"Unable to open " PROC_VESTAT);
+
+	vzctl_parse_conf_simple(ctid, GLOBAL_CFG, &g_conf);
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		char *ve_private;
+
+		/* VEID user nice system uptime ... */
+		if (sscanf(buf, "%37s %llu %llu %llu %llu", id, &user, &nice,
+					&system, &uptime_jif) != 5 ||
+				!strcmp(id, "0") || vzctl2_parse_ctid(id, ctid))
+			continue;
+
+		ve_private = get_env_private(ctid, g_conf.ve_private_orig);
+		if (ve_private == NULL || stat_file(ve_private) != 1) {
+			free(ve_private);
+			continue;
+		}
+
+		if (sync_uptime(ve_private, uptime_jif / clk_tck))
+			failed++;
+		else
+			synced++;
+		free(ve_private);
+	}
+	fclose(fp);
+	vzctl_free_conf_simple(&g_conf);
+
+	if (nsynced != NULL)
+		*nsynced = synced;
+
+	return failed ? vzctl_err(VZCTL_E_SYSTEM, 0,
+			"Failed to sync uptime of %d Container(s)", failed) : 0;
 }
 
 int vzctl2_env_set_type(struct vzctl_env_param *env, vzctl_env_type type)
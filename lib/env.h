@@ -180,6 +180,7 @@ int wait_env_state(struct vzctl_env_handle *h, int state, unsigned int timeout);
 int get_cid_uuid_pair(const char *ctid, const char *uuid,
 		ctid_t ctid_out, ctid_t uuid_out);
 int enter_net_ns(struct vzctl_env_handle *h, pid_t *ct_pid);
+int set_ns(pid_t pid, const char *name, int flags);
 int run_stop_script(struct vzctl_env_handle *h);
 int vzctl_env_destroy(struct vzctl_env_handle *h, int flags);
 int vzctl_env_stop(struct vzctl_env_handle *h, stop_mode_e stop_mode, int flags);
@@ -128,6 +128,7 @@ static struct vzctl_config_param config_param_map[] = {
 /*	Features	*/
 {"FEATURES",	VZCTL_PARAM_FEATURES},
 {"TECHNOLOGIES",VZCTL_PARAM_TECHNOLOGIES},
+{"CAPABILITY",	VZCTL_PARAM_CAP},
 
 {"NAME",	VZCTL_PARAM_NAME},
 
@@ -142,6 +143,8 @@ static struct vzctl_config_param config_param_map[] = {
 {"IOPRIO",	VZCTL_PARAM_IOPRIO},
 {"IOLIMIT",	VZCTL_PARAM_IOLIMIT},
 {"IOPSLIMIT",	VZCTL_PARAM_IOPSLIMIT},
+{"IOLIMIT_BURST", VZCTL_PARAM_IOLIMIT_BURST},
+{"IOLIMIT_LATENCY", VZCTL_PARAM_IOLIMIT_LATENCY},
 /* Global parameters */
 {"LOCKDIR",	VZCTL_PARAM_LOCKDIR},
 
@@ -478,7 +481,7 @@ static int add_env_param(struct vzctl_env_handle *h, struct vzctl_env_param *env
 		ret = parse_technologies(&env->features->tech, str);
 		break;
 	case VZCTL_PARAM_CAP:
-		/* deprecated */
+		ret = parse_cap(env->cap, str, replace);
 		break;
 	case VZCTL_PARAM_CPUUNITS:
 		if (env->cpu->units != NULL && !replace)
@@ -587,6 +590,12 @@ static int add_env_param(struct vzctl_env_handle *h, struct vzctl_env_param *env
 	case VZCTL_PARAM_IOPSLIMIT:
 		ret = parse_iopslimit(env->io, str);
 		break;
+	case VZCTL_PARAM_IOLIMIT_BURST:
+		ret = parse_io_uint(&env->io->burst, str);
+		break;
+	case VZCTL_PARAM_IOLIMIT_LATENCY:
+		ret = parse_io_uint(&env->io->latency, str);
+		break;
 	case VZCTL_PARAM_MEMINFO:
 		ret = parse_meminfo(env->meminfo, str);
 		break;
@@ -1097,6 +1106,12 @@ static char *env_param2str(struct vzctl_env_handle *h,
 			return strdup(buf);
 		}
 		break;
+	case VZCTL_PARAM_CAP:
+		if (env->cap->on || env->cap->off) {
+			build_cap_str(env->cap, buf, sizeof(buf));
+			return strdup(buf);
+		}
+		break;
 	case VZCTL_PARAM_CPUUNITS:
 		if (env->cpu->units != NULL) {
 			snprintf(buf, sizeof(buf), "%lu",
@@ -1188,6 +1203,18 @@ static char *env_param2str(struct vzctl_env_handle *h,
 			return strdup(buf);
 		}
 		break;
+	case VZCTL_PARAM_IOLIMIT_BURST:
+		if (env->io->burst != UINT_MAX) {
+			snprintf(buf, sizeof(buf), "%u", env->io->burst);
+			return strdup(buf);
+		}
+		break;
+	case VZCTL_PARAM_IOLIMIT_LATENCY:
+		if (env->io->latency != UINT_MAX) {
+			snprintf(buf, sizeof(buf), "%u", env->io->latency);
+			return strdup(buf);
+		}
+		break;
 	case VZCTL_PARAM_MEMINFO:
 		if (env->meminfo->mode != 0)
 			return meminfo2str(env->meminfo);
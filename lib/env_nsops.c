@@ -33,7 +33,6 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <grp.h>
-#include <sys/utsname.h>
 #include <sys/socket.h>
 #include <linux/if.h>
 #include <linux/veth.h>
@@ -57,8 +56,11 @@
 #include "vcmm.h"
 #include "vzctl_param.h"
 #include "sysfs_perm.h"
+#include "io.h"
 #include "exec.h"
 #include "cleanup.h"
+#include "hostcap.h"
+#include "cluster.h"
 
 #ifndef HAVE_SETNS
 
@@ -933,6 +935,9 @@ int set_ns(pid_t pid, const char *name, int flags)
 	ret = setns(fd, flags);
 	if (ret)
 		logger(-1, errno, "Failed to set context for %s", name);
+	else if (!strcmp(name, "mnt"))
+		/* the cached mount table belongs to the old namespace */
+		drop_mnt_cache();
 	close(fd);
 
 	return ret;
@@ -1701,8 +1706,12 @@ static int ns_netdev_ctl(struct vzctl_env_handle *h, int add, const char *dev)
 
 static int ns_set_iolimit(struct vzctl_env_handle *h, unsigned int speed)
 {
-	logger(0, 0, "Set up iolimit: %u", speed);
-	if (cg_env_set_iolimit(EID(h), speed, speed * 3, 10*1000))
+	unsigned int burst, latency;
+
+	get_io_burst(h, speed, &burst, &latency);
+	logger(0, 0, "Set up iolimit: %u burst: %u latency: %ums",
+			speed, burst, latency);
+	if (cg_env_set_iolimit(EID(h), speed, burst, latency))
 		return VZCTL_E_SET_IO;
 
 	return 0;
@@ -1739,8 +1748,12 @@ static int ns_set_ioprio(struct vzctl_env_handle *h, int prio)
 
 static int ns_set_iopslimit(struct vzctl_env_handle *h, unsigned int speed)
 {
-	logger(0, 0, "Set up iopslimit: %u", speed);
-	if (cg_env_set_iopslimit(EID(h), speed, speed * 3, 10*1000))
+	unsigned int burst, latency;
+
+	get_io_burst(h, speed, &burst, &latency);
+	logger(0, 0, "Set up iopslimit: %u burst: %u latency: %ums",
+			speed, burst, latency);
+	if (cg_env_set_iopslimit(EID(h), speed, burst, latency))
 		return VZCTL_E_SET_IO;
 
 	return 0;
@@ -1869,9 +1882,6 @@ static struct vzctl_env_ops env_nsops = {
 
 void env_nsops_init(struct vzctl_env_ops *ops)
 {
-	struct utsname u;
-
-	uname(&u);
-	if (kver_cmp(u.release, "3.9") >= 0)
+	if (has_host_cap(VZCTL_HOSTCAP_NSOPS))
 		memcpy(ops, &env_nsops, sizeof(*ops));
 }
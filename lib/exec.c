@@ -1170,7 +1170,8 @@ static int do_wrap_env_exec_script(struct vzctl_env_handle *h,
 	char *const argv[], char *const envp[], const char *fname,
 	int timeout, int flags,  int use_vz_func, int *retcode)
 {
-	int pid;
+	struct vzctl_exec_task t = {.flags = EXEC_KEEP_STDIO};
+	int ret, failed;
 	char *argv_param[8];
 	char timeout_str[11];
 	char flags_str[11];
@@ -1195,20 +1196,24 @@ static int do_wrap_env_exec_script(struct vzctl_env_handle *h,
 		return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "malloc");
 	}
 
-	pid = vfork();
-	if (pid == -1) {
-		free(argv_new);
-		free(envp_new);
-		return vzctl_err(VZCTL_E_FORK, errno, "Cannot fork");
-	} else if (pid == 0) {
-		execvep(argv_new[0], argv_new, envp_new);
-		vzctl_err(VZCTL_E_EXEC, errno, "failed to exec %s", argv_new[0]);
-		_exit(-1);
-	}
+	t.argv = argv_new;
+	t.envp = envp_new;
+	ret = run_exec_tasks(&t, 1, 1, &failed);
 	free(argv_new);
 	free(envp_new);
+	if (ret)
+		return ret;
 
-	return env_wait(pid, 0, retcode);
+	if (t.status == -1) {
+		logger(-1, 0, "%s was killed by a signal", argv_param[0]);
+		return VZCTL_E_SYSTEM;
+	}
+	if (retcode != NULL) {
+		*retcode = t.status;
+		return 0;
+	}
+
+	return t.status;
 }
 
 int vzctl2_wrap_env_exec_script(struct vzctl_env_handle *h,
@@ -29,7 +29,8 @@ enum {
 	EXEC_OPENPTY = (1 << 17),	/* emulate pty in VE*/
 	EXEC_LOG_OUTPUT = (1 << 18),
 	EXEC_NOENV = (1<< 19),
-	EXEC_QUIET =	(1<<20)
+	EXEC_QUIET =	(1<<20),
+	EXEC_KEEP_STDIO = (1 << 21)	/* the task child keeps std[in,out,err] */
 };
 
 struct exec_param {
@@ -82,6 +83,54 @@ int vzctl2_env_exec_async(struct vzctl_env_handle *h, exec_mode_e exec_mode,
 
 int vzctl2_exec_script(char *const argv[], char *const env[], int flags);
 
+struct vzctl_exec_task;
+typedef void (* vzctl_exec_task_f)(struct vzctl_exec_task *t);
+
+struct vzctl_exec_task {
+	char *const *argv;
+	char *const *envp;
+	/* run fn(data) in the forked child instead of executing argv */
+	execFn fn;
+	void *data;
+	/* fn result buffer, copied back from the child */
+	void *res;
+	int res_size;
+	int timeout;		/* sec, 0 - unlimited */
+	/* argv tasks: EXEC_NOENV, EXEC_QUIET - do not log the failure,
+	 * EXEC_LOG_OUTPUT - stdout and stderr are forwarded to stderr and
+	 * logged, EXEC_KEEP_STDIO - nothing is redirected or captured
+	 */
+	int flags;
+	vzctl_exec_task_f started;	/* called once the child is forked */
+	vzctl_exec_task_f finished;	/* called once the result is known */
+	/* result */
+	int status;		/* exit code, -1 if killed by a signal */
+	int timedout;
+	char err[512];		/* stderr tail of argv tasks */
+	/* private */
+	pid_t pid;
+	int pidfd;
+	int errfd;
+	int resfd;
+	int errlen;
+	int reslen;
+	unsigned long long deadline;
+	struct vzctl_cleanup_hook *hook;
+};
+
+/** Run tasks in parallel, at most max_jobs at once.
+ * Children are waited through pidfds in one poll set.
+ * A task that fails to start gets the error code as its status.
+ *
+ * @param tasks		tasks, the results are filled in.
+ * @param n		number of tasks.
+ * @param max_jobs	parallel limit, 0 - run all at once.
+ * @return		0 if all tasks exited with 0.
+ */
+int vzctl2_exec_tasks(struct vzctl_exec_task *tasks, int n, int max_jobs);
+int run_exec_tasks(struct vzctl_exec_task *tasks, int n, int max_jobs,
+		int *failed);
+
 int vzctl2_env_exec_script(struct vzctl_env_handle *h,
 	char *const argv[], char *const envp[], const char *fname,
 	const char *inc, int timeout, int flags);
@@ -95,6 +144,9 @@ int vzctl2_wrap_env_exec_vzscript(struct vzctl_env_handle *h,
 int vzctl2_wrap_exec_script_rc(char *const argv[], char *const env[], int flags, int *retcode);
 int vzctl2_wrap_exec_script(char *const argv[], char *const envp[], int flags);
 void vzctl_stdredir(int rdfd, int wrfd, int log);
+void initoutput(void);
+void addoutput(char *buf, int len);
+void writeoutput(int level);
 int vzctl_env_exec_fn(struct vzctl_env_handle *h, execFn fn, void *data,
 		int timeout);
 int vzctl_wrap_action(struct vzctl_env_handle *h, char *action,
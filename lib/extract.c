@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "libvzctl.h"
+#include "extract.h"
+#include "exec.h"
+#include "util.h"
+#include "vzerror.h"
+#include "logger.h"
+
+#define TAR_BIN		"/bin/tar"
+#define EXTRACT_PIPE_SZ	(1024 * 1024)
+#define EXTRACT_BLK_SZ	4096ULL
+
+/* Template cache unpacking.
+ * The decompressor and tar are connected with an enlarged pipe, a
+ * parallel decompressor is used when it is installed.
+ */
+struct decompressor {
+	const char *ext;
+	const char *bin;
+	const char *args;
+	/* unpacked size estimate when there is no manifest */
+	int ratio;
+	/* the gzip trailer carries the unpacked size modulo 4G */
+	int isize;
+};
+
+static struct decompressor decompressors[] = {
+	{"gz",		"/usr/bin/pigz",	"-dc",	3,	1},
+	{"gz",		"/bin/gzip",		"-dc",	3,	1},
+	{"tgz",		"/usr/bin/pigz",	"-dc",	3,	1},
+	{"tgz",		"/bin/gzip",		"-dc",	3,	1},
+	{"lz4",		"/usr/bin/lz4",		"-dc",	3,	0},
+	{"lzrw",	"/usr/bin/prlcompress",	"-u",	3,	0},
+	{"zst",		"/usr/bin/pzstd",	"-dc",	3,	0},
+	{"zst",		"/usr/bin/zstd",	"-dc",	3,	0},
+	{"zstd",	"/usr/bin/pzstd",	"-dc",	3,	0},
+	{"zstd",	"/usr/bin/zstd",	"-dc",	3,	0},
+};
+
+static struct decompressor *get_decompressor(const char *tarball)
+{
+	const char *ext;
+	int i, found = 0;
+
+	ext = strrchr(tarball, '.');
+	if (ext == NULL)
+		return NULL;
+	ext++;
+
+	for (i = 0; i < sizeof(decompressors) / sizeof(decompressors[0]); i++) {
+		if (strcmp(ext, decompressors[i].ext))
+			continue;
+		found = 1;
+		if (access(decompressors[i].bin, X_OK) == 0)
+			return &decompressors[i];
+	}
+
+	if (found)
+		logger(-1, 0, "No decompressor found for %s", tarball);
+	else
+		logger(-1, 0, "Unsupported cache format %s", tarball);
+
+	return NULL;
+}
+
+/* <tarball>.manifest: "<size> <name>" per archive member */
+static int read_manifest(const char *tarball, unsigned long long *size)
+{
+	char path[PATH_MAX];
+	char buf[PATH_MAX + 32];
+	unsigned long long n;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s.manifest", tarball);
+	fp = fopen(path, "re");
+	if (fp == NULL)
+		return -1;
+
+	*size = 0;
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (sscanf(buf, "%llu", &n) != 1)
+			continue;
+		/* file data rounded up to the fs block plus the inode block */
+		*size += (n + EXTRACT_BLK_SZ - 1) / EXTRACT_BLK_SZ * EXTRACT_BLK_SZ +
+			EXTRACT_BLK_SZ;
+	}
+	fclose(fp);
+
+	logger(3, 0, "Unpacked size %llu from %s", *size, path);
+
+	return 0;
+}
+
+/* gzip ISIZE is the unpacked size modulo 4G, the smallest value not
+ * less than the packed size is only a lower bound for the real size
+ */
+static int get_gzip_size(const char *tarball, unsigned long long csize,
+		unsigned long long *size)
+{
+	unsigned char b[4];
+	int fd, n;
+
+	fd = open(tarball, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return vzctl_err(-1, errno, "Unable to open %s", tarball);
+	n = pread(fd, b, sizeof(b), csize - sizeof(b));
+	close(fd);
+	if (n != sizeof(b))
+		return vzctl_err(-1, errno, "Unable to read %s", tarball);
+
+	*size = b[0] | (b[1] << 8) | (b[2] << 16) |
+		((unsigned long long)b[3] << 24);
+	while (*size < csize)
+		*size += 1ULL << 32;
+
+	return 0;
+}
+
+int get_cache_unpacked_size(const char *tarball, unsigned long long *size)
+{
+	struct decompressor *d;
+	struct stat st;
+
+	if (read_manifest(tarball, size) == 0)
+		return 0;
+
+	if (stat(tarball, &st))
+		return vzctl_err(VZCTL_E_FS_NEW_VE_PRVT, errno,
+				"Tarball does not exist: %s", tarball);
+
+	d = get_decompressor(tarball);
+	if (d == NULL)
+		return VZCTL_E_FS_NEW_VE_PRVT;
+
+	/* Without a manifest the size is approximate: take the larger of
+	 * the ratio estimate and the gzip trailer size, so the well
+	 * compressed caches wrapping ISIZE over 4G are not underestimated
+	 */
+	*size = (unsigned long long)st.st_size * d->ratio;
+	if (d->isize) {
+		unsigned long long isize;
+
+		if (get_gzip_size(tarball, st.st_size, &isize))
+			return VZCTL_E_FS_NEW_VE_PRVT;
+		if (isize > *size)
+			*size = isize;
+	}
+	logger(3, 0, "Approximate unpacked size %llu of %s", *size, tarball);
+
+	return 0;
+}
+
+static int check_space(const char *tarball, const char *dst,
+		unsigned long long reserved)
+{
+	struct statvfs fs;
+	unsigned long long needed, avail;
+	int ret;
+
+	ret = get_cache_unpacked_size(tarball, &needed);
+	if (ret)
+		return ret;
+
+	if (statvfs(dst, &fs))
+		return vzctl_err(VZCTL_E_FS_NEW_VE_PRVT, errno,
+				"statvfs %s", dst);
+
+	avail = (unsigned long long)fs.f_bavail * fs.f_frsize;
+	if (needed < reserved)
+		needed = reserved;
+	if (avail < needed)
+		return vzctl_err(VZCTL_E_FS_NO_DISK_SPACE, 0,
+				"Insufficient disk space in %s available: %llu"
+				" needed: %llu", dst, avail >> 10, needed >> 10);
+
+	return 0;
+}
+
+int extract_cache(const char *tarball, const char *dst,
+		unsigned long long reserved)
+{
+	struct decompressor *d;
+	char *envp[] = {ENV_PATH, NULL};
+	int p[2], fd, ret, ret2;
+	pid_t unpack_pid, tar_pid;
+
+	ret = check_space(tarball, dst, reserved);
+	if (ret)
+		return ret;
+
+	d = get_decompressor(tarball);
+	if (d == NULL)
+		return VZCTL_E_FS_NEW_VE_PRVT;
+
+	fd = open(tarball, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return vzctl_err(VZCTL_E_FS_NEW_VE_PRVT, errno,
+				"Unable to open %s", tarball);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (pipe2(p, O_CLOEXEC)) {
+		close(fd);
+		return vzctl_err(VZCTL_E_PIPE, errno, "Unable to create pipe");
+	}
+	if (fcntl(p[1], F_SETPIPE_SZ, EXTRACT_PIPE_SZ) == -1)
+		logger(3, errno, "Unable to set the pipe size");
+
+	logger(3, 0, "Extract %s by %s to %s", tarball, d->bin, dst);
+	unpack_pid = fork();
+	if (unpack_pid == -1) {
+		ret = vzctl_err(VZCTL_E_FORK, errno, "Unable to fork");
+		goto err;
+	} else if (unpack_pid == 0) {
+		char *argv[] = {(char *)d->bin, (char *)d->args, NULL};
+
+		if (dup2(fd, STDIN_FILENO) == -1 ||
+				dup2(p[1], STDOUT_FILENO) == -1)
+			_exit(VZCTL_E_SYSTEM);
+		execve(argv[0], argv, envp);
+		logger(-1, errno, "Unable to exec %s", argv[0]);
+		_exit(VZCTL_E_SYSTEM);
+	}
+
+	tar_pid = fork();
+	if (tar_pid == -1) {
+		ret = vzctl_err(VZCTL_E_FORK, errno, "Unable to fork");
+		kill(unpack_pid, SIGTERM);
+		env_wait(unpack_pid, 0, NULL);
+		goto err;
+	} else if (tar_pid == 0) {
+		char *argv[] = {TAR_BIN, "-C", (char *)dst, "-x", NULL};
+
+		if (dup2(p[0], STDIN_FILENO) == -1)
+			_exit(VZCTL_E_SYSTEM);
+		execve(argv[0], argv, envp);
+		logger(-1, errno, "Unable to exec %s", argv[0]);
+		_exit(VZCTL_E_SYSTEM);
+	}
+
+	p_close(p);
+	close(fd);
+
+	ret = env_wait(tar_pid, 0, NULL);
+	ret2 = env_wait(unpack_pid, 0, NULL);
+	if (ret || ret2)
+		return vzctl_err(VZCTL_E_FS_NEW_VE_PRVT, 0,
+				"Error in %s %s < %s | tar -x",
+				d->bin, d->args, tarball);
+
+	return 0;
+
+err:
+	p_close(p);
+	close(fd);
+
+	return ret;
+}
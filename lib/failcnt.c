@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+/* The failure counters snapshot and its merge against the cursor,
+ * the counters are read in res.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "vzerror.h"
+#include "logger.h"
+#include "failcnt.h"
+
+int add_failcnt_entry(struct failcnt_snap *s, const char *ctid,
+		const char *name, unsigned long long value)
+{
+	struct failcnt_entry *e;
+
+	if (s->n == s->nalloc) {
+		int n = s->nalloc ? s->nalloc * 2 : 256;
+
+		e = realloc(s->e, n * sizeof(*e));
+		if (e == NULL)
+			return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "failcnt");
+		s->e = e;
+		s->nalloc = n;
+	}
+
+	e = &s->e[s->n++];
+	SET_CTID(e->ctid, ctid);
+	snprintf(e->name, sizeof(e->name), "%s", name);
+	e->value = value;
+
+	return 0;
+}
+
+static int cmp_failcnt_entry(const void *a, const void *b)
+{
+	const struct failcnt_entry *x = a, *y = b;
+	int r;
+
+	r = CMP_CTID(x->ctid, y->ctid);
+	if (r)
+		return r;
+	return strcmp(x->name, y->name);
+}
+
+int merge_failcnt_snap(struct vzctl_failcnt_cursor *c, struct failcnt_snap *s,
+		struct vzctl_failcnt **out, int *n)
+{
+	struct vzctl_failcnt *d = NULL;
+	int i, j, nd = 0;
+
+	*out = NULL;
+	*n = 0;
+
+	qsort(s->e, s->n, sizeof(*s->e), cmp_failcnt_entry);
+
+	if (s->n) {
+		d = malloc(s->n * sizeof(*d));
+		if (d == NULL) {
+			free(s->e);
+			s->e = NULL;
+			return vzctl_err(VZCTL_E_NOMEM, ENOMEM,
+					"vzctl2_get_failcnt_delta");
+		}
+	}
+
+	/* merge against the previous snapshot, both are sorted */
+	for (i = 0, j = 0; i < s->n; i++) {
+		unsigned long long prev = 0;
+		int r = 1;
+
+		while (j < c->n &&
+				(r = cmp_failcnt_entry(&c->snap[j], &s->e[i])) < 0)
+			j++;
+		if (j < c->n && r == 0)
+			prev = c->snap[j].value;
+
+		/* the counter was reset by CT restart */
+		if (s->e[i].value < prev)
+			prev = 0;
+		if (s->e[i].value == prev)
+			continue;
+
+		SET_CTID(d[nd].ctid, s->e[i].ctid);
+		snprintf(d[nd].name, sizeof(d[nd].name), "%s", s->e[i].name);
+		d[nd].failcnt = s->e[i].value;
+		d[nd].delta = s->e[i].value - prev;
+		nd++;
+	}
+
+	free(c->snap);
+	c->snap = s->e;
+	c->n = s->n;
+	s->e = NULL;
+
+	if (nd == 0) {
+		free(d);
+		d = NULL;
+	}
+	*out = d;
+	*n = nd;
+
+	return 0;
+}
+
+struct vzctl_failcnt_cursor *vzctl2_failcnt_cursor_open(void)
+{
+	struct vzctl_failcnt_cursor *c;
+
+	c = calloc(1, sizeof(struct vzctl_failcnt_cursor));
+	if (c == NULL)
+		vzctl_err(VZCTL_E_NOMEM, ENOMEM, "vzctl2_failcnt_cursor_open");
+
+	return c;
+}
+
+void vzctl2_failcnt_cursor_close(struct vzctl_failcnt_cursor *c)
+{
+	if (c == NULL)
+		return;
+	free(c->snap);
+	free(c);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+#ifndef _FAILCNT_H_
+#define _FAILCNT_H_
+
+#include "libvzctl.h"
+
+/* Failure counters tracker: /proc/user_beancounters and the memory
+ * cgroup failcnt/oom_kill counters of all CTs are read in one pass,
+ * sorted by (ctid, name) and merged against the cursor snapshot.
+ */
+struct failcnt_entry {
+	ctid_t ctid;
+	char name[VZCTL_FAILCNT_NAME_LEN];
+	unsigned long long value;
+};
+
+struct vzctl_failcnt_cursor {
+	struct failcnt_entry *snap;
+	int n;
+};
+
+struct failcnt_snap {
+	struct failcnt_entry *e;
+	int n;
+	int nalloc;
+};
+
+int add_failcnt_entry(struct failcnt_snap *s, const char *ctid,
+		const char *name, unsigned long long value);
+/* Sort the snapshot and return the changed counters in out, the
+ * snapshot is moved to the cursor
+ */
+int merge_failcnt_snap(struct vzctl_failcnt_cursor *c, struct failcnt_snap *s,
+		struct vzctl_failcnt **out, int *n);
+
+#endif /* _FAILCNT_H_ */
@@ -38,7 +38,9 @@
 #include "cluster.h"
 #include "exec.h"
 
+#ifndef SHAMAN_BIN
 #define SHAMAN_BIN	"/usr/sbin/shaman"
+#endif
 #define CPUFEATURES_BIN	"/usr/sbin/cpufeatures"
 
 static int is_bin_present(const char *path)
@@ -51,15 +53,257 @@ static void shaman_get_resname(ctid_t ctid, char *buf, int size)
 	snprintf(buf, size, "ct-%s", ctid);
 }
 
+static const char *ha_cmd2str(int cmd)
+{
+	switch (cmd) {
+	case HA_CMD_ADD:
+		return "add";
+	case HA_CMD_SET:
+		return "set";
+	case HA_CMD_DEL:
+		return "del";
+	case HA_CMD_DEL_EVERYWHERE:
+		return "del-everywhere";
+	}
+	return NULL;
+}
+
+static int ha_str2cmd(const char *str)
+{
+	int cmd;
+
+	for (cmd = HA_CMD_ADD; cmd <= HA_CMD_DEL_EVERYWHERE; cmd++)
+		if (!strcmp(ha_cmd2str(cmd), str))
+			return cmd;
+	return -1;
+}
+
+void ha_batch_init(struct ha_batch *b)
+{
+	list_head_init(&b->ops);
+	b->n = 0;
+}
+
+void ha_batch_free(struct ha_batch *b)
+{
+	struct ha_op *op, *tmp;
+
+	list_for_each_safe(op, tmp, &b->ops, list) {
+		list_del(&op->list);
+		free(op->path);
+		free(op);
+	}
+	b->n = 0;
+}
+
+/* Queue the operation, the operations are submitted in order */
+int ha_batch_queue(struct ha_batch *b, int cmd, ctid_t ctid,
+		const unsigned long *prio, const char *path)
+{
+	struct ha_op *op;
+
+	op = calloc(1, sizeof(struct ha_op));
+	if (op == NULL)
+		return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "ha_batch_queue");
+	if (path != NULL && (op->path = strdup(path)) == NULL) {
+		free(op);
+		return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "ha_batch_queue");
+	}
+
+	op->cmd = cmd;
+	SET_CTID(op->ctid, ctid);
+	shaman_get_resname(ctid, op->resname, sizeof(op->resname));
+	if (prio != NULL) {
+		op->prio = *prio;
+		op->has_prio = 1;
+	}
+	/* try to guess action if failed */
+	if (cmd == HA_CMD_ADD)
+		op->fail_cmd = HA_CMD_SET;
+	else if (cmd == HA_CMD_SET)
+		op->fail_cmd = HA_CMD_ADD;
+	else
+		op->fail_cmd = -1;
+	op->rc = -1;
+
+	list_add_tail(&op->list, &b->ops);
+	b->n++;
+
+	return 0;
+}
+
+static int ha_exec_op(struct ha_op *op, int cmd)
+{
+	char *argv[10];
+	char prio[NAME_MAX];
+	int i = 0;
+
+	argv[i++] = SHAMAN_BIN;
+	argv[i++] = "-i";
+	if (cmd == HA_CMD_DEL_EVERYWHERE)
+		argv[i++] = "-q";
+	argv[i++] = (char *)ha_cmd2str(cmd);
+	argv[i++] = op->resname;
+	if (op->has_prio) {
+		snprintf(prio, sizeof(prio), "%lu", op->prio);
+		argv[i++] = "--prio";
+		argv[i++] = prio;
+	}
+	if (op->path != NULL) {
+		argv[i++] = "--path";
+		argv[i++] = op->path;
+	}
+	argv[i] = NULL;
+
+	return vzctl2_wrap_exec_script(argv, NULL, 0);
+}
+
+static void ha_write_op(FILE *fp, struct ha_op *op, int cmd)
+{
+	fprintf(fp, "%s %s", ha_cmd2str(cmd), op->resname);
+	if (op->has_prio)
+		fprintf(fp, " --prio %lu", op->prio);
+	if (op->path != NULL)
+		fprintf(fp, " --path %s", op->path);
+	fprintf(fp, "\n");
+}
+
+/* Submit the queued operations in one 'shaman -i batch' call.
+ * Request lines are "<cmd> <resource> [--prio N] [--path P]",
+ * the reply is a "<cmd> <resource> <rc>" line per operation.
+ * Returns the number of processed operations, -1 if the batch
+ * command is not available.
+ */
+static int ha_batch_submit(struct ha_batch *b, int retry)
+{
+	FILE *in = NULL, *out = NULL;
+	struct ha_op *op;
+	char buf[PATH_MAX + NAME_MAX + 64];
+	char *cmd, *resname, *p, *sp;
+	int n = 0, c, rc, ret = -1;
+	pid_t pid;
+	char *argv[] = {SHAMAN_BIN, "-i", "batch", NULL};
+
+	if ((in = tmpfile()) == NULL || (out = tmpfile()) == NULL) {
+		vzctl_err(-1, errno, "Unable to create temporary file");
+		goto out;
+	}
+
+	list_for_each(op, &b->ops, list) {
+		op->pending = 0;
+		if (retry && !(op->rc == 2 && op->fail_cmd != -1))
+			continue;
+		ha_write_op(in, op, retry ? op->fail_cmd : op->cmd);
+		op->pending = 1;
+		n++;
+	}
+	if (n == 0) {
+		ret = 0;
+		goto out;
+	}
+	if (fflush(in) || fseek(in, 0, SEEK_SET)) {
+		vzctl_err(-1, errno, "Unable to write HA batch");
+		goto out;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		vzctl_err(-1, errno, "Cannot fork");
+		goto out;
+	} else if (pid == 0) {
+		if (dup2(fileno(in), STDIN_FILENO) == -1 ||
+				dup2(fileno(out), STDOUT_FILENO) == -1)
+			_exit(1);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+
+	if (env_wait(pid, 0, &rc) == 0 && rc != 0)
+		logger(5, 0, "%s -i batch exited with %d", SHAMAN_BIN, rc);
+
+	rewind(out);
+	n = 0;
+	while (fgets(buf, sizeof(buf), out) != NULL) {
+		if ((cmd = strtok_r(buf, " \t\n", &sp)) == NULL ||
+				(resname = strtok_r(NULL, " \t\n", &sp)) == NULL ||
+				(p = strtok_r(NULL, " \t\n", &sp)) == NULL ||
+				parse_int(p, &rc))
+			continue;
+		c = ha_str2cmd(cmd);
+		/* the same resource may be queued more than once */
+		list_for_each(op, &b->ops, list) {
+			if (op->pending && !strcmp(op->resname, resname) &&
+					c == (retry ? op->fail_cmd : op->cmd)) {
+				op->rc = rc;
+				op->pending = 0;
+				n++;
+				break;
+			}
+		}
+	}
+	/* old shaman without batch support */
+	ret = n ? n : -1;
+
+out:
+	if (in != NULL)
+		fclose(in);
+	if (out != NULL)
+		fclose(out);
+
+	return ret;
+}
+
+/* Apply queued operations, returns the number of failed ones,
+ * per-resource status is left in ha_op.rc
+ */
+int ha_batch_commit(struct ha_batch *b)
+{
+	struct ha_op *op;
+	int failed = 0;
+
+	if (b->n == 0 || !is_bin_present(SHAMAN_BIN))
+		return 0;
+
+	if (ha_batch_submit(b, 0) == -1) {
+		logger(5, 0, "HA batch is not supported, fall back to per-resource calls");
+		list_for_each(op, &b->ops, list) {
+			op->rc = ha_exec_op(op, op->cmd);
+			if (op->rc == 2 && op->fail_cmd != -1)
+				op->rc = ha_exec_op(op, op->fail_cmd);
+		}
+	} else
+		ha_batch_submit(b, 1);
+
+	list_for_each(op, &b->ops, list) {
+		if (op->rc && op->cmd != HA_CMD_DEL_EVERYWHERE) {
+			logger(-1, 0, "Failed to %s the HA resource %s, rc=%d",
+					ha_cmd2str(op->cmd), op->resname, op->rc);
+			failed++;
+		}
+	}
+
+	return failed;
+}
+
+static void ha_init_op(struct ha_op *op, int cmd, ctid_t ctid,
+		const unsigned long *prio, const char *path)
+{
+	memset(op, 0, sizeof(*op));
+	op->cmd = cmd;
+	shaman_get_resname(ctid, op->resname, sizeof(op->resname));
+	if (prio != NULL) {
+		op->prio = *prio;
+		op->has_prio = 1;
+	}
+	op->path = (char *)path;
+}
+
 int handle_set_cmd_on_ha_cluster(ctid_t ctid, const char *ve_private,
 		struct ha_params *cmdline, struct ha_params *config)
 {
-	char *argv[9];
-	char *fail_act = NULL;
-	char resname[NAME_MAX];
-	char prio[NAME_MAX];
-	int rc, i = 0;
-	int del = cmdline->ha_enable == VZCTL_PARAM_OFF;
+	struct ha_op op;
+	int cmd, fail_cmd = -1;
+	int rc;
 
 	if (!is_bin_present(SHAMAN_BIN))
 		return 0;
@@ -68,100 +312,82 @@ int handle_set_cmd_on_ha_cluster(ctid_t ctid, const char *ve_private,
 			cmdline->ha_enable != VZCTL_PARAM_ON)
 		return 0;
 
-	argv[i++] = SHAMAN_BIN;
-	argv[i++] = "-i";
-
 	if (cmdline->ha_enable == VZCTL_PARAM_ON) {
 		/*
 		 * If there is a '--ha-enable yes' in the command line, then use 'add'
 		 * command to create resource file and set up needed parameters.
 		 */
-		argv[i++] = "add";
-		fail_act = "set";
+		cmd = HA_CMD_ADD;
+		fail_cmd = HA_CMD_SET;
 	} else if (cmdline->ha_enable == VZCTL_PARAM_OFF) {
-		argv[i++] = "del";
+		cmd = HA_CMD_DEL;
 	} else if (cmdline->ha_prio) {
-		argv[i++] = "set";
-		fail_act = "add";
+		cmd = HA_CMD_SET;
+		fail_cmd = HA_CMD_ADD;
 	} else {
 		/* HA options are not present in the command line */
 		return 0;
 	}
 
-	shaman_get_resname(ctid, resname, sizeof(resname));
-	argv[i++] = resname;
-
-	if (!del) {
+	if (cmd == HA_CMD_DEL)
+		ha_init_op(&op, cmd, ctid, NULL, NULL);
+	else
 		/*
 		 * Specify all parameters from the config when doing 'shaman add'.
 		 * This is needed e.g. when registering an already existing CT - newly
 		 * created cluster resource for this CT should contain all actual
 		 * HA parameter values.
 		 */
-		if (cmdline->ha_prio || config->ha_prio) {
-			snprintf(prio, sizeof(prio), "%lu",
-					cmdline->ha_prio ? *cmdline->ha_prio :
-					*config->ha_prio);
-			argv[i++] = "--prio";
-			argv[i++] = prio;
-		}
-		argv[i++] = "--path";
-		argv[i++] = (char *)ve_private;
-	}
-	argv[i] = NULL;
+		ha_init_op(&op, cmd, ctid,
+				cmdline->ha_prio ?: config->ha_prio, ve_private);
 
-	rc = vzctl2_wrap_exec_script(argv, NULL, 0);
-	if (rc == 2 && fail_act != NULL) {
+	rc = ha_exec_op(&op, cmd);
+	if (rc == 2 && fail_cmd != -1)
 		/* try to guess action if failed */
-		argv[2] = fail_act;
-		rc = vzctl2_wrap_exec_script(argv, NULL, 0);
-	}
+		rc = ha_exec_op(&op, fail_cmd);
 
 	return rc;
 }
 
-void shaman_del_everywhere(ctid_t ctid)
-{
-	char resname[NAME_MAX];
-	char *argv[] = {SHAMAN_BIN, "-i", "-q", "del-everywhere", resname, NULL};
-
-	if (!is_bin_present(SHAMAN_BIN))
-		return;
-
-	shaman_get_resname(ctid, resname, sizeof(resname));
-	vzctl2_wrap_exec_script(argv, NULL, 0);
-}
-
 int shaman_del_resource(ctid_t ctid)
 {
-	char resname[NAME_MAX];
-	char *argv[] = {SHAMAN_BIN, "-i", "del", resname, NULL};
+	struct ha_op op;
 
 	if (!is_bin_present(SHAMAN_BIN))
 		return 0;
 
-	shaman_get_resname(ctid, resname, sizeof(resname));
-	return vzctl2_wrap_exec_script(argv, NULL, 0);
+	ha_init_op(&op, HA_CMD_DEL, ctid, NULL, NULL);
+	return ha_exec_op(&op, op.cmd);
 }
 
-int shaman_add_resource(ctid_t ctid, struct vzctl_config *conf, const char *ve_private)
+/* Add the resource, the copies registered on other nodes are
+ * removed first in the same batch if del_everywhere is set
+ */
+int shaman_add_resource(ctid_t ctid, struct vzctl_config *conf,
+		const char *ve_private, int del_everywhere)
 {
-	char resname[NAME_MAX];
-	char *argv[] = {SHAMAN_BIN, "-i", "add", resname,
-					"--prio", NULL,
-					"--path", (char *)ve_private,
-					NULL};
-	const char *prio = NULL;
+	struct ha_batch b;
+	const char *data = NULL;
+	unsigned long prio = 0;
+	int ret = 0;
 
 	if (!is_bin_present(SHAMAN_BIN))
 		return 0;
 
-	shaman_get_resname(ctid, resname, sizeof(resname));
+	vzctl2_conf_get_param(conf, "HA_PRIO", &data);
+	if (data != NULL)
+		prio = strtoul(data, NULL, 10);
 
-	vzctl2_conf_get_param(conf, "HA_PRIO", &prio);
-	argv[5] = (char *)(prio ?: "0");
+	ha_batch_init(&b);
+	if (del_everywhere)
+		ret = ha_batch_queue(&b, HA_CMD_DEL_EVERYWHERE, ctid, NULL, NULL);
+	if (ret == 0)
+		ret = ha_batch_queue(&b, HA_CMD_ADD, ctid, &prio, ve_private);
+	if (ret == 0)
+		ret = ha_batch_commit(&b);
+	ha_batch_free(&b);
 
-	return vzctl2_wrap_exec_script(argv, NULL, 0);
+	return ret;
 }
 
 int shaman_is_configured(void)
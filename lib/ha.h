@@ -22,6 +22,9 @@
 #ifndef	_HA_H_
 #define	_HA_H_
 
+#include <limits.h>
+#include "list.h"
+
 struct ha_params {
 	int ha_enable;
 	unsigned long *ha_prio;
@@ -29,11 +32,43 @@ struct ha_params {
 
 struct vzctl_config;
 
+enum {
+	HA_CMD_ADD,
+	HA_CMD_SET,
+	HA_CMD_DEL,
+	HA_CMD_DEL_EVERYWHERE,
+};
+
+struct ha_op {
+	list_elem_t list;
+	int cmd;
+	int fail_cmd;
+	ctid_t ctid;
+	char resname[NAME_MAX];
+	char *path;
+	unsigned long prio;
+	int has_prio;
+	int rc;
+	int pending;
+};
+
+/* Queue of HA cluster resource operations submitted at once */
+struct ha_batch {
+	list_head_t ops;
+	int n;
+};
+
+void ha_batch_init(struct ha_batch *b);
+void ha_batch_free(struct ha_batch *b);
+int ha_batch_queue(struct ha_batch *b, int cmd, ctid_t ctid,
+		const unsigned long *prio, const char *path);
+int ha_batch_commit(struct ha_batch *b);
+
 int handle_set_cmd_on_ha_cluster(ctid_t ctid, const char *ve_private,
 		struct ha_params *cmdline, struct ha_params *config);
-void shaman_del_everywhere(ctid_t ctid);
 int shaman_del_resource(ctid_t ctid);
-int shaman_add_resource(ctid_t ctid, struct vzctl_config *conf, const char *ve_private);
+int shaman_add_resource(ctid_t ctid, struct vzctl_config *conf,
+		const char *ve_private, int del_everywhere);
 int shaman_is_configured(void);
 int cpufeatures_sync(void);
 #endif	/* _HA_H_ */
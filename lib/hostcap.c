@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+#include "hostcap.h"
+#include "vzfeatures.h"
+#include "vztypes.h"
+#include "util.h"
+
+static struct {
+	const char *name;
+	unsigned int mask;
+} host_cg_map[] = {
+	{"ve",		VZCTL_HOSTCG_VE},
+	{"cpu",		VZCTL_HOSTCG_CPU},
+	{"cpuset",	VZCTL_HOSTCG_CPUSET},
+	{"memory",	VZCTL_HOSTCG_MEMORY},
+	{"blkio",	VZCTL_HOSTCG_BLKIO},
+	{"io",		VZCTL_HOSTCG_BLKIO},
+	{"devices",	VZCTL_HOSTCG_DEVICES},
+	{"freezer",	VZCTL_HOSTCG_FREEZER},
+	{"net_cls",	VZCTL_HOSTCG_NET_CLS},
+	{"beancounter",	VZCTL_HOSTCG_BEANCOUNTER},
+	{"pids",	VZCTL_HOSTCG_PIDS},
+};
+
+static pthread_mutex_t _g_host_caps_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct vzctl_host_caps _g_host_caps;
+static int _g_host_caps_ready;
+
+static unsigned int cg_list2mask(char *list, const char *delim)
+{
+	unsigned int mask = 0;
+	char *token, *savedptr;
+	int i;
+
+	for (token = strtok_r(list, delim, &savedptr); token != NULL;
+			token = strtok_r(NULL, delim, &savedptr))
+	{
+		for (i = 0; i < sizeof(host_cg_map) / sizeof(host_cg_map[0]); i++)
+			if (!strcmp(token, host_cg_map[i].name))
+				mask |= host_cg_map[i].mask;
+	}
+
+	return mask;
+}
+
+static void probe_cgroups(struct vzctl_host_caps *caps)
+{
+	FILE *fp;
+	char buf[PATH_MAX];
+	char target[4096];
+	char type[64];
+	char ops[4096];
+
+	fp = fopen("/proc/mounts", "r");
+	if (fp == NULL)
+		return;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (sscanf(buf, "%*s %4095s %63s %4095s", target, type, ops) != 3)
+			continue;
+
+		if (!strcmp(type, "cgroup")) {
+			caps->flags |= VZCTL_HOSTCAP_CGROUP_V1;
+			caps->cgroups |= cg_list2mask(ops, ",");
+		} else if (!strcmp(type, "cgroup2")) {
+			FILE *cfp;
+			char path[PATH_MAX];
+
+			caps->flags |= VZCTL_HOSTCAP_CGROUP_V2;
+			snprintf(path, sizeof(path), "%s/cgroup.controllers",
+					target);
+			cfp = fopen(path, "r");
+			if (cfp == NULL)
+				continue;
+			if (fgets(ops, sizeof(ops), cfp))
+				caps->cgroups |= cg_list2mask(ops, " \n");
+			fclose(cfp);
+		}
+	}
+	fclose(fp);
+}
+
+static int has_mount_api(void)
+{
+#ifdef __NR_fsopen
+	int fd;
+
+	/* an empty fs name is rejected by the kernel with EINVAL/ENODEV */
+	fd = syscall(__NR_fsopen, "", 0);
+	if (fd != -1) {
+		close(fd);
+		return 1;
+	}
+	return errno != ENOSYS;
+#else
+	return 0;
+#endif
+}
+
+static void probe_host_caps(struct vzctl_host_caps *caps)
+{
+	struct utsname u;
+
+	memset(caps, 0, sizeof(*caps));
+	if (uname(&u) == 0) {
+		snprintf(caps->kver, sizeof(caps->kver), "%s", u.release);
+		snprintf(caps->arch, sizeof(caps->arch), "%s", u.machine);
+		caps->tech = get_kernel_tech(caps->kver, caps->arch);
+		if (kver_cmp(caps->kver, "3.9") >= 0)
+			caps->flags |= VZCTL_HOSTCAP_NSOPS;
+	}
+
+	if (access(PROC_VZ, F_OK) == 0)
+		caps->flags |= VZCTL_HOSTCAP_VZ;
+	if (access(VZCTLDEV, F_OK) == 0)
+		caps->flags |= VZCTL_HOSTCAP_VZCTLDEV;
+	if (has_mount_api())
+		caps->flags |= VZCTL_HOSTCAP_MOUNT_API;
+
+	probe_cgroups(caps);
+}
+
+const struct vzctl_host_caps *get_host_caps(void)
+{
+	pthread_mutex_lock(&_g_host_caps_mtx);
+	if (!_g_host_caps_ready) {
+		probe_host_caps(&_g_host_caps);
+		_g_host_caps_ready = 1;
+	}
+	pthread_mutex_unlock(&_g_host_caps_mtx);
+
+	return &_g_host_caps;
+}
+
+int has_host_cap(unsigned int cap)
+{
+	return (get_host_caps()->flags & cap) == cap;
+}
+
+int has_host_cgroup(unsigned int cg)
+{
+	return (get_host_caps()->cgroups & cg) == cg;
+}
+
+int vzctl2_get_host_caps(struct vzctl_host_caps *caps)
+{
+	const struct vzctl_host_caps *c = get_host_caps();
+
+	pthread_mutex_lock(&_g_host_caps_mtx);
+	memcpy(caps, c, sizeof(*caps));
+	pthread_mutex_unlock(&_g_host_caps_mtx);
+
+	return 0;
+}
+
+void vzctl2_set_host_caps(const struct vzctl_host_caps *caps)
+{
+	pthread_mutex_lock(&_g_host_caps_mtx);
+	if (caps != NULL) {
+		memcpy(&_g_host_caps, caps, sizeof(_g_host_caps));
+		_g_host_caps_ready = 1;
+	} else
+		_g_host_caps_ready = 0;
+	pthread_mutex_unlock(&_g_host_caps_mtx);
+}
@@ -22,6 +22,10 @@
 
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/sysmacros.h>
 #include <sys/syscall.h>
 #include <sys/ioctl.h>
 #include <string.h>
@@ -34,6 +38,8 @@
 #include "util.h"
 #include "vz.h"
 #include "env_ops.h"
+#include "cgroup.h"
+#include "disk.h"
 
 int vzctl2_set_ioprio(struct vzctl_env_handle *h, int prio)
 {
@@ -60,9 +66,24 @@ int vzctl2_get_iopslimit(struct vzctl_env_handle *h, unsigned int *limit)
 	return get_env_ops()->env_get_iopslimit(h, limit);
 }
 
+void get_io_burst(struct vzctl_env_handle *h, unsigned int speed,
+		unsigned int *burst, unsigned int *latency)
+{
+	struct vzctl_io_param *io = h->env_param->io;
+	unsigned long long b;
+
+	b = (unsigned long long)speed *
+		(io->burst != UINT_MAX ? io->burst : IOLIMIT_BURST_DEF);
+	*burst = b > UINT_MAX ? UINT_MAX : b;
+	*latency = io->latency != UINT_MAX ? io->latency : IOLIMIT_LATENCY_DEF;
+}
+
 int apply_io_param(struct vzctl_env_handle *h, struct vzctl_env_param *env, int flags)
 {
 	int ret;
+	struct vzctl_io_param *cur = h->env_param->io;
+	unsigned int limit = env->io->limit;
+	unsigned int iopslimit = env->io->iopslimit;
 
 	if (env->io->prio >= 0) {
 		ret = vzctl2_set_ioprio(h, env->io->prio);
@@ -70,16 +91,227 @@ int apply_io_param(struct vzctl_env_handle *h, struct vzctl_env_param *env, int
 			return ret;
 	}
 
-	if (env->io->limit != UINT_MAX) {
-		ret = vzctl2_set_iolimit(h, env->io->limit);
+	/* burst and latency are applied together with the limits */
+	if (env->io->burst != UINT_MAX || env->io->latency != UINT_MAX) {
+		if (env->io->burst != UINT_MAX)
+			cur->burst = env->io->burst;
+		if (env->io->latency != UINT_MAX)
+			cur->latency = env->io->latency;
+		if (limit == UINT_MAX && cur->limit != UINT_MAX)
+			limit = cur->limit;
+		if (iopslimit == UINT_MAX && cur->iopslimit != UINT_MAX)
+			iopslimit = cur->iopslimit;
+	}
+
+	if (limit != UINT_MAX) {
+		ret = vzctl2_set_iolimit(h, limit);
 		if (ret)
 			return ret;
 	}
-	if (env->io->iopslimit != UINT_MAX) {
-		ret = vzctl2_set_iopslimit(h, env->io->iopslimit);
+	if (iopslimit != UINT_MAX) {
+		ret = vzctl2_set_iopslimit(h, iopslimit);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static dev_t get_disk_io_dev(struct vzctl_disk *d)
+{
+	return d->dmname != NULL ? d->dm_dev : d->dev;
+}
+
+static const char *disk_io_files[] = {
+	"blkio.throttle.read_bps_device",
+	"blkio.throttle.write_bps_device",
+	"blkio.throttle.read_iops_device",
+	"blkio.throttle.write_iops_device",
+};
+
+static int write_disk_io_rule(int fd, const char *fname, dev_t dev,
+		unsigned int limit)
+{
+	char buf[64];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%u:%u %u",
+			gnu_dev_major(dev), gnu_dev_minor(dev), limit);
+	logger(3, 0, "Write %s <%s>", fname, buf);
+
+	return do_write_data(fd, fname, buf, len);
+}
+
+/* Push the per-disk limits of all disks with one open per
+ * blkio throttle file, 0 removes the limit
+ */
+static int write_disk_io_limits(struct vzctl_env_handle *h,
+		struct vzctl_disk **disks, int n)
+{
+	char path[PATH_MAX];
+	int i, j, fd, ret = 0;
+
+	for (i = 0; i < 4; i++) {
+		if (cg_get_path(EID(h), CG_BLKIO, disk_io_files[i], path,
+					sizeof(path)))
+			return VZCTL_E_SET_IO;
+
+		fd = open(path, O_WRONLY | O_CLOEXEC);
+		if (fd == -1)
+			return vzctl_err(VZCTL_E_SET_IO, errno,
+					"Can't open %s for writing", path);
+
+		for (j = 0; j < n; j++) {
+			if (write_disk_io_rule(fd, path,
+					get_disk_io_dev(disks[j]),
+					i < 2 ? disks[j]->iolimit :
+						disks[j]->iopslimit))
+			{
+				ret = VZCTL_E_SET_IO;
+				break;
+			}
+		}
+		close(fd);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int apply_disk_io_limits(struct vzctl_env_handle *h,
+		struct vzctl_env_disk *env_disk)
+{
+	struct vzctl_disk *d;
+	struct vzctl_disk **disks;
+	int n = 0, ret;
+
+	if (env_disk == NULL)
+		return 0;
+
+	list_for_each(d, &env_disk->disks, list)
+		if (d->configured && (d->iolimit || d->iopslimit))
+			n++;
+	if (n == 0)
+		return 0;
+
+	disks = malloc(n * sizeof(struct vzctl_disk *));
+	if (disks == NULL)
+		return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "apply_disk_io_limits");
+
+	n = 0;
+	list_for_each(d, &env_disk->disks, list)
+		if (d->configured && (d->iolimit || d->iopslimit))
+			disks[n++] = d;
+
+	logger(0, 0, "Set up IO limits for %d disk(s)", n);
+	ret = write_disk_io_limits(h, disks, n);
+	free(disks);
+
+	return ret;
+}
+
+int set_disk_io_limit(struct vzctl_env_handle *h, struct vzctl_disk *d,
+		unsigned int iolimit, unsigned int iopslimit)
+{
+	int ret;
+	struct vzctl_disk tmp = *d;
+
+	if (iolimit)
+		tmp.iolimit = iolimit == VZCTL_DISK_IO_UNLIMITED ? 0 : iolimit;
+	if (iopslimit)
+		tmp.iopslimit = iopslimit == VZCTL_DISK_IO_UNLIMITED ? 0 : iopslimit;
+
+	if (is_env_run(h) == 1) {
+		struct vzctl_disk *p = &tmp;
+
+		if (tmp.dev == 0) {
+			ret = update_disk_info(h, &tmp);
+			if (ret)
+				return ret;
+		}
+
+		logger(0, 0, "Set up IO limits for the disk %s: %u B/s %u iops",
+				d->uuid, tmp.iolimit, tmp.iopslimit);
+		ret = write_disk_io_limits(h, &p, 1);
 		if (ret)
 			return ret;
+		d->dev = tmp.dev;
+		d->dm_dev = tmp.dm_dev;
+	}
+
+	d->iolimit = tmp.iolimit;
+	d->iopslimit = tmp.iopslimit;
+
+	return 0;
+}
+
+static int get_blkio_stat(struct vzctl_env_handle *h, const char *name,
+		dev_t dev, unsigned long long *rd, unsigned long long *wr)
+{
+	char path[PATH_MAX];
+	char op[32];
+	unsigned int maj, min;
+	unsigned long long v;
+	FILE *fp;
+
+	*rd = *wr = 0;
+	if (cg_get_path(EID(h), CG_BLKIO, name, path, sizeof(path)))
+		return -1;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return vzctl_err(-1, errno, "Unable to open %s", path);
+
+	/* <major>:<minor> <Read|Write|Sync|Async|Total> <value> */
+	while (fscanf(fp, "%u:%u %31s %llu", &maj, &min, op, &v) == 4) {
+		if (maj != gnu_dev_major(dev) || min != gnu_dev_minor(dev))
+			continue;
+		if (!strcmp(op, "Read"))
+			*rd = v;
+		else if (!strcmp(op, "Write"))
+			*wr = v;
 	}
+	fclose(fp);
+
+	return 0;
+}
+
+int vzctl2_get_disk_iostat(struct vzctl_env_handle *h, const char *uuid,
+		struct vzctl_disk_iostat *out, int size)
+{
+	int ret;
+	struct vzctl_disk *d;
+	struct vzctl_disk tmp;
+	struct vzctl_disk_iostat st = {};
+
+	d = find_disk(h->env_param->disk, uuid);
+	if (d == NULL)
+		return vzctl_err(VZCTL_E_INVAL, 0,
+				"Unable to get IO statistics of the disk %s:"
+				" no such disk", uuid);
+
+	st.iolimit = d->iolimit;
+	st.iopslimit = d->iopslimit;
+
+	if (is_env_run(h) == 1) {
+		tmp = *d;
+		if (tmp.dev == 0) {
+			ret = update_disk_info(h, &tmp);
+			if (ret)
+				return ret;
+		}
+
+		if (get_blkio_stat(h, "blkio.throttle.io_service_bytes",
+				get_disk_io_dev(&tmp), &st.read_bytes,
+				&st.write_bytes) ||
+			get_blkio_stat(h, "blkio.throttle.io_serviced",
+				get_disk_io_dev(&tmp), &st.read_ops,
+				&st.write_ops))
+			return VZCTL_E_SYSTEM;
+	}
+
+	memcpy(out, &st, size < sizeof(st) ? size : sizeof(st));
 
 	return 0;
 }
@@ -99,6 +331,8 @@ struct vzctl_io_param *alloc_io_param(void)
 	new->prio = -1;
 	new->limit = UINT_MAX;
 	new->iopslimit = UINT_MAX;
+	new->burst = UINT_MAX;
+	new->latency = UINT_MAX;
 	return new;
 }
 
@@ -163,3 +397,14 @@ int parse_iopslimit(struct vzctl_io_param *io, const char *str)
 
 	return ret;
 }
+
+int parse_io_uint(unsigned int *out, const char *str)
+{
+	unsigned long n;
+
+	if (parse_ul(str, &n) || n >= UINT_MAX)
+		return VZCTL_E_INVAL;
+	*out = (unsigned int)n;
+
+	return 0;
+}
@@ -31,17 +31,32 @@
 #define IOPRIO_CLASS_SHIFT	13
 #define IOPRIO_CLASS_BE		2
 
+#define IOLIMIT_BURST_DEF	3
+#define IOLIMIT_LATENCY_DEF	10000
+
 struct vzctl_io_param {
 	int prio;
 	unsigned int limit;
 	unsigned int iopslimit;
+	unsigned int burst;	/* burst as a multiplier of the limit */
+	unsigned int latency;	/* latency window in milliseconds */
 };
 
+struct vzctl_env_disk;
+struct vzctl_disk;
+
 struct vzctl_io_param *alloc_io_param(void);
 void free_io_param(struct vzctl_io_param *io);
 int parse_ioprio(struct vzctl_io_param *io, const char *val);
 int parse_iolimit(struct vzctl_io_param *io, const char *val, int def_mul);
 int parse_iopslimit(struct vzctl_io_param *io, const char *str);
+int parse_io_uint(unsigned int *out, const char *str);
+void get_io_burst(struct vzctl_env_handle *h, unsigned int speed,
+		unsigned int *burst, unsigned int *latency);
+int apply_disk_io_limits(struct vzctl_env_handle *h,
+		struct vzctl_env_disk *env_disk);
+int set_disk_io_limit(struct vzctl_env_handle *h, struct vzctl_disk *d,
+		unsigned int iolimit, unsigned int iopslimit);
 int apply_io_param(struct vzctl_env_handle *h, struct vzctl_env_param *env, int flags);
 void free_io_param(struct vzctl_io_param *io);
 int vz_set_ioprio(struct vzctl_env_handle *h, int prio);
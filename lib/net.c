@@ -52,6 +52,7 @@
 #include "env_ops.h"
 #include "exec.h"
 #include "cgroup.h"
+#include "arpsend.h"
 
 void free_ip_param(struct vzctl_ip_param *ip)
 {
@@ -269,10 +270,10 @@ void free_net_param(struct vzctl_net_param *net)
 }
 
 int run_net_script(struct vzctl_env_handle *h, const char *script,
-		list_head_t *ip, int flags)
+		list_head_t *ip, int flags, int native)
 {
 	char *argv[2];
-	char *envp[5];
+	char *envp[7];
 	char veid_str[64];
 	char *ip_str;
 	char buf[STR_SIZE];
@@ -287,6 +288,10 @@ int run_net_script(struct vzctl_env_handle *h, const char *script,
 	envp[i++] = ip_str;
 	if (flags & VZCTL_SKIP_ARPDETECT)
 		envp[i++] = "SKIP_ARPDETECT=yes";
+	if (native & NET_NATIVE_ARP)
+		envp[i++] = "ARPSEND=native";
+	if (native & NET_NATIVE_ROUTE)
+		envp[i++] = "VENET_ROUTE=native";
 	snprintf(s_state, sizeof(s_state), "VE_STATE=%s", get_state(h));
 	envp[i++] = s_state;
 	envp[i] = NULL;
@@ -384,6 +389,8 @@ static int add_ip(struct vzctl_env_handle *h, struct vzctl_env_param *env, int f
 	struct vzctl_ip_param *it;
 	struct vzctl_net_param *net = env->net;
 	int delall = net->delall;
+	int native = 0;
+	struct arpsend_ctx arp;
 	LIST_HEAD(ipadd);
 	LIST_HEAD(iprun);
 
@@ -405,8 +412,33 @@ static int add_ip(struct vzctl_env_handle *h, struct vzctl_env_param *env, int f
 	/* Setup in kernel */
 	if ((ret = env_ip_ctl(h, VE_IP_ADD, &ipadd, 1, flags)))
 		goto err_pool;
+
+	/* ARP probes and announces, routes and proxy entries are set
+	 * in-process if possible, otherwise vz-net_add falls back to
+	 * arping/ndsend and ip
+	 */
+	arpsend_init(&arp);
+	if (arpsend_add_node_devs(&arp) == 0) {
+		/* The script is told to skip ARP only once the packet
+		 * sockets are open and the probes went out
+		 */
+		if (arpsend_add_ips(&arp, &ipadd) == 0 &&
+				arpsend_open(&arp) == 0 &&
+				((flags & VZCTL_SKIP_ARPDETECT) ||
+				 arpsend_run(&arp, ARPSEND_DETECT,
+					 ARPSEND_DETECT_TIMEOUT) >= 0))
+			native |= NET_NATIVE_ARP;
+		if (venet_ip_ctl(VE_IP_ADD, &ipadd, &arp.devs) == 0)
+			native |= NET_NATIVE_ROUTE;
+	}
+
 	/* Setup on node */
-	if ((ret = run_net_script(h, VZCTL_NET_ADD, &ipadd, flags)))
+	ret = run_net_script(h, VZCTL_NET_ADD, &ipadd, flags, native);
+	if (ret == 0 && (native & NET_NATIVE_ARP) &&
+			arpsend_run(&arp, ARPSEND_REPLY, 0) < 0)
+		logger(0, 0, "Warning: failed to announce the ip addresses");
+	arpsend_free(&arp);
+	if (ret)
 		goto err_hn;
 
 	/* Setup inside Container */
@@ -420,7 +452,7 @@ out:
 
 err_hn:
 	/* remove from HN */
-	run_net_script(h, VZCTL_NET_DEL, &ipadd, flags);
+	run_net_script(h, VZCTL_NET_DEL, &ipadd, flags, 0);
 
 	/* remove from kernel */
 	env_ip_ctl(h, VE_IP_DEL, &net->ip, 0, flags);
@@ -461,7 +493,8 @@ static int del_ip(struct vzctl_env_handle *h, struct vzctl_env_param *env, int f
 		}
 	}
 	/* Setup on node */
-	run_net_script(h, VZCTL_NET_DEL, &ipdel, flags);
+	run_net_script(h, VZCTL_NET_DEL, &ipdel, flags,
+			venet_ip_ctl(VE_IP_DEL, &ipdel, NULL) ? 0 : NET_NATIVE_ROUTE);
 	/* Setup inside Container */
 	if (!(flags & VZCTL_SKIP_CONFIGURE))
 		env_ip_configure(h, VZCTL_IP_DEL_CMD, &ipdel, delall, flags);
@@ -26,6 +26,12 @@
 
 #define HAVE_VZLIST_IOCTL	1
 
+#define VE_STATE_DIR		"/var/vz/veip"
+
+/* Node side network setup done by the library instead of the scripts */
+#define NET_NATIVE_ARP		0x1
+#define NET_NATIVE_ROUTE	0x2
+
 #include "list.h"
 
 struct vzctl_ip_param {
@@ -62,7 +68,8 @@ void free_ip_param(struct vzctl_ip_param *ip);
 char *ip_param2str(list_head_t *head);
 char *ip2str(const char *prefix, list_head_t *ip, int use_netmask);
 int run_net_script(struct vzctl_env_handle *h, const char *script,
-		list_head_t *ip, int skip_arpdetect);
+		list_head_t *ip, int flags, int native);
+int venet_ip_ctl(int op, list_head_t *ip, list_head_t *devs);
 int vzctl_get_env_ip(struct vzctl_env_handle *h, list_head_t *ip);
 int parse_netdev(list_head_t *netdev, const char *val, int replace);
 char *netdev2str(struct vzctl_netdev_param *old, struct vzctl_netdev_param *new);
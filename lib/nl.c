@@ -32,9 +32,18 @@
 #include <errno.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
+#include <ifaddrs.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/neighbour.h>
 
 #include "logger.h"
 #include "vzerror.h"
+#include "vztypes.h"
+#include "env.h"
+#include "net.h"
+#include "util.h"
+#include "arpsend.h"
 
 #define NLMSG_TAIL(nmsg) \
         ((struct rtattr *) (((char *) (nmsg)) + NLMSG_ALIGN((nmsg)->nlmsg_len)))
@@ -163,3 +172,544 @@ int setup_venet(void)
 
 	return 0;
 }
+
+/* Batched host route and proxy neighbour programming for venet addresses */
+
+#define NL_BATCH_SIZE	32768
+
+struct venet_addr {
+	int family;
+	int alen;
+	unsigned char addr[16];
+	int has_route;
+};
+
+struct nl_route {
+	int family;
+	unsigned char addr[16];
+	unsigned char table;
+	unsigned char tos;
+	int oif;
+	int prio;
+	int has_prio;
+};
+
+struct nl_neigh {
+	int family;
+	unsigned char addr[16];
+	int ifindex;
+};
+
+struct nl_batch {
+	int fd;
+	char buf[NL_BATCH_SIZE];
+	int len;
+	unsigned int seq;
+	int pending;
+	int errors;
+	int del;
+};
+
+struct venet_ctx {
+	struct venet_addr *addr;
+	int naddr;
+	struct nl_route *routes;
+	int nroutes;
+	struct nl_neigh *neigh;
+	int nneigh;
+	int venet_idx;
+};
+
+static int nl_open(void)
+{
+	struct sockaddr_nl nladdr = {.nl_family = AF_NETLINK};
+	int fd, one = 1, rcvbuf = 1024 * 1024;
+
+	fd = socket(PF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return vzctl_err(-1, errno, "Cannot open netlink socket");
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+#ifdef NETLINK_CAP_ACK
+	setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+#endif
+	if (bind(fd, (struct sockaddr *)&nladdr, sizeof(nladdr))) {
+		close(fd);
+		return vzctl_err(-1, errno, "Cannot bind netlink socket");
+	}
+
+	return fd;
+}
+
+static void parse_rtattr(struct rtattr *tb[], int max, struct rtattr *rta,
+		int len)
+{
+	memset(tb, 0, sizeof(struct rtattr *) * (max + 1));
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		if (rta->rta_type <= max)
+			tb[rta->rta_type] = rta;
+}
+
+static struct venet_addr *find_venet_addr(struct venet_ctx *ctx, int family,
+		const struct rtattr *dst)
+{
+	int i;
+
+	if (dst == NULL)
+		return NULL;
+
+	for (i = 0; i < ctx->naddr; i++)
+		if (ctx->addr[i].family == family &&
+				RTA_PAYLOAD(dst) == ctx->addr[i].alen &&
+				!memcmp(RTA_DATA(dst), ctx->addr[i].addr,
+					ctx->addr[i].alen))
+			return &ctx->addr[i];
+
+	return NULL;
+}
+
+static int nl_dump(int fd, int type, void *req, int len,
+		int (*fn)(struct nlmsghdr *h, void *data), void *data)
+{
+	struct nlmsghdr *h = req;
+	char buf[16384];
+	int n, ret = 0;
+
+	h->nlmsg_len = NLMSG_LENGTH(len);
+	h->nlmsg_type = type;
+	h->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	h->nlmsg_seq = 0;
+	if (send(fd, req, h->nlmsg_len, 0) < 0)
+		return vzctl_err(-1, errno, "Cannot send netlink dump request");
+
+	while (1) {
+		n = recv(fd, buf, sizeof(buf), 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return vzctl_err(-1, errno, "Cannot read netlink dump");
+		}
+
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, n);
+				h = NLMSG_NEXT(h, n))
+		{
+			if (h->nlmsg_type == NLMSG_DONE)
+				return ret;
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *e = NLMSG_DATA(h);
+
+				return vzctl_err(-1, -e->error,
+						"Netlink dump failed");
+			}
+			if (ret == 0)
+				ret = fn(h, data);
+		}
+	}
+}
+
+static int route_dump_fn(struct nlmsghdr *h, void *data)
+{
+	struct venet_ctx *ctx = data;
+	struct rtmsg *r = NLMSG_DATA(h);
+	struct rtattr *tb[RTA_MAX + 1];
+	struct venet_addr *a;
+	struct nl_route *rt;
+	int table, oif;
+
+	if (h->nlmsg_type != RTM_NEWROUTE || r->rtm_type != RTN_UNICAST)
+		return 0;
+
+	parse_rtattr(tb, RTA_MAX, RTM_RTA(r), RTM_PAYLOAD(h));
+	a = find_venet_addr(ctx, r->rtm_family, tb[RTA_DST]);
+	if (a == NULL || r->rtm_dst_len != a->alen * 8)
+		return 0;
+
+	oif = tb[RTA_OIF] ? *(int *)RTA_DATA(tb[RTA_OIF]) : 0;
+	if (oif == ctx->venet_idx)
+		a->has_route = 1;
+
+	table = tb[RTA_TABLE] ? *(int *)RTA_DATA(tb[RTA_TABLE]) : r->rtm_table;
+	if (table != RT_TABLE_MAIN)
+		return 0;
+
+	rt = realloc(ctx->routes, sizeof(*rt) * (ctx->nroutes + 1));
+	if (rt == NULL)
+		return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "route_dump_fn");
+	ctx->routes = rt;
+	rt = &ctx->routes[ctx->nroutes++];
+	memset(rt, 0, sizeof(*rt));
+	rt->family = a->family;
+	memcpy(rt->addr, a->addr, a->alen);
+	rt->table = r->rtm_table;
+	rt->tos = r->rtm_tos;
+	rt->oif = oif;
+	if (tb[RTA_PRIORITY]) {
+		rt->prio = *(int *)RTA_DATA(tb[RTA_PRIORITY]);
+		rt->has_prio = 1;
+	}
+
+	return 0;
+}
+
+static int neigh_dump_fn(struct nlmsghdr *h, void *data)
+{
+	struct venet_ctx *ctx = data;
+	struct ndmsg *nd = NLMSG_DATA(h);
+	struct rtattr *tb[NDA_MAX + 1];
+	struct venet_addr *a;
+	struct nl_neigh *n;
+
+	if (h->nlmsg_type != RTM_NEWNEIGH || !(nd->ndm_flags & NTF_PROXY))
+		return 0;
+
+	parse_rtattr(tb, NDA_MAX, (struct rtattr *)((char *)nd +
+				NLMSG_ALIGN(sizeof(*nd))),
+			h->nlmsg_len - NLMSG_LENGTH(sizeof(*nd)));
+	a = find_venet_addr(ctx, nd->ndm_family, tb[NDA_DST]);
+	if (a == NULL)
+		return 0;
+
+	n = realloc(ctx->neigh, sizeof(*n) * (ctx->nneigh + 1));
+	if (n == NULL)
+		return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "neigh_dump_fn");
+	ctx->neigh = n;
+	n = &ctx->neigh[ctx->nneigh++];
+	n->family = a->family;
+	memcpy(n->addr, a->addr, a->alen);
+	n->ifindex = nd->ndm_ifindex;
+
+	return 0;
+}
+
+static int dump_tables(int fd, struct venet_ctx *ctx)
+{
+	int i, ret;
+	const int family[] = {AF_INET, AF_INET6};
+
+	for (i = 0; i < sizeof(family) / sizeof(family[0]); i++) {
+		struct {
+			struct nlmsghdr h;
+			struct rtmsg r;
+		} rreq = {.r.rtm_family = family[i]};
+		struct {
+			struct nlmsghdr h;
+			struct ndmsg n;
+		} nreq = {.n.ndm_family = family[i], .n.ndm_flags = NTF_PROXY};
+
+		ret = nl_dump(fd, RTM_GETROUTE, &rreq, sizeof(rreq.r),
+				route_dump_fn, ctx);
+		if (ret)
+			return ret;
+		ret = nl_dump(fd, RTM_GETNEIGH, &nreq, sizeof(nreq.n),
+				neigh_dump_fn, ctx);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int batch_flush(struct nl_batch *b)
+{
+	char buf[16384];
+	struct nlmsghdr *h;
+	struct nlmsgerr *e;
+	int n;
+
+	if (b->pending == 0)
+		return 0;
+
+	if (send(b->fd, b->buf, b->len, 0) != b->len)
+		return vzctl_err(-1, errno, "Cannot send netlink request");
+	b->len = 0;
+
+	while (b->pending > 0) {
+		n = recv(b->fd, buf, sizeof(buf), 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return vzctl_err(-1, errno, "Cannot read netlink reply");
+		}
+
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, n);
+				h = NLMSG_NEXT(h, n))
+		{
+			if (h->nlmsg_type != NLMSG_ERROR)
+				continue;
+			b->pending--;
+			e = NLMSG_DATA(h);
+			/* already in the requested state */
+			if (e->error == 0 || (!b->del && e->error == -EEXIST) ||
+					(b->del && (e->error == -ESRCH ||
+						    e->error == -ENOENT)))
+				continue;
+			logger(-1, -e->error, "Netlink request %u failed",
+					h->nlmsg_seq);
+			b->errors++;
+		}
+	}
+
+	return 0;
+}
+
+static struct nlmsghdr *batch_msg(struct nl_batch *b, int type, int flags,
+		const void *hdr, int hlen)
+{
+	struct nlmsghdr *h;
+
+	/* room for the header and a couple of attributes */
+	if (b->len + NLMSG_SPACE(hlen) + 64 > sizeof(b->buf) && batch_flush(b))
+		return NULL;
+
+	h = (struct nlmsghdr *)(b->buf + b->len);
+	memset(h, 0, NLMSG_SPACE(hlen));
+	h->nlmsg_len = NLMSG_LENGTH(hlen);
+	h->nlmsg_type = type;
+	h->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	h->nlmsg_seq = ++b->seq;
+	memcpy(NLMSG_DATA(h), hdr, hlen);
+
+	return h;
+}
+
+static void batch_commit(struct nl_batch *b, struct nlmsghdr *h)
+{
+	b->len += NLMSG_ALIGN(h->nlmsg_len);
+	b->pending++;
+}
+
+static int get_route_src(unsigned int *src)
+{
+	char dev[STR_SIZE];
+	struct ifaddrs *ifaddr, *ifa;
+	int ret = 1;
+
+	if (get_global_param("VE_ROUTE_SRC_DEV", dev, sizeof(dev)) ||
+			dev[0] == '\0')
+		return 0;
+
+	if (getifaddrs(&ifaddr))
+		return vzctl_err(-1, errno, "getifaddrs");
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)ifa->ifa_addr;
+
+		if (sin == NULL || sin->sin_family != AF_INET ||
+				strcmp(ifa->ifa_name, dev) ||
+				(ntohl(sin->sin_addr.s_addr) >> 24) == 127)
+			continue;
+		*src = sin->sin_addr.s_addr;
+		ret = 0;
+		break;
+	}
+	freeifaddrs(ifaddr);
+
+	if (ret)
+		return vzctl_err(-1, 0, "Unable to get source ip [dev %s]", dev);
+
+	return 1;
+}
+
+static int route_add(struct nl_batch *b, struct venet_ctx *ctx,
+		struct venet_addr *a, const unsigned int *src)
+{
+	struct rtmsg r = {
+		.rtm_family = a->family,
+		.rtm_dst_len = a->alen * 8,
+		.rtm_table = RT_TABLE_MAIN,
+		.rtm_protocol = RTPROT_BOOT,
+		.rtm_scope = a->family == AF_INET ?
+			RT_SCOPE_LINK : RT_SCOPE_UNIVERSE,
+		.rtm_type = RTN_UNICAST,
+	};
+	struct nlmsghdr *h;
+
+	h = batch_msg(b, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL, &r, sizeof(r));
+	if (h == NULL)
+		return -1;
+	addattr_l(h, sizeof(b->buf) - b->len, RTA_DST, a->addr, a->alen);
+	addattr_l(h, sizeof(b->buf) - b->len, RTA_OIF, &ctx->venet_idx,
+			sizeof(int));
+	if (src != NULL && a->family == AF_INET)
+		addattr_l(h, sizeof(b->buf) - b->len, RTA_PREFSRC, src, 4);
+	batch_commit(b, h);
+
+	return 0;
+}
+
+static int route_del(struct nl_batch *b, struct nl_route *rt)
+{
+	struct rtmsg r = {
+		.rtm_family = rt->family,
+		.rtm_dst_len = rt->family == AF_INET ? 32 : 128,
+		.rtm_table = rt->table,
+		.rtm_tos = rt->tos,
+		.rtm_scope = RT_SCOPE_NOWHERE,
+	};
+	struct nlmsghdr *h;
+
+	h = batch_msg(b, RTM_DELROUTE, 0, &r, sizeof(r));
+	if (h == NULL)
+		return -1;
+	addattr_l(h, sizeof(b->buf) - b->len, RTA_DST, rt->addr,
+			r.rtm_dst_len / 8);
+	if (rt->oif)
+		addattr_l(h, sizeof(b->buf) - b->len, RTA_OIF, &rt->oif,
+				sizeof(int));
+	if (rt->has_prio)
+		addattr_l(h, sizeof(b->buf) - b->len, RTA_PRIORITY, &rt->prio,
+				sizeof(int));
+	batch_commit(b, h);
+
+	return 0;
+}
+
+static int neigh_ctl(struct nl_batch *b, int type, int family,
+		const void *addr, int ifindex)
+{
+	struct ndmsg nd = {
+		.ndm_family = family,
+		.ndm_ifindex = ifindex,
+		.ndm_state = NUD_PERMANENT,
+		.ndm_flags = NTF_PROXY,
+	};
+	struct nlmsghdr *h;
+
+	h = batch_msg(b, type, type == RTM_NEWNEIGH ?
+			NLM_F_CREATE | NLM_F_EXCL : 0, &nd, sizeof(nd));
+	if (h == NULL)
+		return -1;
+	addattr_l(h, sizeof(b->buf) - b->len, NDA_DST, addr,
+			family == AF_INET ? 4 : 16);
+	batch_commit(b, h);
+
+	return 0;
+}
+
+static int has_proxy(struct venet_ctx *ctx, struct venet_addr *a, int ifindex)
+{
+	int i;
+
+	for (i = 0; i < ctx->nneigh; i++)
+		if (ctx->neigh[i].ifindex == ifindex &&
+				ctx->neigh[i].family == a->family &&
+				!memcmp(ctx->neigh[i].addr, a->addr, a->alen))
+			return 1;
+
+	return 0;
+}
+
+static int init_venet_ctx(struct venet_ctx *ctx, list_head_t *ip)
+{
+	struct vzctl_ip_param *it;
+	struct venet_addr *a;
+	int n = 0;
+
+	list_for_each(it, ip, list)
+		n++;
+
+	ctx->addr = calloc(n, sizeof(struct venet_addr));
+	if (ctx->addr == NULL)
+		return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "init_venet_ctx");
+
+	list_for_each(it, ip, list) {
+		a = &ctx->addr[ctx->naddr];
+		a->family = get_netaddr(it->ip, (unsigned int *)a->addr);
+		if (a->family == -1)
+			return -1;
+		a->alen = a->family == AF_INET ? 4 : 16;
+		ctx->naddr++;
+	}
+
+	ctx->venet_idx = if_nametoindex("venet0");
+	if (ctx->venet_idx == 0)
+		return vzctl_err(-1, errno, "Unable to get venet0 index");
+
+	return 0;
+}
+
+static void free_venet_ctx(struct venet_ctx *ctx)
+{
+	free(ctx->addr);
+	free(ctx->routes);
+	free(ctx->neigh);
+}
+
+/* Reconcile host routes via venet0 and proxy ARP/NDP entries on the
+ * uplinks (list of struct arpsend_dev) with the address list in a single
+ * dump of the tables and one batched transaction.
+ * On VE_IP_DEL all main table routes and proxy entries for the addresses
+ * are removed, devs is not used.
+ */
+int venet_ip_ctl(int op, list_head_t *ip, list_head_t *devs)
+{
+	struct venet_ctx ctx = {};
+	struct nl_batch *b;
+	struct arpsend_dev *d;
+	unsigned int src, *psrc = NULL;
+	int i, ret;
+
+	if (list_empty(ip))
+		return 0;
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "venet_ip_ctl");
+	b->fd = -1;
+
+	ret = init_venet_ctx(&ctx, ip);
+	if (ret)
+		goto out;
+
+	if (op == VE_IP_ADD) {
+		ret = get_route_src(&src);
+		if (ret < 0)
+			goto out;
+		if (ret == 1)
+			psrc = &src;
+	}
+
+	b->fd = nl_open();
+	if (b->fd < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	ret = dump_tables(b->fd, &ctx);
+	if (ret)
+		goto out;
+
+	if (op == VE_IP_ADD) {
+		for (i = 0; i < ctx.naddr && ret == 0; i++) {
+			if (!ctx.addr[i].has_route)
+				ret = route_add(b, &ctx, &ctx.addr[i], psrc);
+			list_for_each(d, devs, list) {
+				if (ret || has_proxy(&ctx, &ctx.addr[i], d->ifindex))
+					continue;
+				ret = neigh_ctl(b, RTM_NEWNEIGH, ctx.addr[i].family,
+						ctx.addr[i].addr, d->ifindex);
+			}
+		}
+	} else {
+		b->del = 1;
+		for (i = 0; i < ctx.nroutes && ret == 0; i++)
+			ret = route_del(b, &ctx.routes[i]);
+		for (i = 0; i < ctx.nneigh && ret == 0; i++)
+			ret = neigh_ctl(b, RTM_DELNEIGH, ctx.neigh[i].family,
+					ctx.neigh[i].addr, ctx.neigh[i].ifindex);
+	}
+
+	if (ret == 0)
+		ret = batch_flush(b);
+	if (ret == 0 && b->errors)
+		ret = vzctl_err(-1, 0, "Failed to %s %d venet route/proxy"
+				" entries", op == VE_IP_ADD ? "add" : "remove",
+				b->errors);
+
+out:
+	if (b->fd != -1)
+		close(b->fd);
+	free(b);
+	free_venet_ctx(&ctx);
+
+	return ret;
+}
@@ -26,6 +26,12 @@
 #include <errno.h>
 #include <string.h>
 #include <limits.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/sysinfo.h>
 
 #include "libvzctl.h"
 #include "env.h"
@@ -35,6 +41,8 @@
 #include "util.h"
 #include "vzctl_param.h"
 #include "vcmm.h"
+#include "cgroup.h"
+#include "failcnt.h"
 
 void free_res_param(struct vzctl_res_param *res)
 {
@@ -147,35 +155,439 @@ static int get_ub_resources(ctid_t ctid, unsigned long *ram,
 	return 0;
 }
 
-int vzctl2_get_env_total_meminfo(unsigned long *limit_bytes, unsigned long *usage_bytes)
+enum {
+	MEMCG_LIMIT,
+	MEMCG_USAGE,
+	MEMCG_SWAP_LIMIT,
+	MEMCG_SWAP_USAGE,
+	MEMCG_MAX,
+	/* failure counters, optional */
+	MEMCG_FAILCNT = MEMCG_MAX,
+	MEMCG_SWAP_FAILCNT,
+	MEMCG_OOM_CONTROL,
+	MEMCG_NR_FILES,
+};
+
+static const char *memcg_files[MEMCG_NR_FILES] = {
+	CG_MEM_LIMIT,
+	CG_MEM_USAGE,
+	CG_SWAP_LIMIT,
+	CG_SWAP_USAGE,
+	"memory.failcnt",
+	"memory.memsw.failcnt",
+	"memory.oom_control",
+};
+
+/* Memory cgroup counters of the running CTs are kept open
+ * between calls and re-read with pread().
+ */
+struct memcg_fds {
+	list_elem_t list;
+	ctid_t ctid;
+	int fd[MEMCG_NR_FILES];
+	int seen;
+};
+
+static list_head_t memcg_fds_list = {
+	(list_elem_t *)&memcg_fds_list,
+	(list_elem_t *)&memcg_fds_list,
+};
+static pthread_mutex_t memcg_fds_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_memcg_fds(struct memcg_fds *m)
+{
+	int i;
+
+	for (i = 0; i < MEMCG_NR_FILES; i++)
+		if (m->fd[i] != -1)
+			close(m->fd[i]);
+	list_del(&m->list);
+	free(m);
+}
+
+static struct memcg_fds *open_memcg_fds(int dfd, const char *ctid)
+{
+	int i;
+	char path[PATH_MAX];
+	struct memcg_fds *m;
+
+	m = malloc(sizeof(struct memcg_fds));
+	if (m == NULL)
+		return NULL;
+
+	SET_CTID(m->ctid, ctid);
+	for (i = 0; i < MEMCG_NR_FILES; i++) {
+		snprintf(path, sizeof(path), "%s/%s", ctid, memcg_files[i]);
+		/* memsw and failure counters are optional */
+		m->fd[i] = openat(dfd, path, O_RDONLY | O_CLOEXEC);
+		if (m->fd[i] == -1 && i < MEMCG_SWAP_LIMIT) {
+			while (i-- > 0)
+				close(m->fd[i]);
+			free(m);
+			return NULL;
+		}
+	}
+	list_add_tail(&m->list, &memcg_fds_list);
+
+	return m;
+}
+
+static int read_memcg_fd(int fd, unsigned long long *val)
+{
+	int r;
+	char buf[32];
+
+	*val = 0;
+	if (fd == -1)
+		return 0;
+
+	r = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (r <= 0)
+		return -1;
+	buf[r] = '\0';
+
+	errno = 0;
+	*val = strtoull(buf, NULL, 10);
+
+	return errno == ERANGE ? -1 : 0;
+}
+
+static int read_memcg_fds(struct memcg_fds *m, void *data)
+{
+	unsigned long long *v = data;
+	int i;
+
+	for (i = 0; i < MEMCG_MAX; i++)
+		if (read_memcg_fd(m->fd[i], &v[i]))
+			return -1;
+
+	return 0;
+}
+
+static void memcg_fds_begin(void)
+{
+	struct memcg_fds *m;
+
+	pthread_mutex_lock(&memcg_fds_mtx);
+	list_for_each(m, &memcg_fds_list, list)
+		m->seen = 0;
+}
+
+static void memcg_fds_end(void)
+{
+	struct memcg_fds *m, *tmp;
+
+	/* drop fds of the stopped CTs */
+	list_for_each_safe(m, tmp, &memcg_fds_list, list)
+		if (!m->seen)
+			free_memcg_fds(m);
+	pthread_mutex_unlock(&memcg_fds_mtx);
+}
+
+/* Read the cached counters of the CT with read_fn(), the stale fds
+ * of a recreated cgroup are reopened in the same pass.
+ * Returns NULL if the CT is gone.
+ */
+static struct memcg_fds *get_memcg_fds(int dfd, const char *ctid,
+		int (*read_fn)(struct memcg_fds *m, void *data), void *data)
 {
-	int ret, i;
-	unsigned long ram[3], swap[3];
-	float limit = 0, usage = 0;
-	vzctl_ids_t *ids;
-
-	ids = vzctl2_alloc_env_ids();
-	if (ids == NULL)
-		return VZCTL_E_NOMEM;
-
-	ret = vzctl2_get_env_ids_by_state(ids, ENV_STATUS_RUNNING);
-	if (ret < 0) {
-		vzctl2_free_env_ids(ids);
-		return vzctl_err(VZCTL_E_SYSTEM, 0, "Faied to get thr running CT ids");
+	struct memcg_fds *m;
+
+	list_for_each(m, &memcg_fds_list, list)
+		if (!strcmp(m->ctid, ctid))
+			break;
+	if ((list_elem_t *)m == (list_elem_t *)&memcg_fds_list)
+		m = NULL;
+
+	if (m != NULL && read_fn(m, data)) {
+		/* the cgroup was recreated, reopen it */
+		free_memcg_fds(m);
+		m = NULL;
 	}
+	if (m == NULL) {
+		m = open_memcg_fds(dfd, ctid);
+		if (m == NULL)
+			return NULL;
+		if (read_fn(m, data)) {
+			/* the CT is gone */
+			free_memcg_fds(m);
+			return NULL;
+		}
+	}
+	m->seen = 1;
+
+	return m;
+}
+
+static int is_ctid_dir(const char *name)
+{
+	ctid_t ctid;
+	const char *p;
+
+	if (vzctl2_get_normalized_ctid(name, ctid, sizeof(ctid)) == 0)
+		return 1;
+
+	for (p = name; *p != '\0'; p++)
+		if (!isdigit(*p))
+			return 0;
+
+	return p != name;
+}
+
+int vzctl2_get_node_meminfo(struct vzctl_node_meminfo *info, int size,
+		struct vzctl_env_meminfo_stat **cts, int *n)
+{
+	int ret = 0, ncts = 0, nalloc = 0;
+	char path[PATH_MAX];
+	struct sysinfo si;
+	struct vzctl_node_meminfo data = {};
+	struct vzctl_env_meminfo_stat *stat = NULL;
+	struct memcg_fds *m;
+	struct dirent *de;
+	DIR *dir;
+
+	if (sysinfo(&si))
+		return vzctl_err(VZCTL_E_SYSTEM, errno, "sysinfo");
+
+	data.ram_total = (unsigned long long)si.totalram * si.mem_unit;
+	data.swap_total = (unsigned long long)si.totalswap * si.mem_unit;
+
+	ret = cg_get_slice_path(CG_MEMORY, path, sizeof(path));
+	if (ret)
+		return vzctl_err(VZCTL_E_SYSTEM, 0,
+				"Unable to find memory cgroup mount point");
+
+	dir = opendir(path);
+	if (dir == NULL)
+		return vzctl_err(VZCTL_E_SYSTEM, errno, "Unable to open %s", path);
+
+	memcg_fds_begin();
+	while ((de = readdir(dir)) != NULL) {
+		unsigned long long v[MEMCG_MAX];
+
+		if (de->d_type != DT_DIR || !is_ctid_dir(de->d_name))
+			continue;
+
+		m = get_memcg_fds(dirfd(dir), de->d_name, read_memcg_fds, v);
+		if (m == NULL)
+			continue;
+
+		if (v[MEMCG_LIMIT] > data.ram_total)
+			v[MEMCG_LIMIT] = data.ram_total;
+		if (v[MEMCG_SWAP_LIMIT] > data.ram_total + data.swap_total)
+			v[MEMCG_SWAP_LIMIT] = data.ram_total + data.swap_total;
+
+		data.limit += v[MEMCG_LIMIT];
+		data.usage += v[MEMCG_USAGE];
+		data.swap_limit += v[MEMCG_SWAP_LIMIT];
+		data.swap_usage += v[MEMCG_SWAP_USAGE];
+		ncts++;
 
-	for (i = 0; i < ret; i++) {
-		if (get_ub_resources_proc(ids->ids[i], ram, swap) == 0) {
-			limit += ram[1];
-			usage += ram[2];
+		if (cts == NULL)
+			continue;
+
+		if (ncts > nalloc) {
+			struct vzctl_env_meminfo_stat *t;
+
+			nalloc = nalloc ? nalloc * 2 : 64;
+			t = realloc(stat, nalloc * sizeof(*stat));
+			if (t == NULL) {
+				ret = vzctl_err(VZCTL_E_NOMEM, ENOMEM,
+						"vzctl2_get_node_meminfo");
+				break;
+			}
+			stat = t;
 		}
+		SET_CTID(stat[ncts - 1].ctid, m->ctid);
+		stat[ncts - 1].limit = v[MEMCG_LIMIT];
+		stat[ncts - 1].usage = v[MEMCG_USAGE];
+		stat[ncts - 1].swap_limit = v[MEMCG_SWAP_LIMIT];
+		stat[ncts - 1].swap_usage = v[MEMCG_SWAP_USAGE];
+	}
+
+	memcg_fds_end();
+	closedir(dir);
+
+	if (ret) {
+		free(stat);
+		return ret;
 	}
 
-	limit *= 4096;
-	usage *= 4096;
-	*limit_bytes = (unsigned long)(limit > ULONG_MAX ? ULONG_MAX : limit);
-	*usage_bytes = (unsigned long)(usage > ULONG_MAX ? ULONG_MAX : usage);
-	vzctl2_free_env_ids(ids);
+	data.ncts = ncts;
+	if (data.ram_total)
+		data.overcommit = (float)data.limit / data.ram_total;
+	if (data.ram_total + data.swap_total)
+		data.swap_overcommit = (float)data.swap_limit /
+				(data.ram_total + data.swap_total);
+
+	memcpy(info, &data, size < sizeof(data) ? size : sizeof(data));
+	if (cts != NULL) {
+		*cts = stat;
+		*n = ncts;
+	}
+
+	return 0;
+}
+
+static int read_ub_failcnt(struct failcnt_snap *s)
+{
+	FILE *fp;
+	char buf[STR_SIZE];
+	char id[STR_SIZE] = "";
+	char name[64];
+	char *p;
+	unsigned long long held, maxheld, barrier, limit, failcnt;
+	int ret = 0;
+
+	fp = fopen(PROCUBC, "r");
+	if (fp == NULL)
+		return errno == ENOENT ? 0 :
+			vzctl_err(VZCTL_E_SYSTEM, errno, "Unable to open " PROCUBC);
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		/* "   <ctid>:  <res> held maxheld barrier limit failcnt"
+		 * the id is present on the first line of each CT
+		 */
+		p = buf;
+		while (isspace(*p))
+			p++;
+		if (!isalnum(*p))
+			continue;
+
+		if (sscanf(p, "%63s", name) == 1 &&
+				name[strlen(name) - 1] == ':')
+		{
+			name[strlen(name) - 1] = '\0';
+			snprintf(id, sizeof(id), "%s", name);
+			p += strlen(name) + 1;
+		}
+
+		if (id[0] == '\0' || !strcmp(id, "0") ||
+				sscanf(p, "%63s%llu%llu%llu%llu%llu", name, &held,
+					&maxheld, &barrier, &limit, &failcnt) != 6)
+			continue;
+
+		ret = add_failcnt_entry(s, id, name, failcnt);
+		if (ret)
+			break;
+	}
+	fclose(fp);
+
+	return ret;
+}
+
+struct memcg_failcnt {
+	unsigned long long v[MEMCG_NR_FILES - MEMCG_FAILCNT];
+	int has[MEMCG_NR_FILES - MEMCG_FAILCNT];
+};
+
+static int read_memcg_failcnt_fds(struct memcg_fds *m, void *data)
+{
+	struct memcg_failcnt *f = data;
+	char buf[STR_SIZE];
+	char *p;
+	int i, r;
+
+	for (i = MEMCG_FAILCNT; i < MEMCG_OOM_CONTROL; i++) {
+		f->has[i - MEMCG_FAILCNT] = m->fd[i] != -1;
+		if (read_memcg_fd(m->fd[i], &f->v[i - MEMCG_FAILCNT]))
+			return -1;
+	}
+
+	/* oom_kill is reported by newer kernels only */
+	i = MEMCG_OOM_CONTROL - MEMCG_FAILCNT;
+	f->has[i] = 0;
+	if (m->fd[MEMCG_OOM_CONTROL] == -1)
+		return 0;
+	r = pread(m->fd[MEMCG_OOM_CONTROL], buf, sizeof(buf) - 1, 0);
+	if (r <= 0)
+		return -1;
+	buf[r] = '\0';
+	for (p = buf; p != NULL; p = strchr(p, '\n')) {
+		if (*p == '\n')
+			p++;
+		if (sscanf(p, "oom_kill %llu", &f->v[i]) == 1) {
+			f->has[i] = 1;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int read_memcg_failcnt(struct failcnt_snap *s)
+{
+	char path[PATH_MAX];
+	struct memcg_failcnt f;
+	struct memcg_fds *m;
+	struct dirent *de;
+	DIR *dir;
+	int i, ret = 0;
+
+	if (cg_get_slice_path(CG_MEMORY, path, sizeof(path)))
+		return 0;
+
+	dir = opendir(path);
+	if (dir == NULL)
+		return vzctl_err(VZCTL_E_SYSTEM, errno, "Unable to open %s", path);
+
+	memcg_fds_begin();
+	while (ret == 0 && (de = readdir(dir)) != NULL) {
+		if (de->d_type != DT_DIR || !is_ctid_dir(de->d_name))
+			continue;
+
+		m = get_memcg_fds(dirfd(dir), de->d_name,
+				read_memcg_failcnt_fds, &f);
+		if (m == NULL)
+			continue;
+
+		for (i = 0; ret == 0 && i < MEMCG_NR_FILES - MEMCG_FAILCNT; i++) {
+			if (!f.has[i])
+				continue;
+			ret = add_failcnt_entry(s, m->ctid,
+					i == MEMCG_OOM_CONTROL - MEMCG_FAILCNT ?
+					"memory.oom_kill" :
+					memcg_files[MEMCG_FAILCNT + i], f.v[i]);
+		}
+	}
+	memcg_fds_end();
+	closedir(dir);
+
+	return ret;
+}
+
+int vzctl2_get_failcnt_delta(struct vzctl_failcnt_cursor *c,
+		struct vzctl_failcnt **out, int *n)
+{
+	struct failcnt_snap s = {};
+	int ret;
+
+	*out = NULL;
+	*n = 0;
+
+	ret = read_ub_failcnt(&s);
+	if (ret == 0)
+		ret = read_memcg_failcnt(&s);
+	if (ret) {
+		free(s.e);
+		return ret;
+	}
+
+	return merge_failcnt_snap(c, &s, out, n);
+}
+
+int vzctl2_get_env_total_meminfo(unsigned long *limit_bytes, unsigned long *usage_bytes)
+{
+	int ret;
+	struct vzctl_node_meminfo info;
+
+	ret = vzctl2_get_node_meminfo(&info, sizeof(info), NULL, NULL);
+	if (ret)
+		return ret;
+
+	*limit_bytes = info.limit > ULONG_MAX ? ULONG_MAX : info.limit;
+	*usage_bytes = info.usage > ULONG_MAX ? ULONG_MAX : info.usage;
+
 	return 0;
 }
 
@@ -27,6 +27,7 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include "logger.h"
 #include "env.h"
@@ -34,11 +35,119 @@
 #include "cgroup.h"
 #include "vzerror.h"
 #include "util.h"
+#include "sysfs_perm.h"
 
-int add_sysfs_dir(struct vzctl_env_handle *h, const char *sysfs,
+struct sysfs_rule {
+	list_elem_t list;
+	struct sysfs_rule *next;	/* hash chain */
+	char *path;
+	char mode[4];
+	const void **owners;
+	int nowners;
+	int failed;
+};
+
+void sysfs_perm_init(struct sysfs_perm_set *set)
+{
+	list_head_init(&set->rules);
+	memset(set->hash, 0, sizeof(set->hash));
+	set->n = 0;
+	set->owner = NULL;
+}
+
+static void free_rule(struct sysfs_rule *r)
+{
+	free(r->owners);
+	free(r->path);
+	free(r);
+}
+
+void sysfs_perm_free(struct sysfs_perm_set *set)
+{
+	struct sysfs_rule *r, *tmp;
+
+	list_for_each_safe(r, tmp, &set->rules, list) {
+		list_del(&r->list);
+		free_rule(r);
+	}
+	memset(set->hash, 0, sizeof(set->hash));
+	set->n = 0;
+}
+
+static unsigned int hash_path(const char *path)
+{
+	unsigned int h = 5381;
+
+	while (*path != '\0')
+		h = h * 33 + (unsigned char)*path++;
+
+	return h % SYSFS_PERM_HASH_SIZE;
+}
+
+static int is_rule_owner(struct sysfs_rule *r, const void *owner)
+{
+	int i;
+
+	for (i = 0; i < r->nowners; i++)
+		if (r->owners[i] == owner)
+			return 1;
+
+	return 0;
+}
+
+static int add_rule_owner(struct sysfs_rule *r, const void *owner)
+{
+	const void **tmp;
+
+	if (is_rule_owner(r, owner))
+		return 0;
+
+	tmp = realloc(r->owners, (r->nowners + 1) * sizeof(*tmp));
+	if (tmp == NULL)
+		return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "sysfs_perm_add");
+	r->owners = tmp;
+	r->owners[r->nowners++] = owner;
+
+	return 0;
+}
+
+/* Add the rule, the rule for the same path is shared by all its owners
+ * and written once, the mode is updated in place
+ */
+int sysfs_perm_add(struct sysfs_perm_set *set, const char *path,
+		const char *mode)
+{
+	unsigned int h = hash_path(path);
+	struct sysfs_rule *r;
+
+	for (r = set->hash[h]; r != NULL; r = r->next) {
+		if (!strcmp(r->path, path)) {
+			snprintf(r->mode, sizeof(r->mode), "%s", mode);
+			return add_rule_owner(r, set->owner);
+		}
+	}
+
+	r = calloc(1, sizeof(struct sysfs_rule));
+	if (r == NULL)
+		return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "sysfs_perm_add");
+	r->path = strdup(path);
+	if (r->path == NULL || add_rule_owner(r, set->owner)) {
+		free_rule(r);
+		return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "sysfs_perm_add");
+	}
+	snprintf(r->mode, sizeof(r->mode), "%s", mode);
+	r->next = set->hash[h];
+	set->hash[h] = r;
+	list_add_tail(&r->list, &set->rules);
+	set->n++;
+
+	return 0;
+}
+
+int sysfs_perm_add_dir(struct sysfs_perm_set *set, const char *sysfs,
 		const char *devname, const char *mode)
 {
-	char buf[PATH_MAX];
+	int ret;
 	char t[PATH_MAX];
 	char *p;
 
@@ -49,26 +158,25 @@ int add_sysfs_dir(struct vzctl_env_handle *h, const char *sysfs,
 
 	for (p = strchr(t, '/'); p != NULL; p = strchr(p, '/')) {
 		*p = '\0';
-		snprintf(buf, sizeof(buf), "%s %s", t, mode);
-		if (cg_set_param(EID(h), CG_VE, "ve.sysfs_permissions", buf))
-			return VZCTL_E_SYSFS_PERM;
+		ret = sysfs_perm_add(set, t, mode);
+		if (ret)
+			return ret;
 		*p++ = '/';
 	}
 
 	return 0;
 }
 
-int add_sysfs_entry(struct vzctl_env_handle *h, const char *sysfs)
+int sysfs_perm_add_entry(struct sysfs_perm_set *set, const char *sysfs)
 {
 	char path[PATH_MAX];
 	struct dirent **namelist;
 	struct stat st;
-	int n;
-	int ret = 0;
+	int i, n, ret;
 
-	snprintf(path, sizeof(path), "%s rx", sysfs);
-	if (cg_set_param(EID(h), CG_VE, "ve.sysfs_permissions", path))
-		return VZCTL_E_SYSFS_PERM;
+	ret = sysfs_perm_add(set, sysfs, "rx");
+	if (ret)
+		return ret;
 
 	snprintf(path, sizeof(path), "/sys/%s", sysfs);
 	if (lstat(path, &st))
@@ -82,20 +190,125 @@ int add_sysfs_entry(struct vzctl_env_handle *h, const char *sysfs)
 		return vzctl_err(VZCTL_E_SYSTEM, errno, "Unable to open %s",
 				path);
 
-	while (n--) {
-		if (strcmp(namelist[n]->d_name, ".") == 0 ||
-				strcmp(namelist[n]->d_name, "..") == 0)
+	for (i = 0; i < n; i++) {
+		if (ret == 0 && strcmp(namelist[i]->d_name, ".") &&
+				strcmp(namelist[i]->d_name, ".."))
+		{
+			snprintf(path, sizeof(path), "%s/%s", sysfs,
+					namelist[i]->d_name);
+			ret = sysfs_perm_add(set, path,
+					!strcmp(namelist[i]->d_name, "uevent") ?
+						"rw" : "rx");
+		}
+		free(namelist[i]);
+	}
+	free(namelist);
+
+	return ret;
+}
+
+/* Release the rules of the owner, e.g. of a disk that failed to set up,
+ * the rules still held by other owners are kept
+ */
+void sysfs_perm_drop(struct sysfs_perm_set *set, const void *owner)
+{
+	struct sysfs_rule *r, *tmp, **p;
+	int i;
+
+	list_for_each_safe(r, tmp, &set->rules, list) {
+		for (i = 0; i < r->nowners; i++) {
+			if (r->owners[i] == owner) {
+				r->owners[i] = r->owners[--r->nowners];
+				break;
+			}
+		}
+		if (r->nowners != 0)
 			continue;
 
-		snprintf(path, sizeof(path), "%s/%s %s",
-			sysfs, namelist[n]->d_name,
-			!strcmp(namelist[n]->d_name, "uevent") ? "rw" : "rx");
-		if (cg_set_param(EID(h), CG_VE, "ve.sysfs_permissions", path))
-			ret = VZCTL_E_SYSFS_PERM;
+		for (p = &set->hash[hash_path(r->path)]; *p != r;
+				p = &(*p)->next)
+			;
+		*p = r->next;
+		list_del(&r->list);
+		free_rule(r);
+		set->n--;
+	}
+}
+
+/* Returns 1 if any rule of the owner failed to apply */
+int sysfs_perm_failed(struct sysfs_perm_set *set, const void *owner)
+{
+	struct sysfs_rule *r;
+
+	list_for_each(r, &set->rules, list)
+		if (r->failed && is_rule_owner(r, owner))
+			return 1;
+
+	return 0;
+}
+
+/* Push all the rules through a single ve.sysfs_permissions fd.
+ * The rules are applied best effort, the failed ones are marked
+ * so the caller can check them per owner.
+ */
+int sysfs_perm_apply(struct vzctl_env_handle *h, struct sysfs_perm_set *set)
+{
+	int fd = -1, ret = 0;
+	char path[PATH_MAX];
+	char buf[PATH_MAX + 8];
+	struct sysfs_rule *r;
+
+	if (set->n == 0)
+		return 0;
 
-		free(namelist[n]);
+	if (cg_get_path(EID(h), CG_VE, "ve.sysfs_permissions", path,
+				sizeof(path)) == 0)
+	{
+		fd = open(path, O_WRONLY | O_CLOEXEC);
+		if (fd == -1)
+			logger(-1, errno, "Can't open %s for writing", path);
 	}
-	free(namelist);
+
+	logger(3, 0, "Apply %d sysfs permission rules", set->n);
+	list_for_each(r, &set->rules, list) {
+		int len = snprintf(buf, sizeof(buf), "%s %s", r->path, r->mode);
+
+		if (fd == -1 || do_write_data(fd, path, buf, len)) {
+			r->failed = 1;
+			ret = VZCTL_E_SYSFS_PERM;
+		}
+	}
+	if (fd != -1)
+		close(fd);
+
+	return ret;
+}
+
+int add_sysfs_dir(struct vzctl_env_handle *h, const char *sysfs,
+		const char *devname, const char *mode)
+{
+	int ret;
+	struct sysfs_perm_set set;
+
+	sysfs_perm_init(&set);
+	ret = sysfs_perm_add_dir(&set, sysfs, devname, mode);
+	if (ret == 0)
+		ret = sysfs_perm_apply(h, &set);
+	sysfs_perm_free(&set);
+
+	return ret ? VZCTL_E_SYSFS_PERM : 0;
+}
+
+int add_sysfs_entry(struct vzctl_env_handle *h, const char *sysfs)
+{
+	int ret;
+	struct sysfs_perm_set set;
+
+	sysfs_perm_init(&set);
+	ret = sysfs_perm_add_entry(&set, sysfs);
+	if (ret == 0)
+		ret = sysfs_perm_apply(h, &set);
+	sysfs_perm_free(&set);
 
 	return ret;
 }
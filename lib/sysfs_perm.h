@@ -22,8 +22,33 @@
 #ifndef __SYSFS_PERM_H__
 #define __SYSFS_PERM_H__
 
+#include "list.h"
+
 struct vzctl_env_handle;
+struct sysfs_rule;
+
+#define SYSFS_PERM_HASH_SIZE	128
 
+/* Set of ve.sysfs_permissions rules collected for one apply,
+ * a rule is kept once per path together with the list of its owners
+ */
+struct sysfs_perm_set {
+	list_head_t rules;
+	struct sysfs_rule *hash[SYSFS_PERM_HASH_SIZE];
+	int n;
+	const void *owner;	/* owner of the rules added next */
+};
+
+void sysfs_perm_init(struct sysfs_perm_set *set);
+void sysfs_perm_free(struct sysfs_perm_set *set);
+int sysfs_perm_add(struct sysfs_perm_set *set, const char *path,
+		const char *mode);
+int sysfs_perm_add_dir(struct sysfs_perm_set *set, const char *sysfs,
+		const char *devname, const char *mode);
+int sysfs_perm_add_entry(struct sysfs_perm_set *set, const char *sysfs);
+int sysfs_perm_apply(struct vzctl_env_handle *h, struct sysfs_perm_set *set);
+void sysfs_perm_drop(struct sysfs_perm_set *set, const void *owner);
+int sysfs_perm_failed(struct sysfs_perm_set *set, const void *owner);
 int add_sysfs_dir(struct vzctl_env_handle *h, const char *sysfs,
 		const char *devname, const char *mode);
 int add_sysfs_entry(struct vzctl_env_handle *h, const char *sysfs);
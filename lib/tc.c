@@ -26,6 +26,10 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <net/if.h>
 #include <sys/ioctl.h>
 #include <linux/vzctl_netstat.h>
 
@@ -38,6 +42,7 @@
 #include "vz.h"
 #include "env.h"
 #include "exec.h"
+#include "tc_batch.h"
 
 struct vzctl_rate *alloc_rate()
 {
@@ -191,6 +196,500 @@ int tc_get_base(struct vzctl_env_handle *h, int *tc_base)
 	return 0;
 }
 
+/* Native shaping setup.
+ *
+ * The CT classes and filters are modelled as a set of (dev, net class,
+ * rate, ceil, mpu) entries. The wanted set is built from BANDWIDTH,
+ * TOTALRATE, RATE and RATEMPU the same way vz-setrate does, the
+ * installed set is read back from 'tc class show', and only the
+ * difference is applied with a single 'tc -batch' run: changed classes
+ * are updated in place so the CT is never left unshaped. The result is
+ * verified by reading the configuration back again.
+ *
+ * Anything the model does not cover (missing root classes, invalid
+ * configuration, verification mismatch) makes the caller fall back to
+ * the full rebuild done by vz-setrate, which also reports the errors.
+ */
+#define TC_CMD			"/usr/sbin/tc"
+#define TC_CLASSES_DB		"/var/run/vz_tc_classes"
+#define TC_CLASSES_LOCK		"/var/lock/vz_tc_classes.lock"
+#define TC_IP_CLASSES		VZ_ENV_CONF_DIR "networks_classes"
+#define TC_BATCH_FILE		"/var/run/vz_tc_batch.XXXXXX"
+#define TC_MAGIC_NUM		10000
+#define TC_MAX_CLASS		60000
+#define TC_ATTEMPTS		10
+#define TC_DEFAULT_MPU		1000
+#define TC_LOCK_TIMEOUT		10000	/* msec */
+
+static int get_ip_classes(unsigned int *mask)
+{
+	FILE *fp;
+	char buf[STR_SIZE];
+	int n;
+
+	*mask = 0;
+	if ((fp = fopen(TC_IP_CLASSES, "r")) == NULL)
+		return vzctl_err(-1, errno, "Unable to open " TC_IP_CLASSES);
+	while (fgets(buf, sizeof(buf), fp) != NULL)
+		if (buf[0] >= '1' && buf[0] <= '9' &&
+				sscanf(buf, "%d", &n) == 1 &&
+				n > 0 && n < TC_MAX_CLASSES)
+			*mask |= 1U << n;
+	fclose(fp);
+
+	return 0;
+}
+
+/* Build the wanted class set the same way vzadd_ve_sh_classes does */
+static int build_tc_shape(struct tc_shape *s, const char *bandwidth,
+		const char *totalrate, const char *rate, const char *ratempu,
+		int ratebound)
+{
+	struct tc_rate_ent total[TC_MAX_ENTS];
+	struct tc_rate_ent rates[TC_MAX_ENTS];
+	struct tc_rate_ent mpus[TC_MAX_ENTS];
+	char buf[STR_MAX];
+	char path[PATH_MAX];
+	char *token, *savedptr, *p;
+	unsigned int ip_classes, total_classes = 0;
+	int i, j, ntotal, nrates, nmpus;
+
+	snprintf(buf, sizeof(buf), "%s", bandwidth);
+	for (token = strtok_r(buf, LIST_DELIMITERS, &savedptr); token != NULL;
+			token = strtok_r(NULL, LIST_DELIMITERS, &savedptr))
+	{
+		if ((p = strchr(token, ':')) != NULL)
+			*p = '\0';
+		if (*token == '\0' || strlen(token) >= IFNAMSIZ ||
+				s->ndevs == TC_MAX_DEVS)
+			return -1;
+		snprintf(path, sizeof(path), "/sys/class/net/%s", token);
+		if (!stat_file(path))
+			return -1;
+		if (tc_find_dev(s, token) == -1)
+			strcpy(s->devs[s->ndevs++], token);
+	}
+
+	if ((ntotal = parse_tc_list(s, totalrate, total, TC_MAX_ENTS)) < 0 ||
+			(nrates = parse_tc_list(s, rate, rates, TC_MAX_ENTS)) < 0 ||
+			(nmpus = parse_tc_list(s, ratempu, mpus, TC_MAX_ENTS)) < 0)
+		return -1;
+
+	if (get_ip_classes(&ip_classes))
+		return -1;
+
+	for (i = 0; i < ntotal; i++) {
+		if (!total[i].has_val || tc_find_dev(s, total[i].dev) == -1 ||
+				!(ip_classes & (1U << total[i].net_class)))
+			return -1;
+		total_classes |= 1U << total[i].net_class;
+	}
+	for (i = 0; i < nrates; i++)
+		if (!rates[i].has_val ||
+				!(total_classes & (1U << rates[i].net_class)) ||
+				tc_find_rate_ent(total, ntotal, rates[i].dev,
+					rates[i].net_class) == -1)
+			return -1;
+	for (i = 0; i < nmpus; i++)
+		if (!(total_classes & (1U << mpus[i].net_class)) ||
+				tc_find_rate_ent(total, ntotal, mpus[i].dev,
+					mpus[i].net_class) == -1)
+			return -1;
+
+	for (i = 0; i < nrates; i++) {
+		struct tc_class_ent *e = &s->want[s->nwant++];
+
+		j = tc_find_rate_ent(total, ntotal, rates[i].dev,
+				rates[i].net_class);
+		e->dev = tc_find_dev(s, rates[i].dev);
+		e->net_class = rates[i].net_class;
+		e->ceil = total[j].val;
+		e->rate = ratebound ? rates[i].val : total[j].val;
+		j = tc_find_rate_ent(mpus, nmpus, rates[i].dev,
+				rates[i].net_class);
+		if (j != -1)
+			e->mpu = mpus[j].has_val ? mpus[j].val : TC_DEFAULT_MPU;
+	}
+
+	return 0;
+}
+
+/* Mark the filters of the installed classes attached at parent:0 */
+static int read_tc_filters_parent(struct tc_shape *s, int dev,
+		unsigned int parent)
+{
+	FILE *fp;
+	char buf[STR_SIZE], proto[16], sparent[16];
+	char *argv[] = {TC_CMD, "filter", "show", "dev", s->devs[dev],
+		"parent", sparent, NULL};
+	unsigned int p, handle, maj, min;
+	int j, pref, leaf, net_class;
+	char *h, *c;
+
+	snprintf(sparent, sizeof(sparent), "%x:", parent);
+	if ((fp = vzctl_popen(argv, NULL, CLOSE_STDERR)) == NULL)
+		return -1;
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		/* filter parent 1: protocol ip pref 1 fw [chain 0]
+		 *	handle 0x2711 classid 1:2
+		 */
+		if (sscanf(buf, "filter parent %x: protocol %15s pref %d",
+					&p, proto, &pref) != 3 || p != parent ||
+				(h = strstr(buf, " handle 0x")) == NULL ||
+				sscanf(h, " handle 0x%x", &handle) != 1 ||
+				(c = strstr(buf, " classid ")) == NULL ||
+				sscanf(c, " classid %x:%x", &maj, &min) != 2 ||
+				maj != parent)
+			continue;
+
+		net_class = handle - s->mark;
+		leaf = (parent != 1);
+		if (leaf ? (net_class + 1 != parent || min != s->tc_class) :
+				min != net_class + 1)
+			continue;
+		j = tc_find_ent(s->cur, s->ncur, dev, net_class);
+		if (j != -1)
+			s->cur[j].filters |= TC_FILTER_BIT(
+					!strcmp(proto, "ipv6"), leaf);
+	}
+	if (vzctl_pclose(fp))
+		return vzctl_err(-1, 0, "Unable to read tc filters on %s",
+				s->devs[dev]);
+
+	return 0;
+}
+
+/* A class can lose its filters independently, e.g. by a manual
+ * 'tc filter del', so the filters are read back along with the classes.
+ */
+static int read_tc_filters(struct tc_shape *s)
+{
+	int i, j, found;
+
+	for (i = 0; i < s->ndevs; i++) {
+		found = 0;
+		for (j = 0; j < s->ncur; j++) {
+			if (s->cur[j].dev != i)
+				continue;
+			found = 1;
+			if (read_tc_filters_parent(s, i,
+						s->cur[j].net_class + 1))
+				return -1;
+		}
+		if (found && read_tc_filters_parent(s, i, 1))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int read_tc_classes(struct tc_shape *s)
+{
+	FILE *fp;
+	char buf[STR_SIZE];
+	unsigned int maj, min;
+	int i;
+
+	s->ncur = 0;
+	for (i = 0; i < s->ndevs; i++) {
+		char *argv[] = {TC_CMD, "class", "show", "dev", s->devs[i],
+			NULL};
+
+		s->roots[i] = 0;
+		if ((fp = vzctl_popen(argv, NULL, CLOSE_STDERR)) == NULL)
+			return -1;
+		while (fgets(buf, sizeof(buf), fp) != NULL) {
+			struct tc_class_ent *e;
+
+			if (sscanf(buf, "class htb %x:%x", &maj, &min) != 2)
+				continue;
+			if (maj == 1) {
+				if (min > 1 && min <= TC_MAX_CLASSES)
+					s->roots[i] |= 1U << (min - 1);
+				continue;
+			}
+			if (min != s->tc_class || maj < 2 ||
+					maj > TC_MAX_CLASSES ||
+					s->ncur == TC_MAX_ENTS)
+				continue;
+			e = &s->cur[s->ncur];
+			e->dev = i;
+			e->net_class = maj - 1;
+			if (parse_tc_rate(buf, " rate ", &e->rate) ||
+					parse_tc_rate(buf, " ceil ", &e->ceil))
+				continue;
+			e->mpu = 0;
+			e->filters = 0;
+			s->ncur++;
+		}
+		if (vzctl_pclose(fp))
+			return vzctl_err(-1, 0, "Unable to read tc classes"
+					" on %s", s->devs[i]);
+	}
+
+	return read_tc_filters(s);
+}
+
+static int get_hz(void)
+{
+	FILE *fp;
+	unsigned int hz = 0;
+
+	if ((fp = fopen("/proc/net/psched", "r")) != NULL) {
+		if (fscanf(fp, "%*x %*x %*x %x", &hz) != 1)
+			hz = 0;
+		fclose(fp);
+	}
+
+	return hz ? hz : 100;
+}
+
+static int run_tc_batch(struct tc_batch *b)
+{
+	char fname[] = TC_BATCH_FILE;
+	char buf[STR_SIZE];
+	char *argv[] = {TC_CMD, "-force", "-batch", fname, NULL};
+	FILE *fp;
+	int fd, ret;
+
+	if ((fd = mkstemp(fname)) == -1)
+		return vzctl_err(-1, errno, "Unable to create %s", fname);
+	ret = write(fd, b->buf, b->len);
+	close(fd);
+	if (ret != (int)b->len) {
+		logger(-1, errno, "Unable to write %s", fname);
+		unlink(fname);
+		return -1;
+	}
+
+	logger(2, 0, "tc batch:\n%s", b->buf);
+	fp = vzctl_popen(argv, NULL, 0);
+	if (fp != NULL) {
+		while (fgets(buf, sizeof(buf), fp) != NULL)
+			logger(1, 0, "tc: %s", buf);
+		/* with -force the errors are reported but not fatal,
+		 * the result is checked by reading the classes back */
+		vzctl_pclose(fp);
+	}
+	unlink(fname);
+
+	return fp != NULL ? 0 : -1;
+}
+
+static int verify_tc_classes(struct tc_shape *s)
+{
+	struct tc_class_ent *e;
+	int i, j;
+
+	if (read_tc_classes(s))
+		return -1;
+	for (i = 0; i < s->nwant; i++) {
+		e = &s->want[i];
+		j = tc_find_ent(s->cur, s->ncur, e->dev, e->net_class);
+		if (j == -1 || !tc_rate_eq(s->cur[j].rate, e->rate) ||
+				!tc_rate_eq(s->cur[j].ceil, e->ceil) ||
+				s->cur[j].filters != TC_ALL_FILTERS)
+			return vzctl_err(-1, 0, "tc class %x:%x on %s is not"
+					" configured as requested",
+					e->net_class + 1, s->tc_class,
+					s->devs[e->dev]);
+	}
+	for (i = 0; i < s->ncur; i++) {
+		e = &s->cur[i];
+		if (tc_find_ent(s->want, s->nwant, e->dev, e->net_class) == -1)
+			return vzctl_err(-1, 0, "Unable to remove tc class"
+					" %x:%x on %s", e->net_class + 1,
+					s->tc_class, s->devs[e->dev]);
+	}
+
+	return 0;
+}
+
+/* The class database is shared with vz-setrate, so use the same
+ * lockfile(1) compatible lock: an exclusively created read-only file.
+ */
+static int lock_tc_classes(void)
+{
+	int fd, i;
+
+	for (i = 0; i < TC_LOCK_TIMEOUT / 10; i++) {
+		fd = open(TC_CLASSES_LOCK, O_WRONLY | O_CREAT | O_EXCL, 0444);
+		if (fd != -1) {
+			close(fd);
+			return 0;
+		}
+		if (errno != EEXIST)
+			return vzctl_err(-1, errno, "Unable to create "
+					TC_CLASSES_LOCK);
+		usleep(10000);
+	}
+
+	return vzctl_err(-1, 0, "Timeout waiting for " TC_CLASSES_LOCK);
+}
+
+static void unlock_tc_classes(void)
+{
+	unlink(TC_CLASSES_LOCK);
+}
+
+/* Look up the CT tc class in the database, allocate a new one if
+ * requested (see vzget_tc_class). Returns 0 if not found.
+ */
+static int get_tc_class(unsigned int veid, int alloc)
+{
+	FILE *fp;
+	char buf[STR_SIZE];
+	unsigned char *used = NULL;
+	unsigned int id, c, seed;
+	int i, range, tc_class = 0;
+
+	if (lock_tc_classes())
+		return -1;
+
+	fp = fopen(TC_CLASSES_DB, alloc ? "a+" : "r");
+	if (fp == NULL) {
+		if (errno != ENOENT || alloc)
+			tc_class = vzctl_err(-1, errno, "Unable to open "
+					TC_CLASSES_DB);
+		goto out;
+	}
+
+	if (alloc && (used = calloc(1, TC_MAX_CLASS)) == NULL) {
+		tc_class = vzctl_err(-1, ENOMEM, "get_tc_class");
+		goto out;
+	}
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		if (sscanf(buf, "%u %x", &id, &c) != 2)
+			continue;
+		if (id == veid) {
+			tc_class = c;
+			goto out;
+		}
+		if (used != NULL && c < TC_MAX_CLASS)
+			used[c] = 1;
+	}
+	if (!alloc)
+		goto out;
+
+	c = veid % TC_MAX_CLASS;
+	if (c == 0)
+		c = TC_MAGIC_NUM;
+	range = TC_MAX_CLASS - TC_MAGIC_NUM;
+	seed = time(NULL) ^ getpid();
+	for (i = 0; used[c] && i < range; i++)
+		c = TC_MAGIC_NUM + (i < TC_ATTEMPTS ?
+				rand_r(&seed) % range : i);
+	if (used[c]) {
+		tc_class = vzctl_err(-1, 0, "Can't find free tc class");
+		goto out;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	if (ftell(fp) == 0)
+		fprintf(fp, "#VEID TC_CLASS\n");
+	fprintf(fp, "%u %x\n", veid, c);
+	if (fflush(fp)) {
+		tc_class = vzctl_err(-1, errno, "Unable to write "
+				TC_CLASSES_DB);
+		goto out;
+	}
+	tc_class = c;
+
+out:
+	if (fp != NULL)
+		fclose(fp);
+	free(used);
+	unlock_tc_classes();
+
+	return tc_class;
+}
+
+static int put_tc_class(unsigned int veid)
+{
+	FILE *fp;
+	char buf[STR_SIZE];
+	struct tc_batch b = {};
+	unsigned int id;
+	int ret = -1;
+
+	if (lock_tc_classes())
+		return -1;
+
+	if ((fp = fopen(TC_CLASSES_DB, "r")) == NULL) {
+		ret = 0;
+		goto out;
+	}
+	while (fgets(buf, sizeof(buf), fp) != NULL)
+		if ((sscanf(buf, "%u ", &id) != 1 || id != veid) &&
+				tc_batch_printf(&b, "%s", buf))
+			goto out;
+	ret = write_file_atomic(TC_CLASSES_DB, TC_CLASSES_DB ".tmp",
+			b.buf != NULL ? b.buf : "", b.len, NULL);
+
+out:
+	if (fp != NULL)
+		fclose(fp);
+	free(b.buf);
+	unlock_tc_classes();
+
+	return ret;
+}
+
+/* Returns 0 if shaping is configured, -1 to fall back to vz-setrate */
+static int apply_tc_shape(struct vzctl_env_handle *h, const char *bandwidth,
+		const char *totalrate, const char *rate, const char *ratempu,
+		int ratebound, int tc_base)
+{
+	struct tc_shape *s;
+	struct tc_batch b = {};
+	int n, ret = -1;
+
+	if (!stat_file(TC_CMD))
+		return -1;
+
+	s = calloc(1, sizeof(struct tc_shape));
+	if (s == NULL)
+		return vzctl_err(-1, ENOMEM, "apply_tc_shape");
+
+	if (build_tc_shape(s, bandwidth, totalrate, rate, ratempu, ratebound))
+		goto out;
+
+	s->tc_class = get_tc_class(h->veid, s->nwant != 0);
+	if (s->tc_class == -1)
+		goto out;
+	if (s->tc_class == 0) {
+		/* no classes were allocated and none are requested */
+		ret = 0;
+		goto out;
+	}
+	s->mark = tc_base != -1 ? tc_base * TC_MAX_CLASSES :
+			h->veid * 2 * TC_MAX_CLASSES;
+
+	if (read_tc_classes(s))
+		goto out;
+
+	n = build_tc_batch(s, &b, get_hz());
+	if (n == -1)
+		goto out;
+	if (n != 0 && run_tc_batch(&b))
+		goto out;
+	logger(1, 0, "Shaping: %d tc class(es) updated", n);
+
+	if (verify_tc_classes(s))
+		goto out;
+
+	if (s->nwant == 0 && put_tc_class(h->veid))
+		goto out;
+
+	ret = 0;
+out:
+	free(b.buf);
+	free(s);
+
+	return ret;
+}
+
 int vzctl2_set_tc_param(struct vzctl_env_handle *h, struct vzctl_env_param *env,
 		int flags)
 {
@@ -220,6 +719,18 @@ int vzctl2_set_tc_param(struct vzctl_env_handle *h, struct vzctl_env_param *env,
 	if (ret)
 		return ret;
 
+	if ((p = rate2str(rate)) != NULL)
+		logger(1, 0, "Setup shaping: %s", p);
+	ratebound = tc->ratebound ? tc->ratebound :
+			h->env_param->vz->tc->ratebound;
+	if (apply_tc_shape(h, bandwidth, totalrate, p, ratempu,
+				ratebound == VZCTL_PARAM_ON, tc_base) == 0)
+	{
+		free(p);
+		return 0;
+	}
+	logger(1, 0, "Falling back to the full shaping setup");
+
 	snprintf(buf, sizeof(buf), "VE_STATE=%s", get_state(h));
 	envp[i++] = strdup(buf);
 	snprintf(buf, sizeof(buf), "BANDWIDTH=%s", bandwidth);
@@ -237,14 +748,11 @@ int vzctl2_set_tc_param(struct vzctl_env_handle *h, struct vzctl_env_param *env,
 	envp[i++] = strdup("TRAFFIC_SHAPING=yes");
 	snprintf(buf, sizeof(buf), "VEID=%d", h->veid);
 	envp[i++] = strdup(buf);
-	if ((p = rate2str(rate)) != NULL) {
-		logger(1, 0, "Setup shaping: %s", p);
+	if (p != NULL) {
 		snprintf(buf, sizeof(buf), "RATE=%s", p);
 		envp[i++] = strdup(buf);
 		free(p);
 	}
-	ratebound = tc->ratebound ? tc->ratebound :
-			h->env_param->vz->tc->ratebound;
 	if (ratebound == VZCTL_PARAM_ON) {
 		snprintf(buf, sizeof(buf), "RATEBOUND=yes");
 		envp[i++] = strdup(buf);
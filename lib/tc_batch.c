@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+/* The tc class/filter model of the native shaping (see tc.c) and
+ * the diff of the installed set against the wanted one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include "vztypes.h"
+#include "vzerror.h"
+#include "logger.h"
+#include "tc_batch.h"
+
+#define TC_AVPKT		1000
+
+int tc_find_dev(struct tc_shape *s, const char *dev)
+{
+	int i;
+
+	for (i = 0; i < s->ndevs; i++)
+		if (strcmp(s->devs[i], dev) == 0)
+			return i;
+	return -1;
+}
+
+int tc_find_ent(struct tc_class_ent *ents, int n, int dev, int net_class)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (ents[i].dev == dev && ents[i].net_class == net_class)
+			return i;
+	return -1;
+}
+
+int tc_find_rate_ent(struct tc_rate_ent *ents, int n, const char *dev,
+		int net_class)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (strcmp(ents[i].dev, dev) == 0 &&
+				ents[i].net_class == net_class)
+			return i;
+	return -1;
+}
+
+/* Parse "<dev|*>:<class>[:<val>] ..." and expand '*' to the configured
+ * devices that have no explicit entry for the class (see expand_DEV).
+ */
+int parse_tc_list(struct tc_shape *s, const char *str,
+		struct tc_rate_ent *out, int max)
+{
+	struct tc_rate_ent tmp[TC_MAX_ENTS];
+	char buf[STR_MAX];
+	char *token, *savedptr, *p, *tail;
+	int i, j, n = 0, nany = 0;
+
+	if (str == NULL)
+		return 0;
+	snprintf(buf, sizeof(buf), "%s", str);
+	for (token = strtok_r(buf, LIST_DELIMITERS, &savedptr); token != NULL;
+			token = strtok_r(NULL, LIST_DELIMITERS, &savedptr))
+	{
+		struct tc_rate_ent e = {};
+
+		if ((p = strchr(token, ':')) == NULL || p == token ||
+				p - token >= (int)sizeof(e.dev))
+			return -1;
+		strncpy(e.dev, token, p - token);
+		errno = 0;
+		e.net_class = strtol(p + 1, &tail, 10);
+		if (tail == p + 1 || errno == ERANGE)
+			return -1;
+		if (*tail == ':') {
+			p = tail + 1;
+			e.val = strtoul(p, &tail, 10);
+			if (tail == p || errno == ERANGE)
+				return -1;
+			e.has_val = 1;
+		}
+		if (*tail != '\0')
+			return -1;
+		if (e.net_class <= 0 || e.net_class >= TC_MAX_CLASSES)
+			return -1;
+
+		if (strcmp(e.dev, "*") == 0) {
+			if (nany == TC_MAX_ENTS)
+				return -1;
+			tmp[nany++] = e;
+		} else if (tc_find_rate_ent(out, n, e.dev, e.net_class) == -1) {
+			if (n == max)
+				return -1;
+			out[n++] = e;
+		}
+	}
+
+	for (i = 0; i < nany; i++) {
+		for (j = 0; j < s->ndevs; j++) {
+			if (tc_find_rate_ent(out, n, s->devs[j],
+						tmp[i].net_class) != -1)
+				continue;
+			if (n == max)
+				return -1;
+			out[n] = tmp[i];
+			strcpy(out[n].dev, s->devs[j]);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+int parse_tc_rate(const char *str, const char *key, unsigned int *kbit)
+{
+	const char *p;
+	char *tail;
+	double v;
+
+	if ((p = strstr(str, key)) == NULL)
+		return -1;
+	p += strlen(key);
+	v = strtod(p, &tail);
+	if (tail == p)
+		return -1;
+	switch (*tail) {
+	case 'b':
+		v /= 1000;
+		break;
+	case 'K':
+		break;
+	case 'M':
+		v *= 1000;
+		break;
+	case 'G':
+		v *= 1000000;
+		break;
+	case 'T':
+		v *= 1000000000;
+		break;
+	default:
+		return -1;
+	}
+	*kbit = v + 0.5;
+
+	return 0;
+}
+
+/* tc prints the rate rounded to 3-4 significant digits */
+int tc_rate_eq(unsigned int installed, unsigned int wanted)
+{
+	unsigned int d = installed > wanted ? installed - wanted :
+				wanted - installed;
+
+	return d <= wanted / 1000 + 1;
+}
+
+static unsigned int get_maxburst(unsigned int rate, int hz)
+{
+	unsigned long long maxburst;
+
+	maxburst = (unsigned long long)rate * 1024 / (TC_AVPKT * 8 * hz);
+
+	return maxburst > 10 ? maxburst : 10;
+}
+
+int tc_batch_printf(struct tc_batch *b, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+	size_t size;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(b->buf + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return -1;
+		if (b->len + n < b->size)
+			break;
+		size = (b->size + n) * 2;
+		if ((buf = realloc(b->buf, size)) == NULL)
+			return vzctl_err(-1, ENOMEM, "tc_batch_printf");
+		b->buf = buf;
+		b->size = size;
+	}
+	b->len += n;
+
+	return 0;
+}
+
+/* Filters are attached at 1:0 -> 1:<class + 1> and
+ * <class + 1>:0 -> <class + 1>:<tc class> for both ip and ipv6,
+ * only the filters in the mask are added or deleted
+ */
+static int batch_filters(struct tc_batch *b, struct tc_shape *s,
+		struct tc_class_ent *e, int add, unsigned int mask)
+{
+	unsigned int parent, minor;
+	int i, j;
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++) {
+			if (!(mask & TC_FILTER_BIT(i, j)))
+				continue;
+			parent = j ? e->net_class + 1 : 1;
+			minor = j ? s->tc_class : e->net_class + 1;
+			if (tc_batch_printf(b, "filter %s dev %s protocol %s "
+					"parent %x:0 prio %d handle %d fw",
+					add ? "add" : "del", s->devs[e->dev],
+					i ? "ipv6" : "ip", parent, i + 1,
+					s->mark + e->net_class))
+				return -1;
+			if (add && tc_batch_printf(b, " classid %x:%x",
+						parent, minor))
+				return -1;
+			if (tc_batch_printf(b, "\n"))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int batch_class(struct tc_batch *b, struct tc_shape *s,
+		struct tc_class_ent *e, const char *action, int hz)
+{
+	if (tc_batch_printf(b, "class %s dev %s parent %x: classid %x:%x htb "
+			"rate %uKbit prio 1 maxburst %u ceil %uKbit",
+			action, s->devs[e->dev], e->net_class + 1,
+			e->net_class + 1, s->tc_class, e->rate,
+			get_maxburst(e->rate, hz), e->ceil))
+		return -1;
+	if (e->mpu && tc_batch_printf(b, " mpu %u", e->mpu))
+		return -1;
+
+	return tc_batch_printf(b, "\n");
+}
+
+/* Generate the tc batch turning s->cur into s->want.
+ * Returns the number of commands, or -1 if the diff can not be applied
+ * incrementally.
+ */
+int build_tc_batch(struct tc_shape *s, struct tc_batch *b, int hz)
+{
+	struct tc_class_ent *e;
+	int i, j, n = 0;
+
+	for (i = 0; i < s->ncur; i++) {
+		e = &s->cur[i];
+		if (tc_find_ent(s->want, s->nwant, e->dev, e->net_class) != -1)
+			continue;
+		if (batch_filters(b, s, e, 0, e->filters) ||
+				tc_batch_printf(b, "class del dev %s classid %x:%x\n",
+					s->devs[e->dev], e->net_class + 1,
+					s->tc_class))
+			return -1;
+		n++;
+	}
+
+	for (i = 0; i < s->nwant; i++) {
+		e = &s->want[i];
+		j = tc_find_ent(s->cur, s->ncur, e->dev, e->net_class);
+		if (j == -1) {
+			if (!(s->roots[e->dev] & (1U << e->net_class))) {
+				logger(1, 0, "No root class for class %d on %s",
+						e->net_class, s->devs[e->dev]);
+				return -1;
+			}
+			if (batch_class(b, s, e, "add", hz) ||
+					batch_filters(b, s, e, 1, TC_ALL_FILTERS))
+				return -1;
+			n++;
+			continue;
+		}
+
+		if (s->cur[j].filters != TC_ALL_FILTERS) {
+			/* the class is there but its filters were lost */
+			if (batch_filters(b, s, e, 1,
+					~s->cur[j].filters & TC_ALL_FILTERS))
+				return -1;
+			n++;
+		}
+		if (!tc_rate_eq(s->cur[j].rate, e->rate) ||
+				!tc_rate_eq(s->cur[j].ceil, e->ceil) ||
+				e->mpu != 0)
+		{
+			/* mpu is not shown by 'tc class show', reapply */
+			if (batch_class(b, s, e, "change", hz))
+				return -1;
+			n++;
+		}
+	}
+
+	return n;
+}
+
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+#ifndef _TC_BATCH_H_
+#define _TC_BATCH_H_
+
+#include <net/if.h>
+
+#define TC_MAX_CLASSES		16
+#define TC_MAX_DEVS		16
+#define TC_MAX_ENTS		(TC_MAX_DEVS * TC_MAX_CLASSES)
+
+/* ip/ipv6 filters at the root (1:0) and the net class (<class + 1>:0) */
+#define TC_FILTER_BIT(ipv6, leaf)	(1U << ((ipv6) * 2 + (leaf)))
+#define TC_ALL_FILTERS		0xf
+
+struct tc_rate_ent {
+	char dev[IFNAMSIZ];
+	int net_class;
+	unsigned int val;
+	int has_val;
+};
+
+struct tc_class_ent {
+	int dev;		/* index in tc_shape.devs */
+	int net_class;
+	unsigned int rate;	/* Kbit */
+	unsigned int ceil;	/* Kbit */
+	unsigned int mpu;	/* 0 if not set */
+	unsigned int filters;	/* TC_FILTER_BIT() mask of installed filters */
+};
+
+struct tc_shape {
+	char devs[TC_MAX_DEVS][IFNAMSIZ];
+	int ndevs;
+	/* bitmask of net classes having the 1:<class + 1> root class */
+	unsigned int roots[TC_MAX_DEVS];
+	int tc_class;
+	int mark;
+	int nwant;
+	struct tc_class_ent want[TC_MAX_ENTS];
+	int ncur;
+	struct tc_class_ent cur[TC_MAX_ENTS];
+};
+
+struct tc_batch {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+int tc_find_dev(struct tc_shape *s, const char *dev);
+int tc_find_ent(struct tc_class_ent *ents, int n, int dev, int net_class);
+int tc_find_rate_ent(struct tc_rate_ent *ents, int n, const char *dev,
+		int net_class);
+int parse_tc_list(struct tc_shape *s, const char *str,
+		struct tc_rate_ent *out, int max);
+int parse_tc_rate(const char *str, const char *key, unsigned int *kbit);
+int tc_rate_eq(unsigned int installed, unsigned int wanted);
+int tc_batch_printf(struct tc_batch *b, const char *fmt, ...);
+int build_tc_batch(struct tc_shape *s, struct tc_batch *b, int hz);
+
+#endif /* _TC_BATCH_H_ */
@@ -35,6 +35,10 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/sendfile.h>
 #include <sys/mount.h>
 #include <dirent.h>
@@ -64,6 +68,7 @@
 #include "disk.h"
 #include "vztmpl.h"
 #include "exec.h"
+#include "hostcap.h"
 
 #ifndef NR_OPEN
 #define NR_OPEN 1024
@@ -1516,67 +1521,371 @@ err:
 #define ENV_SIZE	256
 int vzctl2_exec_script(char *const argv[], char *const env[], int flags)
 {
-	int child, fd, ret, i, j, retcode;
+	struct vzctl_exec_task t = {
+		.argv = argv,
+		.envp = env,
+		.flags = flags & (EXEC_NOENV | EXEC_QUIET),
+	};
 	char *cmd;
-	char *envp[ENV_SIZE];
-	struct vzctl_cleanup_hook *h;
-	int out[2];
+	int ret, failed;
 
 	if (strchr(argv[0], '/') && !stat_file(argv[0]))
 		return vzctl_err(VZCTL_E_NOSCRIPT, 0,
 			"run_script: executable %s not found", argv[0]);
 
-	if (pipe(out))
-		return vzctl_err(VZCTL_E_SYSTEM, errno, "Cannot create pipe");
-
 	cmd = arg2str(argv);
 	if (cmd != NULL) {
 		logger(2, 0, "running: %s", cmd);
 		free(cmd);
 	}
-	i = 0;
-	if (env != NULL) {
-		for (i = 0; i < ENV_SIZE - 1 && env[i] != NULL; i++)
-			envp[i] = env[i];
-	}
-	for (j = 0; i < ENV_SIZE - 1 && envp_bash[j] != NULL; i++, j++)
-		envp[i] = envp_bash[j];
-	envp[i] = NULL;
+	if (!(flags & EXEC_QUIET))
+		t.flags |= EXEC_LOG_OUTPUT;
 
-	if ((child = fork()) == 0) {
-		fd = open("/dev/null", O_WRONLY);
-		dup2(fd, 0);
-		if (flags & EXEC_QUIET) {
-			dup2(fd, STDOUT_FILENO);
-			dup2(fd, STDERR_FILENO);
-		} else {
-			dup2(out[1], STDOUT_FILENO);
-			dup2(out[1], STDERR_FILENO);
-		}
+	ret = run_exec_tasks(&t, 1, 1, &failed);
+	if (ret)
+		return ret;
 
-		if (flags & EXEC_NOENV)
-			execv(argv[0], argv);
+	return t.status == -1 ? VZCTL_E_SYSTEM : t.status;
+}
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open		434
+#endif
+
+/* waitpid() polling interval when pidfd is not supported */
+#define TASK_POLL_MS		100
+
+static unsigned long long get_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void run_task_fn(struct vzctl_exec_task *t, int resfd)
+{
+	int ret;
+
+	ret = t->fn(t->data);
+	if (t->res_size && write(resfd, t->res, t->res_size) != t->res_size)
+		_exit(VZCTL_E_SYSTEM);
+	_exit(ret);
+}
+
+static int start_task(struct vzctl_exec_task *t)
+{
+	char *envp[ENV_SIZE];
+	int err[2] = {-1, -1}, res[2] = {-1, -1};
+	int fd, i = 0, j;
+
+	t->pid = 0;
+	if (t->fn == NULL) {
+		if (t->envp != NULL)
+			for (; i < ENV_SIZE - 1 && t->envp[i] != NULL; i++)
+				envp[i] = t->envp[i];
+		for (j = 0; i < ENV_SIZE - 1 && envp_bash[j] != NULL; i++, j++)
+			envp[i] = envp_bash[j];
+		envp[i] = NULL;
+
+		if (!(t->flags & EXEC_KEEP_STDIO) && pipe2(err, O_CLOEXEC))
+			return vzctl_err(VZCTL_E_PIPE, errno, "Cannot create pipe");
+	} else if (t->res_size && pipe2(res, O_CLOEXEC))
+		return vzctl_err(VZCTL_E_PIPE, errno, "Cannot create pipe");
+
+	t->pid = fork();
+	if (t->pid == 0) {
+		if (t->fn != NULL) {
+			close(res[0]);
+			run_task_fn(t, res[1]);
+		}
+		if (!(t->flags & EXEC_KEEP_STDIO)) {
+			fd = open("/dev/null", O_RDWR);
+			dup2(fd, STDIN_FILENO);
+			dup2(t->flags & EXEC_LOG_OUTPUT ? err[1] : fd,
+					STDOUT_FILENO);
+			dup2(err[1], STDERR_FILENO);
+		}
+		if (t->flags & EXEC_NOENV)
+			execv(t->argv[0], t->argv);
 		else
-			execvep(argv[0], argv, envp);
-		logger(-1, errno, "Error exec %s", argv[0]);
+			execvep(t->argv[0], t->argv, envp);
+		logger(-1, errno, "Error exec %s", t->argv[0]);
 		_exit(1);
-	} else if(child == -1) {
-		logger(-1, errno, "Unable to fork");
-		ret = VZCTL_E_FORK;
-		goto err;
+	} else if (t->pid == -1) {
+		t->pid = 0;
+		p_close(err);
+		p_close(res);
+		return vzctl_err(VZCTL_E_FORK, errno, "Unable to fork");
 	}
-	h = register_cleanup_hook(cleanup_kill_process, (void *) &child);
-	close(out[1]);
-	out[1] = -1;
 
-	vzctl_stdredir(out[0], STDERR_FILENO, !(flags & EXEC_QUIET));
+	if (err[1] != -1) {
+		close(err[1]);
+		t->errfd = err[0];
+		fcntl(t->errfd, F_SETFL, O_NONBLOCK);
+	}
+	if (res[1] != -1) {
+		close(res[1]);
+		t->resfd = res[0];
+		fcntl(t->resfd, F_SETFL, O_NONBLOCK);
+	}
+	t->pidfd = syscall(__NR_pidfd_open, t->pid, 0);
+	t->deadline = t->timeout ? get_time_ms() + t->timeout * 1000ULL : 0;
+	t->hook = register_cleanup_hook(cleanup_kill_process, &t->pid);
 
-	ret = env_wait(child, 0, &retcode);
-	unregister_cleanup_hook(h);
-err:
-	p_close(out);
+	if (t->started != NULL)
+		t->started(t);
+
+	return 0;
+}
+
+/* The fn result is read as it comes, a child writing more than
+ * the pipe buffer would block otherwise
+ */
+static void read_task_res(struct vzctl_exec_task *t)
+{
+	int n;
+
+	while (t->resfd != -1) {
+		n = read(t->resfd, (char *)t->res + t->reslen,
+				t->res_size - t->reslen);
+		if (n > 0) {
+			t->reslen += n;
+			if (t->reslen < t->res_size)
+				continue;
+		} else if (n == -1 && errno == EINTR)
+			continue;
+		else if (n == -1 && errno == EAGAIN)
+			break;
+		close(t->resfd);
+		t->resfd = -1;
+	}
+}
+
+static void write_output(const char *buf, int len)
+{
+	int n;
+
+	while (len > 0) {
+		n = write(STDERR_FILENO, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Keep the tail of the task stderr */
+static void read_task_err(struct vzctl_exec_task *t)
+{
+	int n, size = sizeof(t->err) - 1;
+
+	while (t->errfd != -1) {
+		if (t->errlen == size) {
+			memmove(t->err, t->err + size / 2, size - size / 2);
+			t->errlen -= size / 2;
+		}
+		n = read(t->errfd, t->err + t->errlen, size - t->errlen);
+		if (n <= 0) {
+			if (n == 0 || errno != EINTR) {
+				if (n == 0 || errno != EAGAIN) {
+					close(t->errfd);
+					t->errfd = -1;
+				}
+				break;
+			}
+			continue;
+		}
+		if (t->flags & EXEC_LOG_OUTPUT) {
+			addoutput(t->err + t->errlen, n);
+			write_output(t->err + t->errlen, n);
+		}
+		t->errlen += n;
+	}
+	t->err[t->errlen] = '\0';
+}
+
+static void close_task(struct vzctl_exec_task *t)
+{
+	if (t->errfd != -1)
+		close(t->errfd);
+	if (t->pidfd != -1)
+		close(t->pidfd);
+	if (t->resfd != -1)
+		close(t->resfd);
+	t->errfd = t->pidfd = t->resfd = -1;
+	t->pid = 0;
+	unregister_cleanup_hook(t->hook);
+	t->hook = NULL;
+}
 
-	return ret ? ret : retcode;
+static void set_task_status(struct vzctl_exec_task *t, int status)
+{
+	t->status = status;
+	/* the output is already shown with EXEC_LOG_OUTPUT */
+	if (t->status && t->fn == NULL &&
+			!(t->flags & (EXEC_QUIET | EXEC_LOG_OUTPUT |
+					EXEC_KEEP_STDIO)))
+		logger(-1, 0, "%s %s: %s", t->argv[0],
+				t->timedout ? "timed out" : "failed", t->err);
+	if (t->finished != NULL)
+		t->finished(t);
+}
+
+static int finish_task(struct vzctl_exec_task *t)
+{
+	int status;
+
+	if (t->pid <= 0 || waitpid(t->pid, &status, WNOHANG) <= 0)
+		return 0;
+
+	read_task_err(t);
+	if (WIFEXITED(status))
+		status = WEXITSTATUS(status);
+	else
+		status = -1;
+	/* the child has exited, the rest of its result is in the pipe */
+	read_task_res(t);
+	if (t->reslen != t->res_size && status == 0)
+		status = VZCTL_E_SYSTEM;
+	close_task(t);
+	set_task_status(t, status);
+
+	return 1;
+}
+
+/* Run the tasks, the number of failed ones is returned in *failed */
+int run_exec_tasks(struct vzctl_exec_task *tasks, int n, int max_jobs,
+		int *failed)
+{
+	struct pollfd *pfd;
+	struct vzctl_exec_task *t;
+	unsigned long long now;
+	int i, nfd, timeout, running = 0, next = 0, ret = 0, log = 0;
+
+	*failed = 0;
+	if (n <= 0)
+		return 0;
+	if (max_jobs <= 0)
+		max_jobs = n;
+
+	pfd = calloc(n * 3, sizeof(struct pollfd));
+	if (pfd == NULL)
+		return vzctl_err(VZCTL_E_NOMEM, ENOMEM, "vzctl2_exec_tasks");
+
+	for (i = 0; i < n; i++) {
+		tasks[i].pid = 0;
+		tasks[i].pidfd = tasks[i].errfd = tasks[i].resfd = -1;
+		tasks[i].status = -1;
+		tasks[i].timedout = 0;
+		tasks[i].errlen = 0;
+		tasks[i].reslen = 0;
+		tasks[i].err[0] = '\0';
+		tasks[i].hook = NULL;
+		if (tasks[i].flags & EXEC_LOG_OUTPUT)
+			log = 1;
+	}
+	if (log)
+		initoutput();
+
+	while (next < n || running) {
+		for (; next < n && running < max_jobs; next++) {
+			ret = start_task(&tasks[next]);
+			if (ret) {
+				set_task_status(&tasks[next], ret);
+				ret = 0;
+				(*failed)++;
+				continue;
+			}
+			running++;
+		}
+		if (running == 0)
+			break;
+
+		now = get_time_ms();
+		timeout = -1;
+		nfd = 0;
+		for (i = 0; i < next; i++) {
+			t = &tasks[i];
+			if (t->pid <= 0)
+				continue;
+			if (t->pidfd != -1) {
+				pfd[nfd].fd = t->pidfd;
+				pfd[nfd++].events = POLLIN;
+			} else if (timeout == -1 || timeout > TASK_POLL_MS)
+				timeout = TASK_POLL_MS;
+			if (t->errfd != -1) {
+				pfd[nfd].fd = t->errfd;
+				pfd[nfd++].events = POLLIN;
+			}
+			if (t->resfd != -1) {
+				pfd[nfd].fd = t->resfd;
+				pfd[nfd++].events = POLLIN;
+			}
+			if (t->deadline && !t->timedout) {
+				int left = t->deadline > now ? t->deadline - now : 0;
+
+				if (timeout == -1 || timeout > left)
+					timeout = left;
+			}
+		}
+
+		if (poll(pfd, nfd, timeout) == -1 && errno != EINTR) {
+			ret = vzctl_err(VZCTL_E_SYSTEM, errno, "poll");
+			break;
+		}
+
+		now = get_time_ms();
+		for (i = 0; i < next; i++) {
+			t = &tasks[i];
+			if (t->pid <= 0)
+				continue;
+			read_task_err(t);
+			read_task_res(t);
+			if (finish_task(t)) {
+				if (t->status)
+					(*failed)++;
+				running--;
+			} else if (t->deadline && !t->timedout &&
+					now >= t->deadline) {
+				t->timedout = 1;
+				kill(t->pid, SIGKILL);
+			}
+		}
+	}
+
+	/* poll failure: kill and reap the rest */
+	for (i = 0; i < next; i++) {
+		t = &tasks[i];
+		if (t->pid <= 0)
+			continue;
+		kill(t->pid, SIGKILL);
+		env_wait(t->pid, 0, NULL);
+		close_task(t);
+		set_task_status(t, -1);
+		(*failed)++;
+	}
+	free(pfd);
+	if (log)
+		writeoutput(0);
+
+	return ret;
+}
+
+int vzctl2_exec_tasks(struct vzctl_exec_task *tasks, int n, int max_jobs)
+{
+	int ret, failed;
+
+	ret = run_exec_tasks(tasks, n, max_jobs, &failed);
+	if (ret == 0 && failed)
+		ret = vzctl_err(VZCTL_E_EXEC, 0, "%d of %d task(s) failed",
+				failed, n);
+
+	return ret;
 }
 
 void get_action_script_path(struct vzctl_env_handle *h, const char *name, char *out, int size)
@@ -2525,7 +2834,7 @@ char *get_script_path(const char *name, char *buf, int size)
 
 int is_vz_kernel(void)
 {
-	return (access(PROC_VZ, F_OK) == 0);
+	return has_host_cap(VZCTL_HOSTCAP_VZ);
 }
 
 #define K_VER(a,b,c)	(((a) << 16) + ((b) << 8) + (c))
@@ -2564,6 +2873,86 @@ unsigned long long ceil2digit(unsigned long long v)
 	return ceil(exp10(e - e2)) * exp10(e2);
 }
 
+/* FNV-1a, used as a checksum of small state files */
+unsigned int fnv_hash(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	unsigned int h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/* Replace fname with data via tmp: write, fsync, rename and fsync
+ * the parent directory
+ */
+int write_file_atomic(const char *fname, const char *tmp,
+		const char *data, size_t len, struct stat *st)
+{
+	int fd, ret = -1;
+	char dir[PATH_MAX], *p;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return vzctl_err(-1, errno, "Unable to create %s", tmp);
+
+	if (st != NULL)
+		set_fattr(fd, st);
+
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			logger(-1, errno, "Unable to write to %s", tmp);
+			goto err;
+		}
+		data += n;
+		len -= n;
+	}
+
+	if (fsync(fd)) {
+		logger(-1, errno, "Unable to fsync %s", tmp);
+		goto err;
+	}
+
+	if (rename(tmp, fname)) {
+		logger(-1, errno, "Failed to rename %s", tmp);
+		goto err;
+	}
+
+	/* make the rename durable, the file is in place already
+	 * so a failure here is not fatal
+	 */
+	close(fd);
+	snprintf(dir, sizeof(dir), "%s", fname);
+	p = strrchr(dir, '/');
+	if (p == NULL)
+		strcpy(dir, ".");
+	else if (p == dir)
+		p[1] = '\0';
+	else
+		*p = '\0';
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1 || fsync(fd))
+		logger(-1, errno, "Unable to fsync %s", dir);
+
+	ret = 0;
+err:
+	if (fd != -1)
+		close(fd);
+	if (ret)
+		unlink(tmp);
+
+	return ret;
+}
+
 int set_fattr(int fd, struct stat *st)
 {
 	if (fchmod(fd, st->st_mode))
@@ -216,6 +216,9 @@ int kver_cmp(const char *v1, const char *v2);
 int is_permanent_disk(struct vzctl_disk *d);
 int vzctl2_get_dump_file(struct vzctl_env_handle *h, char *buf, int size);
 int set_fattr(int fd, struct stat *st);
+unsigned int fnv_hash(const void *data, size_t len);
+int write_file_atomic(const char *fname, const char *tmp,
+		const char *data, size_t len, struct stat *st);
 int add_dq_param(struct vzctl_2UL_res **addr, struct vzctl_2UL_res *res);
 void free_dq_param(struct vzctl_dq_param *dq);
 int is_ip6(const char *ip);
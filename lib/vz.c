@@ -38,7 +38,8 @@
 #include <netdb.h>
 #include <limits.h>
 #include <sys/param.h>
-#include <sys/utsname.h>
+#include <sys/file.h>
+#include <pthread.h>
 
 #include <ploop/libploop.h>
 #include "vz.h"
@@ -60,6 +61,7 @@
 #include "ha.h"
 #include "disk.h"
 #include "name.h"
+#include "hostcap.h"
 
 #define PROC_VEINFO	"/proc/vz/veinfo"
 static int _initialized = 0;
@@ -84,6 +86,7 @@ void vzctl2_lib_close(void)
 	if (_initialized)
 		get_env_ops()->close();
 
+	drop_mnt_cache();
 	_initialized = 0;
 }
 
@@ -369,10 +372,8 @@ static void read_env_transition(ctid_t ctid, char *lockdir, char *str, int sz)
 int vzctl2_vz_status(void)
 {
 	int ret;
-	struct utsname u;
 
-	uname(&u);
-	if (kver_cmp(u.release, "3.9") >= 0)
+	if (has_host_cap(VZCTL_HOSTCAP_NSOPS))
 		return 1;
 
 	/* Check /proc/vz/veinfo & /proc/vz/venetstat exists
@@ -657,100 +658,370 @@ static int is_dst_free(const char *dst, ctid_t ctid, int *fail_cnt)
 }
 
 #define GET_FREE_ENVID_FAIL_MAX	12
-int vzctl2_get_free_envid(unsigned *neweid, const char *dst,
-		const char *unused)
+#define ENVID_IDX_FILE		VZ_ENV_CONF_DIR ".envid.idx"
+#define ENVID_IDX_MAGIC		0x5a564944
+#define ENVID_IDX_MAX		(INT_MAX/2)
+#define BITS_PER_WORD		(sizeof(unsigned long) * 8)
+
+/* Persistent index of used Container ids: a bitmap keyed by the
+ * VZ_ENV_CONF_DIR mtime it was built from. It is only a hint, every
+ * candidate is still verified against the config directory, so a stale
+ * index may cost a skipped id but never a duplicate.
+ */
+struct envid_idx_hdr {
+	unsigned int magic;
+	unsigned int nwords;
+	struct timespec dir_mtime;
+};
+
+struct envid_idx {
+	int fd;
+	struct envid_idx_hdr hdr;
+	unsigned long *map;
+};
+
+/* GLOBAL_CFG paths cached by mtime */
+static struct {
+	struct timespec mtime;
+	char *ve_private_orig;
+	char *ve_root_orig;
+} _g_envid_conf;
+static pthread_mutex_t _g_envid_conf_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int get_envid_conf(char **ve_private, char **ve_root)
+{
+	struct stat st;
+	struct vzctl_conf_simple conf = {};
+	ctid_t ctid = {};
+
+	*ve_private = *ve_root = NULL;
+	if (stat(GLOBAL_CFG, &st))
+		return vzctl_err(-1, errno, "Failed to stat " GLOBAL_CFG);
+
+	pthread_mutex_lock(&_g_envid_conf_mtx);
+	if (st.st_mtim.tv_sec != _g_envid_conf.mtime.tv_sec ||
+			st.st_mtim.tv_nsec != _g_envid_conf.mtime.tv_nsec)
+	{
+		free(_g_envid_conf.ve_private_orig);
+		free(_g_envid_conf.ve_root_orig);
+		_g_envid_conf.ve_private_orig = NULL;
+		_g_envid_conf.ve_root_orig = NULL;
+
+		vzctl_parse_conf_simple(ctid, GLOBAL_CFG, &conf);
+		if (conf.ve_private_orig != NULL &&
+				strstr(conf.ve_private_orig, "$VEID"))
+			_g_envid_conf.ve_private_orig =
+				strdup(conf.ve_private_orig);
+		if (conf.ve_root_orig != NULL &&
+				strstr(conf.ve_root_orig, "$VEID"))
+			_g_envid_conf.ve_root_orig = strdup(conf.ve_root_orig);
+		vzctl_free_conf_simple(&conf);
+		_g_envid_conf.mtime = st.st_mtim;
+	}
+
+	if (_g_envid_conf.ve_private_orig != NULL)
+		*ve_private = strdup(_g_envid_conf.ve_private_orig);
+	if (_g_envid_conf.ve_root_orig != NULL)
+		*ve_root = strdup(_g_envid_conf.ve_root_orig);
+	pthread_mutex_unlock(&_g_envid_conf_mtx);
+
+	return 0;
+}
+
+static int envid_idx_test(struct envid_idx *idx, unsigned int id)
+{
+	if (id / BITS_PER_WORD >= idx->hdr.nwords)
+		return 0;
+	return !!(idx->map[id / BITS_PER_WORD] & (1UL << (id % BITS_PER_WORD)));
+}
+
+static int envid_idx_set(struct envid_idx *idx, unsigned int id)
+{
+	unsigned int w = id / BITS_PER_WORD;
+
+	if (w >= idx->hdr.nwords) {
+		unsigned int n = w + 64;
+		unsigned long *t;
+
+		t = realloc(idx->map, n * sizeof(unsigned long));
+		if (t == NULL)
+			return vzctl_err(-1, ENOMEM, "envid_idx_set");
+		memset(t + idx->hdr.nwords, 0,
+				(n - idx->hdr.nwords) * sizeof(unsigned long));
+		idx->map = t;
+		idx->hdr.nwords = n;
+	}
+	idx->map[w] |= 1UL << (id % BITS_PER_WORD);
+
+	return 0;
+}
+
+/* Parse <id>.conf and <id>.conf.lck entries */
+static unsigned int get_envid_by_fname(const char *name)
+{
+	char *end;
+	unsigned long id;
+
+	if (!isdigit(*name))
+		return 0;
+	id = strtoul(name, &end, 10);
+	if (id == 0 || id >= ENVID_IDX_MAX)
+		return 0;
+	if (strcmp(end, ".conf") && strcmp(end, ".conf.lck"))
+		return 0;
+
+	return id;
+}
+
+static int envid_idx_rescan(struct envid_idx *idx, struct timespec *mtime)
+{
+	DIR *dir;
+	struct dirent *ent;
+	unsigned int id;
+
+	dir = opendir(VZ_ENV_CONF_DIR);
+	if (dir == NULL)
+		return vzctl_err(-1, errno, "Failed to open " VZ_ENV_CONF_DIR);
+
+	memset(idx->map, 0, idx->hdr.nwords * sizeof(unsigned long));
+	while ((ent = readdir(dir)) != NULL) {
+		id = get_envid_by_fname(ent->d_name);
+		if (id != 0 && envid_idx_set(idx, id)) {
+			closedir(dir);
+			return -1;
+		}
+	}
+	closedir(dir);
+	idx->hdr.dir_mtime = *mtime;
+
+	logger(5, 0, "Rebuilt Container id index");
+
+	return 0;
+}
+
+static int envid_idx_open(struct envid_idx *idx)
+{
+	struct stat st;
+	struct envid_idx_hdr hdr;
+	ssize_t len;
+
+	memset(idx, 0, sizeof(*idx));
+	idx->fd = open(ENVID_IDX_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (idx->fd == -1)
+		return vzctl_err(-1, errno, "Failed to open " ENVID_IDX_FILE);
+
+	if (flock(idx->fd, LOCK_EX)) {
+		vzctl_err(-1, errno, "Failed to lock " ENVID_IDX_FILE);
+		goto err;
+	}
+
+	if (stat(VZ_ENV_CONF_DIR, &st)) {
+		vzctl_err(-1, errno, "Failed to stat " VZ_ENV_CONF_DIR);
+		goto err;
+	}
+
+	idx->hdr.magic = ENVID_IDX_MAGIC;
+	if (pread(idx->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+			hdr.magic == ENVID_IDX_MAGIC &&
+			hdr.nwords <= ENVID_IDX_MAX / BITS_PER_WORD + 1 &&
+			hdr.dir_mtime.tv_sec == st.st_mtim.tv_sec &&
+			hdr.dir_mtime.tv_nsec == st.st_mtim.tv_nsec)
+	{
+		idx->map = malloc(hdr.nwords * sizeof(unsigned long) ?: 1);
+		if (idx->map == NULL) {
+			vzctl_err(-1, ENOMEM, "envid_idx_open");
+			goto err;
+		}
+		len = hdr.nwords * sizeof(unsigned long);
+		if (pread(idx->fd, idx->map, len, sizeof(hdr)) == len) {
+			idx->hdr = hdr;
+			return 0;
+		}
+		free(idx->map);
+		idx->map = NULL;
+	}
+
+	if (envid_idx_rescan(idx, &st.st_mtim))
+		goto err;
+
+	return 0;
+
+err:
+	close(idx->fd);
+	free(idx->map);
+	idx->fd = -1;
+
+	return -1;
+}
+
+static void envid_idx_close(struct envid_idx *idx)
+{
+	struct stat st;
+	size_t len = idx->hdr.nwords * sizeof(unsigned long);
+
+	if (idx->fd == -1)
+		return;
+
+	/* Own .lck files bumped the directory mtime, record it so
+	 * the next call does not have to rescan
+	 */
+	if (stat(VZ_ENV_CONF_DIR, &st) == 0)
+		idx->hdr.dir_mtime = st.st_mtim;
+
+	if (pwrite(idx->fd, &idx->hdr, sizeof(idx->hdr), 0) != sizeof(idx->hdr) ||
+			pwrite(idx->fd, idx->map, len, sizeof(idx->hdr)) != len ||
+			ftruncate(idx->fd, sizeof(idx->hdr) + len))
+	{
+		logger(-1, errno, "Failed to update " ENVID_IDX_FILE);
+		/* the index is rebuilt on the next call */
+		unlink(ENVID_IDX_FILE);
+	}
+
+	close(idx->fd);
+	free(idx->map);
+	idx->fd = -1;
+}
+
+/* Returns 1 if the id is locked, 0 if it is in use and -1 if
+ * its paths are occupied
+ */
+static int lock_free_envid(unsigned int id, const char *dst,
+		const char *dstlck, char *ve_private, char *ve_root,
+		int *fail_cnt)
 {
-	int i;
-	struct vzctl_conf_simple conf;
 	char file[STR_SIZE];
 	char lckfile[STR_SIZE];
-	char dstlck[PATH_MAX];
 	struct stat st;
-	int check_ve_private = 0;
-	int check_ve_root = 0;
-	int check_dst = 0;
-	int fail_cnt = 0;
+	ctid_t ctid;
 	int fd;
-	ctid_t ctid = {};
 
-	vzctl_parse_conf_simple(ctid, GLOBAL_CFG, &conf);
+	snprintf(ctid, sizeof(ctid), "%u", id);
+	/* Check for VEID.conf */
+	vzctl2_get_env_conf_path(ctid, file, sizeof(file));
+	if (lstat(file, &st) == 0)
+		return 0;
+	if (errno != ENOENT) {
+		logger(-1, errno, "Failed to stat %s", file);
+		(*fail_cnt)++;
+		return -1;
+	}
 
-	if (conf.ve_private_orig != NULL && strstr(conf.ve_private_orig, "$VEID"))
-		check_ve_private = 1;
-	if (conf.ve_root_orig != NULL && strstr(conf.ve_root_orig, "$VEID"))
-		check_ve_root = 1;
-	if (dst != NULL && strstr(dst, "$VEID")) {
+	/* lock envid */
+	snprintf(lckfile, sizeof(lckfile), "%s.lck", file);
+	fd = open(lckfile, O_CREAT|O_EXCL, 0644);
+	if (fd == -1) {
+		if (errno != EEXIST) {
+			(*fail_cnt)++;
+			logger(-1, errno, "Failed to create %s", lckfile);
+			return -1;
+		}
+		return 0;
+	}
+	close(fd);
+
+	/* check if PATH(s) exist */
+	if ((ve_private && !is_dst_free(ve_private, ctid, fail_cnt)) ||
+	    (ve_root && !is_dst_free(ve_root, ctid, fail_cnt)) ||
+	    (dst && (!is_dst_free(dst, ctid, fail_cnt) ||
+			!is_dst_free(dstlck, ctid, fail_cnt))))
+	{
+		/* unlock envid */
+		unlink(lckfile);
+		return -1;
+	}
+
+	return 1;
+}
+
+/* Get & lock up to n free Container ids in ascending order */
+static int get_free_envids(unsigned int *ids, int n, const char *dst)
+{
+	int i, ret, cnt = 0;
+	unsigned int id;
+	char dstlck[PATH_MAX];
+	char *ve_private, *ve_root;
+	int fail_cnt = 0;
+	struct envid_idx idx;
+
+	if (get_envid_conf(&ve_private, &ve_root))
+		return -1;
+
+	if (dst != NULL && strstr(dst, "$VEID"))
 		snprintf(dstlck, sizeof(dstlck), "%s.lck", dst);
-		check_dst = 1;
+	else
+		dst = NULL;
+
+	if (envid_idx_open(&idx)) {
+		free(ve_private);
+		free(ve_root);
+		return -1;
 	}
 
-	*neweid = 0;
-	for (i = START_ID; i < INT_MAX/2 && fail_cnt < GET_FREE_ENVID_FAIL_MAX; i++) {
-		ctid_t ctid = {i, };
-		/* Check for VEID.conf */
-		vzctl2_get_env_conf_path(ctid, file, sizeof(file));
-		if (lstat(file, &st)) {
-			if (errno != ENOENT) {
-				logger(-1, errno, "Failed to stat %s", file);
-				fail_cnt++;
-				continue;
-			}
-		} else
-			continue;
-		/* lock envid */
-		snprintf(lckfile, sizeof(lckfile), "%s.lck", file);
-		fd = open(lckfile, O_CREAT|O_EXCL, 0644);
-		if (fd == -1) {
-			if (errno != EEXIST) {
-				fail_cnt++;
-				logger(-1, errno, "Failed to create %s", lckfile);
-			}
+	for (id = START_ID; id < ENVID_IDX_MAX && cnt < n &&
+			fail_cnt < GET_FREE_ENVID_FAIL_MAX; id++)
+	{
+		if (envid_idx_test(&idx, id))
 			continue;
-		}
-		close(fd);
 
-		/* check if PATH(s) exist */
-		if ((check_ve_private && !is_dst_free(conf.ve_private_orig, ctid, &fail_cnt)) ||
-		    (check_ve_root && !is_dst_free(conf.ve_root_orig, ctid, &fail_cnt)) ||
-		    (check_dst &&
-			(!is_dst_free(dst, ctid, &fail_cnt) || !is_dst_free(dstlck, ctid, &fail_cnt))))
-		{
-			/* unlock envid */
-			unlink(lckfile);
+		ret = lock_free_envid(id, dst, dstlck, ve_private, ve_root,
+				&fail_cnt);
+		if (ret == 0)
+			envid_idx_set(&idx, id);
+		if (ret != 1)
 			continue;
+
+		if (envid_idx_set(&idx, id)) {
+			vzctl2_unlock_envid(id);
+			break;
 		}
-		*neweid = i;
-		break;
+		ids[cnt++] = id;
 	}
-	vzctl_free_conf_simple(&conf);
 
-	if (*neweid == 0)
-		return vzctl_err(-1, 0,  "Failed to get unused Countainer id");
+	envid_idx_close(&idx);
+	free(ve_private);
+	free(ve_root);
+
+	if (cnt < n) {
+		for (i = 0; i < cnt; i++)
+			vzctl2_unlock_envid(ids[i]);
+		return vzctl_err(-1, 0,  "Failed to get unused Container id");
+	}
 
 	return 0;
 }
 
+int vzctl2_get_free_envid(unsigned *neweid, const char *dst,
+		const char *unused)
+{
+	*neweid = 0;
+
+	return get_free_envids(neweid, 1, dst);
+}
+
+int vzctl2_get_free_envids(unsigned int *ids, int n, const char *dst)
+{
+	if (n <= 0)
+		return vzctl_err(VZCTL_E_INVAL, 0, "Invalid number of ids %d", n);
+
+	return get_free_envids(ids, n, dst);
+}
+
 int vzctl2_get_free_env_id(unsigned *neweid)
 {
 	return vzctl2_get_free_envid(neweid, NULL, NULL);
 }
 
-static int vzctl_check_owner_quiet(const char *ve_private, char *serverid,
-		size_t size, char *ve_ownerid, size_t ve_size)
+/* Compare VE_PRIVATE/.owner with this node, serverid and hostname
+ * are looked up when NULL
+ */
+static int check_env_owner(const char *ve_private, const char *serverid,
+		const char *hostname, char *host, size_t size,
+		char *ve_ownerid, size_t ve_size)
 {
 	char file[PATH_MAX];
 	char *p;
 	int len;
 	FILE *fp;
-	int ret;
-
-	ret = is_shared_fs(ve_private);
-	if (ret == -1) {
-		if (errno == ENOENT)
-			return 0;
-		return VZCTL_E_SYSTEM;
-	} else if (ret == 0)
-		return 0;
 
 	snprintf(file, sizeof(file), "%s/" VZCTL_VE_OWNER, ve_private);
 	if ((fp = fopen(file, "r")) == NULL) {
@@ -772,19 +1043,41 @@ static int vzctl_check_owner_quiet(const char *ve_private, char *serverid,
 		*p = 0;
 
 	if (vzctl2_get_normalized_uuid(ve_ownerid, file, sizeof(file))) {
-		if (get_hostname(serverid, size - 1))
+		if (hostname != NULL)
+			snprintf(host, size, "%s", hostname);
+		else if (get_hostname(host, size - 1))
 			return vzctl_err(VZCTL_E_ENV_MANAGE_DISABLED, errno,
 				"Owner check failed, unable to get hostname");
 	} else {
-		get_serverid(serverid, size);
+		if (serverid != NULL)
+			snprintf(host, size, "%s", serverid);
+		else
+			get_serverid(host, size);
 	}
 
-	if (strcmp(serverid, ve_ownerid))
+	if (strcmp(host, ve_ownerid))
 		return VZCTL_E_ENV_MANAGE_DISABLED;
 
 	return 0;
 }
 
+static int vzctl_check_owner_quiet(const char *ve_private, char *serverid,
+		size_t size, char *ve_ownerid, size_t ve_size)
+{
+	int ret;
+
+	ret = is_shared_fs(ve_private);
+	if (ret == -1) {
+		if (errno == ENOENT)
+			return 0;
+		return VZCTL_E_SYSTEM;
+	} else if (ret == 0)
+		return 0;
+
+	return check_env_owner(ve_private, NULL, NULL, serverid, size,
+			ve_ownerid, ve_size);
+}
+
 enum {
 	SKIP_PORT_REDIR_DESTROY = 0x01,
 };
@@ -875,19 +1168,52 @@ static int renew_VE_PRIVATE(struct vzctl_env_handle *h, const char *path,
 	return 0;
 }
 
-/** Register Container
- * @param path		Container private data root
- * @param param		struct vzctl_reg_param
- * @param flags		registration flags
- * @return		veid or -1 in case error
- */
-int vzctl2_env_register(const char *path, struct vzctl_reg_param *param, int flags)
+/* Storage properties shared by all Containers on one mount */
+struct reg_mnt_info {
+	dev_t dev;
+	int on_pcs;
+	int on_shared;
+	int shared_errno;
+};
+
+/* Batch registration context, node and storage lookups done once */
+struct reg_ctx {
+	const struct reg_mnt_info *mnt;
+	const char *serverid;
+	const char *hostname;
+};
+
+static int lock_dir(const char *dir)
+{
+	int fd;
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return vzctl_err(-1, errno, "Failed to open %s", dir);
+
+	if (flock(fd, LOCK_EX)) {
+		vzctl_err(-1, errno, "Failed to lock %s", dir);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void unlock_dir(int fd)
+{
+	if (fd != -1)
+		close(fd);
+}
+
+static int do_env_register(const char *path, struct vzctl_reg_param *param,
+		int flags, const struct reg_ctx *ctx, ctid_t out)
 {
 	char buf[PATH_MAX];
 	char veconf[STR_SIZE];
 	char path_r[PATH_MAX];
-	struct stat st;
-	int ret, err;
+	struct stat st, st_r;
+	int ret, err, rc = VZCTL_E_REGISTER;
 	struct vzctl_env_handle *h;
 	FILE *fp;
 	char ve_host[STR_SIZE];
@@ -895,7 +1221,10 @@ int vzctl2_env_register(const char *path, struct vzctl_reg_param *param, int fla
 	int owner_check_res;
 	int on_pcs, on_shared;
 	int ha_resource_added = 0;
+	int ha_del_everywhere = 0;
 	int ha_enable = 0;
+	int reserved = 0;
+	int lckfd = -1;
 	const char *data, *name;
 	ctid_t ctid = {};
 	ctid_t uuid = {};
@@ -907,27 +1236,27 @@ int vzctl2_env_register(const char *path, struct vzctl_reg_param *param, int fla
 		flags |= VZ_REG_SKIP_CLUSTER;
 
 	if (stat(path, &st) != 0)
-		return vzctl_err(-1, errno, "Unable to stat %s", path);
+		return vzctl_err(VZCTL_E_SYSTEM, errno, "Unable to stat %s", path);
 
 	if (realpath(path, path_r) == NULL)
-		return vzctl_err(-1, errno, "Failed to get realpath %s", path);
+		return vzctl_err(VZCTL_E_SYSTEM, errno, "Failed to get realpath %s", path);
 
 	ret = vzctl2_env_layout_version(path_r);
 	if (ret == -1) {
-		return -1;
+		return VZCTL_E_REGISTER;
 	} else if (ret < VZCTL_LAYOUT_4)
-		return vzctl_err(-1, 0, "Warning: Container in old data format,"
+		return vzctl_err(VZCTL_E_REGISTER, 0, "Warning: Container in old data format,"
 				" registration skipped.");
 
 	snprintf(veconf, sizeof(veconf), "%s/" VZCTL_VE_CONF, path_r);
 	if (stat(veconf, &st)) {
 		logger(-1, 0, "Error: Broken Container, no %s file found", veconf);
-		return -1;
+		return VZCTL_E_REGISTER;
 	}
 
 	h = vzctl2_env_open_conf(param->ctid, veconf, 0, &err);
 	if (h == NULL)
-		return -1;
+		return err ? err : VZCTL_E_REGISTER;
 
 	data = param->uuid;
 	/* get UUID from config if not specified */
@@ -937,10 +1266,25 @@ int vzctl2_env_register(const char *path, struct vzctl_reg_param *param, int fla
 	if (get_cid_uuid_pair(param->ctid, data, ctid, uuid))
 		goto err;
 
-	owner_check_res = vzctl_check_owner_quiet(
-			path_r, host, sizeof(host), ve_host, sizeof(ve_host));
-	on_pcs = (is_pcs(path_r) == 1);
-	on_shared = (is_shared_fs(path_r) == 1);
+	if (ctx != NULL) {
+		const struct reg_mnt_info *mi = ctx->mnt;
+
+		if (mi->on_shared == 1)
+			owner_check_res = check_env_owner(path_r, ctx->serverid,
+					ctx->hostname, host, sizeof(host),
+					ve_host, sizeof(ve_host));
+		else if (mi->on_shared == -1 && mi->shared_errno != ENOENT)
+			owner_check_res = VZCTL_E_SYSTEM;
+		else
+			owner_check_res = 0;
+		on_pcs = (mi->on_pcs == 1);
+		on_shared = (mi->on_shared == 1);
+	} else {
+		owner_check_res = vzctl_check_owner_quiet(path_r, host,
+				sizeof(host), ve_host, sizeof(ve_host));
+		on_pcs = (is_pcs(path_r) == 1);
+		on_shared = (is_shared_fs(path_r) == 1);
+	}
 
         if (vzctl2_env_get_param(h, "HA_ENABLE", &data) == 0 && data != NULL)
                 ha_enable = yesno2id(data);
@@ -969,11 +1313,34 @@ int vzctl2_env_register(const char *path, struct vzctl_reg_param *param, int fla
 					"You can force the registration, but this will revoke "
 					"all access to the Container from the original server.");
 			}
+			rc = owner_check_res;
 			goto err;
 		}
 
+		if (ctx != NULL) {
+			/* Concurrent batch workers: check and reserve the id
+			 * atomically by creating the registration link early
+			 */
+			lckfd = lock_dir(VZ_ENV_CONF_DIR);
+			if (lckfd == -1)
+				goto err;
+		}
+
 		if (validate_eid(h, &st, ctid))
 			goto err;
+
+		if (ctx != NULL) {
+			vzctl2_get_env_conf_path(ctid, buf, sizeof(buf));
+			if (lstat(buf, &st_r) && errno == ENOENT) {
+				if (symlink(veconf, buf)) {
+					logger(-1, errno, "Failed to create the symlink %s", buf);
+					goto err;
+				}
+				reserved = 1;
+			}
+			unlock_dir(lckfd);
+			lckfd = -1;
+		}
 	} else if ((owner_check_res == VZCTL_E_ENV_MANAGE_DISABLED) && on_shared) {
 		if (on_pcs && !(flags & VZ_REG_SKIP_CLUSTER)) {
 			/* [pstorage:] if CT already registered on other node, revoke leases */
@@ -984,20 +1351,18 @@ int vzctl2_env_register(const char *path, struct vzctl_reg_param *param, int fla
 				goto err;
 		}
 		if (!(flags & VZ_REG_SKIP_CLUSTER) && (ha_enable != VZCTL_PARAM_OFF)) {
-			/* remove resource from HA cluster
-			 * TODO : execute 'del-everywhere' and 'add' by one command
-			 *	 (https://jira.sw.ru/browse/PSBM-17374
+			/* remove resource from HA cluster, it is done by
+			 * the same batch as 'add' below (PSBM-17374)
 			 */
-			shaman_del_everywhere(ctid);
+			ha_del_everywhere = 1;
 		}
 	}
 	if (!(flags & VZ_REG_SKIP_CLUSTER) && on_shared && (ha_enable != VZCTL_PARAM_OFF)) {
-		/* TODO : execute 'del-everywhere' and 'add' by one command
-		 *		(https://jira.sw.ru/browse/PSBM-17374)
-		 * Right now ask HA cluster to register CT as resource
+		/* Ask HA cluster to register CT as resource
 		 * and will do it before filesystem operations
 		 */
-		if (shaman_add_resource(ctid, h->conf, path_r)) {
+		if (shaman_add_resource(ctid, h->conf, path_r,
+					ha_del_everywhere)) {
 			logger(-1, 0, "Error: Failed to register the Container %s on HA cluster",
 					ctid);
 			goto err;
@@ -1018,12 +1383,20 @@ int vzctl2_env_register(const char *path, struct vzctl_reg_param *param, int fla
 	}
 
 	ret = renew_VE_PRIVATE(h, path, ctid);
-	if (ret)
+	if (ret) {
+		rc = ret;
 		goto err;
+	}
 
 	/* restore CT name */
 	name = param->name ?: h->env_param->name->name;
 	if (name != NULL && *name != '\0') {
+		if (ctx != NULL) {
+			lckfd = lock_dir(ENV_NAME_DIR);
+			if (lckfd == -1)
+				goto err;
+		}
+
 		ctid_t t;
 		char x[PATH_MAX];
 		const char *new_name = name;
@@ -1055,6 +1428,8 @@ int vzctl2_env_register(const char *path, struct vzctl_reg_param *param, int fla
 			logger(-1, errno, "Unable to create the link %s", buf);
 			goto err;
 		}
+		unlock_dir(lckfd);
+		lckfd = -1;
 	}
 
 	vzctl2_env_set_param(h, "VEID", ctid);
@@ -1071,8 +1446,10 @@ int vzctl2_env_register(const char *path, struct vzctl_reg_param *param, int fla
 	}
 
 	ret = vzctl2_env_save_conf(h, veconf);
-	if (ret)
+	if (ret) {
+		rc = ret;
 		goto err;
+	}
 
 	/* create registration */
 	vzctl2_get_env_conf_path(ctid, buf, sizeof(buf));
@@ -1085,17 +1462,215 @@ int vzctl2_env_register(const char *path, struct vzctl_reg_param *param, int fla
 	vzctl2_env_close(h);
 	vzctl2_send_state_evt(ctid, VZCTL_ENV_REGISTERED);
 
+	if (out != NULL)
+		SET_CTID(out, ctid);
 	logger(0, 0, "Container %s was successfully registered", ctid);
 	return 0;
 
 err:
+	unlock_dir(lckfd);
+	if (reserved) {
+		vzctl2_get_env_conf_path(ctid, buf, sizeof(buf));
+		unlink(buf);
+	}
 	if (ha_resource_added)
 		shaman_del_resource(ctid);
 	vzctl2_env_close(h);
 	logger(-1, 0, "Container registration failed: %s",
 			vzctl2_get_last_error());
 
-	return -1;
+	return rc;
+}
+
+/** Register Container
+ * @param path		Container private data root
+ * @param param		struct vzctl_reg_param
+ * @param flags		registration flags
+ * @return		veid or -1 in case error
+ */
+int vzctl2_env_register(const char *path, struct vzctl_reg_param *param, int flags)
+{
+	return do_env_register(path, param, flags, NULL, NULL) ? -1 : 0;
+}
+
+struct reg_job_result {
+	int err;
+	ctid_t ctid;
+};
+
+struct reg_job {
+	struct vzctl_reg_batch_param *param;
+	const struct reg_mnt_info *mnt;
+	const struct reg_ctx *ctx;
+	int flags;
+	struct reg_job_result res;
+};
+
+static const struct reg_mnt_info *get_reg_mnt_info(struct reg_mnt_info *mnt,
+		int *nmnt, const char *path)
+{
+	int i;
+	struct stat st;
+	struct reg_mnt_info *mi;
+
+	if (stat(path, &st))
+		return NULL;
+
+	for (i = 0; i < *nmnt; i++)
+		if (mnt[i].dev == st.st_dev)
+			return &mnt[i];
+
+	mi = &mnt[(*nmnt)++];
+	mi->dev = st.st_dev;
+	mi->on_pcs = is_pcs(path);
+	mi->on_shared = is_shared_fs(path);
+	mi->shared_errno = mi->on_shared == -1 ? errno : 0;
+
+	return mi;
+}
+
+static int reg_job_fn(void *data)
+{
+	struct reg_job *job = data;
+	struct reg_ctx c = *job->ctx;
+
+	c.mnt = job->mnt;
+	job->res.err = do_env_register(job->param->path, &job->param->param,
+			job->flags, &c, job->res.ctid);
+
+	return job->res.err != 0;
+}
+
+static void reg_job_finished(struct vzctl_exec_task *t)
+{
+	struct reg_job *job = t->data;
+
+	if (t->status == 0) {
+		job->param->err = 0;
+		SET_CTID(job->param->ctid, job->res.ctid);
+	} else if (job->res.err)
+		job->param->err = job->res.err;
+	else
+		job->param->err = t->status > 0 ? t->status : VZCTL_E_SYSTEM;
+}
+
+int vzctl2_env_register_batch(struct vzctl_reg_batch_param *param, int n,
+		int flags, int max_jobs)
+{
+	int i, m = 0, failed = 0, nmnt = 0;
+	char serverid[STR_SIZE] = "";
+	char hostname[STR_SIZE] = "";
+	struct reg_mnt_info *mnt;
+	struct reg_job *jobs;
+	struct vzctl_exec_task *tasks;
+	struct reg_ctx ctx = {
+		.serverid = serverid,
+		.hostname = hostname,
+	};
+
+	if (n <= 0)
+		return 0;
+	if (max_jobs <= 0)
+		max_jobs = VZCTL_REG_MAX_JOBS;
+
+	jobs = calloc(n, sizeof(struct reg_job));
+	mnt = calloc(n, sizeof(struct reg_mnt_info));
+	tasks = calloc(n, sizeof(struct vzctl_exec_task));
+	if (jobs == NULL || mnt == NULL || tasks == NULL) {
+		free(jobs);
+		free(mnt);
+		free(tasks);
+		return vzctl_err(-1, ENOMEM, "vzctl2_env_register_batch");
+	}
+
+	/* node identity is looked up once for all owner checks */
+	get_serverid(serverid, sizeof(serverid));
+	if (get_hostname(hostname, sizeof(hostname) - 1))
+		ctx.hostname = NULL;
+
+	for (i = 0; i < n; i++) {
+		jobs[i].param = &param[i];
+		jobs[i].ctx = &ctx;
+		jobs[i].flags = flags;
+		param[i].err = 0;
+		param[i].ctid[0] = '\0';
+
+		/* cluster checks are done once per storage mount */
+		jobs[i].mnt = get_reg_mnt_info(mnt, &nmnt, param[i].path);
+		if (jobs[i].mnt == NULL) {
+			param[i].err = vzctl_err(VZCTL_E_SYSTEM, errno,
+					"Unable to stat %s", param[i].path);
+			continue;
+		}
+
+		tasks[m].fn = reg_job_fn;
+		tasks[m].data = &jobs[i];
+		tasks[m].res = &jobs[i].res;
+		tasks[m].res_size = sizeof(jobs[i].res);
+		tasks[m].finished = reg_job_finished;
+		m++;
+	}
+
+	vzctl2_exec_tasks(tasks, m, max_jobs);
+
+	for (i = 0; i < n; i++)
+		if (param[i].err)
+			failed++;
+
+	free(jobs);
+	free(mnt);
+	free(tasks);
+
+	logger(0, 0, "Registered %d of %d Container(s)", n - failed, n);
+
+	return failed;
+}
+
+/* Find VE_PRIVATE areas under dir */
+int vzctl2_env_find_private(const char *dir, char ***out)
+{
+	DIR *d;
+	struct dirent *ent;
+	char path[PATH_MAX];
+	char **ar = NULL, **t;
+	int n = 0;
+
+	*out = NULL;
+	d = opendir(dir);
+	if (d == NULL)
+		return vzctl_err(-1, errno, "Failed to open %s", dir);
+
+	while ((ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s/" VZCTL_VE_CONF,
+				dir, ent->d_name);
+		if (access(path, F_OK))
+			continue;
+
+		t = realloc(ar, (n + 2) * sizeof(char *));
+		if (t == NULL)
+			goto err;
+		ar = t;
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		if ((ar[n] = strdup(path)) == NULL)
+			goto err;
+		ar[++n] = NULL;
+	}
+	closedir(d);
+	*out = ar;
+
+	return n;
+
+err:
+	closedir(d);
+	if (ar != NULL) {
+		ar[n] = NULL;
+		free_ar_str(ar);
+		free(ar);
+	}
+
+	return vzctl_err(-1, ENOMEM, "vzctl2_env_find_private");
 }
 
 static int unregister_env_conf(struct vzctl_env_handle *h)
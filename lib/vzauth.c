@@ -37,12 +37,14 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "fs.h"
 #include "env.h"
 #include "vzerror.h"
 #include "logger.h"
 #include "util.h"
+#include "list.h"
 
 static int check_link(const char *file, int fd)
 {
@@ -216,36 +218,269 @@ static int get_user_hash(const char *user, int gid, char **hash)
 	return ret;
 }
 
-static int escape_chroot(int rootfd)
+static int check_hash(const char *password, const char *pw)
 {
-	int ret = fchdir(rootfd);
-	if (ret == -1)
-		return vzctl_err(VZCTL_E_SYSTEM, errno, "fchdir('/') failed");
-	ret = chroot(".");
+	struct crypt_data data = {};
+	char *pw_enc;
+
+	pw_enc = crypt_r(password, pw, &data);
+	if (pw_enc && !strcmp(pw_enc, pw))
+		return 0;
+
+	return VZCTL_E_AUTH;
+}
+
+/* Credentials looked up in the Container root */
+struct auth_cred {
+	int gid_ret;
+	int hash_ret;
+	char *hash;
+};
+
+static void get_user_cred(const char *user, int gid, struct auth_cred *cred)
+{
+	cred->gid_ret = 0;
+	cred->hash_ret = 0;
+	cred->hash = NULL;
+
+	if (gid != -1 && (cred->gid_ret = check_gid(user, gid)) != 0)
+		return;
+	cred->hash_ret = get_user_hash(user, gid, &cred->hash);
+}
+
+static int cred_auth(const struct auth_cred *cred, const char *password)
+{
+	if (cred->gid_ret)
+		return cred->gid_ret;
+	if (cred->hash_ret)
+		return cred->hash_ret;
+
+	return check_hash(password, cred->hash);
+}
+
+/* Per-Container credential cache, validated by the state of the files
+ * it was read from: the password database inside a mounted root or the
+ * top ploop delta of a stopped Container.
+ */
+#define AUTH_CACHE_MAX		256
+#define AUTH_KEY_NFILES		3
+
+struct auth_file_key {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+};
+
+struct auth_key {
+	int mounted;
+	struct auth_file_key f[AUTH_KEY_NFILES];
+};
+
+struct auth_cache_entry {
+	list_elem_t list;
+	ctid_t ctid;
+	char *user;
+	int gid;
+	struct auth_key key;
+	struct auth_cred cred;
+};
+
+static list_head_t _g_auth_cache = {
+	(list_elem_t *)&_g_auth_cache,
+	(list_elem_t *)&_g_auth_cache,
+};
+static int _g_auth_cache_n;
+static pthread_mutex_t _g_auth_cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void get_file_key(const char *path, struct auth_file_key *k)
+{
+	struct stat st;
+
+	memset(k, 0, sizeof(*k));
+	if (lstat(path, &st))
+		return;
+	k->dev = st.st_dev;
+	k->ino = st.st_ino;
+	k->size = st.st_size;
+	k->mtime = st.st_mtim;
+}
+
+static int get_auth_key(struct vzctl_env_handle *h, int mounted,
+		struct auth_key *key)
+{
+	const struct vzctl_fs_param *fs = h->env_param->fs;
+	char path[PATH_MAX];
+	const char *files[AUTH_KEY_NFILES] = {
+		"/etc/shadow", "/etc/passwd", "/etc/group"};
+	int i;
+
+	memset(key, 0, sizeof(*key));
+	key->mounted = mounted;
+	if (mounted) {
+		for (i = 0; i < AUTH_KEY_NFILES; i++) {
+			snprintf(path, sizeof(path), "%s%s", fs->ve_root, files[i]);
+			get_file_key(path, &key->f[i]);
+		}
+		return 0;
+	}
+
+	/* a stopped Container can be changed only through its image */
+	if (fs->layout < VZCTL_LAYOUT_5 || fs->ve_private == NULL ||
+			vzctl2_get_top_image_fname(fs->ve_private, path,
+				sizeof(path)))
+		return -1;
+	get_file_key(path, &key->f[0]);
+
+	return key->f[0].ino ? 0 : -1;
+}
+
+static void free_cache_entry(struct auth_cache_entry *e)
+{
+	free(e->user);
+	free(e->cred.hash);
+	free(e);
+}
+
+static struct auth_cache_entry *find_cache_entry(const ctid_t ctid,
+		const char *user, int gid)
+{
+	struct auth_cache_entry *e;
+
+	list_for_each(e, &_g_auth_cache, list)
+		if (!CMP_CTID(e->ctid, ctid) && e->gid == gid &&
+				!strcmp(e->user, user))
+			return e;
+
+	return NULL;
+}
+
+/* Returns auth result, -1 on cache miss */
+static int auth_cache_lookup(const ctid_t ctid, const char *user, int gid,
+		const struct auth_key *key, const char *password)
+{
+	struct auth_cache_entry *e;
+	struct auth_cred cred = {};
+	int ret = -1;
+
+	pthread_mutex_lock(&_g_auth_cache_mtx);
+	e = find_cache_entry(ctid, user, gid);
+	if (e != NULL && !memcmp(&e->key, key, sizeof(*key))) {
+		cred = e->cred;
+		if (cred.hash != NULL)
+			cred.hash = strdup(cred.hash);
+		if (e->cred.hash == NULL || cred.hash != NULL)
+			ret = 0;
+	}
+	pthread_mutex_unlock(&_g_auth_cache_mtx);
+
 	if (ret == -1)
-		logger(VZCTL_E_SYSTEM, errno, "chroot('/') failed");
+		return -1;
+
+	logger(5, 0, "Authenticate %s in %s from the cache", user, ctid);
+	ret = cred_auth(&cred, password);
+	free(cred.hash);
+
 	return ret;
 }
 
-static int userauth(const char *user, const char *password, int gid, int rootfd)
+static void auth_cache_update(const ctid_t ctid, const char *user, int gid,
+		const struct auth_key *key, const struct auth_cred *cred)
 {
-	int ret;
-	char *pw, *pw_enc;
+	struct auth_cache_entry *e;
+
+	pthread_mutex_lock(&_g_auth_cache_mtx);
+	e = find_cache_entry(ctid, user, gid);
+	if (e != NULL) {
+		list_del(&e->list);
+		free_cache_entry(e);
+		_g_auth_cache_n--;
+	}
 
-	if (gid != -1 && (ret = check_gid(user, gid)) != 0)
-		return ret;
-	ret = get_user_hash(user, gid, &pw);
-	if (ret != 0)
-		return ret;
-	ret = escape_chroot(rootfd);
-	if (ret == 0) {
-		struct crypt_data data = {};
-		ret = VZCTL_E_AUTH;
-		pw_enc = crypt_r(password, pw, &data);
-		if (pw_enc && !strcmp(pw_enc, pw))
-			ret = 0;
+	e = calloc(1, sizeof(struct auth_cache_entry));
+	if (e == NULL || (e->user = strdup(user)) == NULL ||
+			(cred->hash != NULL &&
+			 (e->cred.hash = strdup(cred->hash)) == NULL))
+	{
+		if (e != NULL)
+			free_cache_entry(e);
+		goto out;
 	}
-	free(pw);
+	SET_CTID(e->ctid, ctid);
+	e->gid = gid;
+	e->key = *key;
+	e->cred.gid_ret = cred->gid_ret;
+	e->cred.hash_ret = cred->hash_ret;
+
+	/* drop the least recently added */
+	if (_g_auth_cache_n >= AUTH_CACHE_MAX) {
+		struct auth_cache_entry *old;
+
+		old = list_entry(_g_auth_cache.prev, typeof(*old), list);
+		list_del(&old->list);
+		free_cache_entry(old);
+		_g_auth_cache_n--;
+	}
+	list_add(&e->list, &_g_auth_cache);
+	_g_auth_cache_n++;
+out:
+	pthread_mutex_unlock(&_g_auth_cache_mtx);
+}
+
+/* Read the credentials in the chroot and pass them to the parent */
+static int read_cred(const char *ve_root, const char *user, int gid,
+		struct auth_cred *cred)
+{
+	int p[2], len, ret;
+	pid_t pid;
+	char buf[4096];
+
+	if (pipe(p))
+		return vzctl_err(VZCTL_E_PIPE, errno, "Unable to create pipe");
+
+	pid = fork();
+	if (pid == -1) {
+		p_close(p);
+		return vzctl_err(VZCTL_E_FORK, errno, "Cannot fork");
+	} else if (pid == 0) {
+		struct auth_cred c = {};
+
+		close(p[0]);
+		if ((ret = vzctl_chroot(ve_root)) == 0) {
+			get_user_cred(user, gid, &c);
+			len = c.hash ? strlen(c.hash) : -1;
+			if (write(p[1], &c, sizeof(c)) != sizeof(c) ||
+					write(p[1], &len, sizeof(len)) != sizeof(len) ||
+					(len > 0 && write(p[1], c.hash, len) != len))
+				ret = VZCTL_E_SYSTEM;
+		}
+		_exit(ret);
+	}
+	close(p[1]);
+
+	ret = VZCTL_E_SYSTEM;
+	if (read(p[0], cred, sizeof(*cred)) != sizeof(*cred) ||
+			read(p[0], &len, sizeof(len)) != sizeof(len) ||
+			len >= (int)sizeof(buf))
+		goto out;
+	cred->hash = NULL;
+	if (len >= 0) {
+		if (len > 0 && TEMP_FAILURE_RETRY(read(p[0], buf, len)) != len)
+			goto out;
+		buf[len] = '\0';
+		cred->hash = strdup(buf);
+		if (cred->hash == NULL)
+			goto out;
+	}
+	ret = 0;
+out:
+	close(p[0]);
+	if (env_wait(pid, 0, NULL) && ret == 0) {
+		free(cred->hash);
+		cred->hash = NULL;
+		ret = VZCTL_E_SYSTEM;
+	}
+
 	return ret;
 }
 
@@ -283,6 +518,9 @@ int vzctl2_env_auth(struct vzctl_env_handle *h, const char *user, const char *pa
 {
 	int is_mounted = 0;
 	int pid, ret;
+	int has_key = 0;
+	struct auth_key key;
+	struct auth_cred cred = {};
 	struct vzctl_env_param *env;
 
 	if (user == NULL || passwd == NULL)
@@ -294,34 +532,42 @@ int vzctl2_env_auth(struct vzctl_env_handle *h, const char *user, const char *pa
 		 return VZCTL_E_VE_ROOT_NOTSET;
 
 	is_mounted = vzctl2_env_is_mounted(h);
+	if (type == 0) {
+		has_key = (get_auth_key(h, is_mounted, &key) == 0);
+		if (has_key) {
+			ret = auth_cache_lookup(EID(h), user, gid, &key, passwd);
+			if (ret != -1)
+				return ret;
+		}
+	}
+
 	if (!is_mounted) {
 		ret = vzctl2_env_mount(h, 0);
 		if (ret)
 			return ret;
 	}
 
-	if (!(pid = fork())) {
-		int rootfd = -1;
-		if (type == 0) {
-			rootfd = open("/", O_RDONLY);
-			if (rootfd == -1)
-				_exit(vzctl_err(VZCTL_E_SYSTEM, errno,
-					"failed to open '/' "));
-		}
-		if ((ret = vzctl_chroot(env->fs->ve_root)) == 0) {
-			if (type == 0)
-				ret = userauth(user, passwd, gid, rootfd);
-			else
-				ret = pleskauth(user, passwd);
-		}
-		if (rootfd != -1)
-			close(rootfd);
+	if (type == 0) {
+		ret = read_cred(env->fs->ve_root, user, gid, &cred);
+	} else if (!(pid = fork())) {
+		if ((ret = vzctl_chroot(env->fs->ve_root)) == 0)
+			ret = pleskauth(user, passwd);
 		_exit(ret);
-	}
-	ret = env_wait(pid, 0, NULL);
+	} else
+		ret = env_wait(pid, 0, NULL);
 
 	if (!is_mounted)
 		vzctl2_env_umount(h, 0);
 
+	if (type == 0 && ret == 0) {
+		/* the image is changed by mount, take the key afterwards */
+		if (!is_mounted || !has_key)
+			has_key = (get_auth_key(h, is_mounted, &key) == 0);
+		if (has_key)
+			auth_cache_update(EID(h), user, gid, &key, &cred);
+		ret = cred_auth(&cred, passwd);
+		free(cred.hash);
+	}
+
 	return ret;
 }
@@ -154,6 +154,8 @@ enum {
 	VZCTL_PARAM_IOLIMIT,
 	VZCTL_PARAM_IOLIMIT_MB,
 	VZCTL_PARAM_IOPSLIMIT,
+	VZCTL_PARAM_IOLIMIT_BURST,
+	VZCTL_PARAM_IOLIMIT_LATENCY,
 	VZCTL_PARAM_VE_TYPE,
 	VZCTL_PARAM_VE_UUID,
 	VZCTL_PARAM_APPLY_IPONLY,
@@ -26,7 +26,6 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
-#include <sys/utsname.h>
 
 #include "vzctl.h"
 #include "vzfeatures.h"
@@ -35,6 +34,7 @@
 #include "logger.h"
 #include "libvzctl.h"
 #include "util.h"
+#include "hostcap.h"
 
 struct feature_s {
 	char *name;
@@ -277,21 +277,15 @@ static int ver_cmp(const char *str1, const char *str2)
 	return 0;
 }
 
-static unsigned long get_supported_tech(void)
+unsigned long long get_kernel_tech(const char *kver, const char *arch)
 {
 	int i;
-	struct utsname uts;
 	unsigned long long mask;
-	const char *kver, *arch;
 
-	if (uname(&uts))
-		return 0;
-	arch = uts.machine;
 	/* Get architecture */
 	if (arch[0] == 'i' && arch[2] == '8' && arch[3] == '6' && arch[4] == 0)
 		arch = "x86";
 	mask = vzctl2_name2tech(arch);
-	kver = uts.release;
 	/* Get kernel supported technologies */
 	for (i = 0; i < sizeof(tech_mtx) / sizeof(tech_mtx[0]); i++)
 		if (ver_cmp(kver, tech_mtx[i].kver) >= 0)
@@ -311,7 +305,7 @@ unsigned long vzctl2_check_tech(unsigned long mask)
 {
 	unsigned long provides;
 
-	provides = get_supported_tech();
+	provides = get_host_caps()->tech;
 	if (provides & VZ_T_X86_64)
 		provides |= VZ_T_I386;
 	return (mask & provides) ^ mask;
@@ -41,6 +41,7 @@ void features_mask2str(struct vzctl_features_param *features, char *buf, int len
 int parse_technologies(unsigned long long *tech, const char *str);
 const char *tech2str(unsigned long long mask, char *buf, int len);
 unsigned long long tech2features(unsigned long long tech);
+unsigned long long get_kernel_tech(const char *kver, const char *arch);
 
 #ifdef __cplusplus
 }
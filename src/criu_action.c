@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <libgen.h>
+
+#include "libvzctl.h"
+
+/* criu --action-script helper, the action is passed in the environment */
+int main(int argc, char **argv)
+{
+	const char *action;
+
+	action = getenv("CRTOOLS_SCRIPT_ACTION");
+	if (action == NULL) {
+		fprintf(stderr, "Missing parameter CRTOOLS_SCRIPT_ACTION\n");
+		return 1;
+	}
+
+	vzctl2_init_log(basename(argv[0]));
+	if (vzctl2_lib_init())
+		return 1;
+
+	return vzctl2_criu_action(action) ? 1 : 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/* Micro-benchmark of the configuration value parsers.
+ *
+ * Usage: bench_config [iterations] [list size]
+ *
+ * For every sample parameter a synthetic value of 'list size' elements
+ * is parsed 'iterations' times through vzctl2_add_env_param_by_name(),
+ * then a synthetic config with all parameters is parsed as a whole.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libvzctl.h"
+#include "test.h"
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_param(struct config_param_sample *p, const char *val,
+		int iter, unsigned long long *ns)
+{
+	int i, ret = 0;
+	unsigned long long start, t = 0;
+	vzctl_env_param_ptr env;
+
+	for (i = 0; i < iter; i++) {
+		env = vzctl2_alloc_env_param();
+		if (env == NULL)
+			return -1;
+
+		start = now_ns();
+		ret = vzctl2_add_env_param_by_name(env, p->name, val);
+		t += now_ns() - start;
+
+		vzctl2_free_env_param(env);
+		if (ret)
+			break;
+	}
+	*ns = t;
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int i, j, ret, failed = 0;
+	int iter = 10000, nlist = 64;
+	unsigned long long ns, total = 0;
+	char **vals;
+	vzctl_env_param_ptr env;
+
+	if (argc > 1)
+		iter = atoi(argv[1]);
+	if (argc > 2)
+		nlist = atoi(argv[2]);
+	if (iter < 1 || nlist < 1) {
+		printf("bench_config [iterations] [list size]\n");
+		return 1;
+	}
+
+	vzctl2_init_log("bench_config");
+	vzctl2_set_log_quiet(1);
+
+	vals = calloc(n_config_params, sizeof(char *));
+	if (vals == NULL)
+		return 1;
+
+	printf("%-12s %10s %12s %12s\n", "PARAM", "LEN", "ns/op", "MB/s");
+	for (i = 0; i < n_config_params; i++) {
+		struct config_param_sample *p = &config_params[i];
+
+		vals[i] = gen_config_value(p, nlist);
+		if (vals[i] == NULL)
+			return 1;
+
+		ret = bench_param(p, vals[i], iter, &ns);
+		if (ret) {
+			printf("%-12s FAILED ret=%d\n", p->name, ret);
+			failed++;
+			continue;
+		}
+
+		printf("%-12s %10zu %12llu %12.2f\n", p->name, strlen(vals[i]),
+				ns / iter, ns ? strlen(vals[i]) * iter * 1000.0 / ns : 0);
+	}
+
+	/* synthetic config: all the parameters at once */
+	for (i = 0; i < iter; i++) {
+		unsigned long long start;
+
+		env = vzctl2_alloc_env_param();
+		if (env == NULL)
+			return 1;
+		start = now_ns();
+		for (j = 0; j < n_config_params; j++)
+			vzctl2_add_env_param_by_name(env, config_params[j].name,
+					vals[j]);
+		total += now_ns() - start;
+		vzctl2_free_env_param(env);
+	}
+	printf("%-12s %10d %12llu\n", "CONFIG", n_config_params, total / iter);
+
+	for (i = 0; i < n_config_params; i++)
+		free(vals[i]);
+	free(vals);
+
+	return failed != 0;
+}
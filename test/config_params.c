@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/* Samples of the configuration values used by the parser fuzzer
+ * and benchmark. sep != NULL means the value is a list and the
+ * sample can be repeated to build a large synthetic value.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+struct config_param_sample config_params[] = {
+	{"KMEMSIZE",	"9223372036854775807:9223372036854775807", NULL},
+	{"PHYSPAGES",	"0:262144", NULL},
+	{"SWAPPAGES",	"0:131072", NULL},
+	{"NUMPROC",	"65536:65536", NULL},
+	{"DISKSPACE",	"10485760:10485760", NULL},
+	{"BINDMOUNT",	"/vz/src:/mnt/dst,nosuid", " "},
+	{"DEVICES",	"c:10:229:rw", " "},
+	{"DEVNODES",	"fuse:rw", " "},
+	{"PCI",		"0000:01:00.0", " "},
+	{"MEMINFO",	"privvmpages:1", NULL},
+	{"FEATURES",	"nfs:on", " "},
+	{"NETIF",	"ifname=eth0,mac=00:18:51:AA:BB:CC,"
+			"host_ifname=veth100.0,host_mac=00:18:51:DD:EE:FF,"
+			"network=Bridged,ip=10.0.0.1/255.255.255.0", ";"},
+	{"DISK",	"uuid={73a0af3e-5cfb-4276-a594-9358d01a49f7},"
+			"enabled=yes,size=102400,image=/vz/private/100/root.hdd,"
+			"mnt=/", ";"},
+	{"IP_ADDRESS",	"10.0.0.1/255.255.255.0", " "},
+	{"CPUMASK",	"0-3,8", NULL},
+	{"IOLIMIT",	"10M", NULL},
+	{"CAPABILITY",	"NET_ADMIN:on,SYS_TIME:off", " "},
+};
+
+int n_config_params = sizeof(config_params) / sizeof(config_params[0]);
+
+/* Build a value of n repeated samples, the result should be freed */
+char *gen_config_value(struct config_param_sample *p, int n)
+{
+	int i, len, slen;
+	char *buf, *sp;
+
+	if (p->sep == NULL || n < 1)
+		n = 1;
+
+	slen = strlen(p->sample);
+	len = n * (slen + 1) + 1;
+	buf = malloc(len);
+	if (buf == NULL)
+		return NULL;
+
+	sp = buf;
+	for (i = 0; i < n; i++) {
+		if (i)
+			*sp++ = p->sep[0];
+		memcpy(sp, p->sample, slen);
+		sp += slen;
+	}
+	*sp = '\0';
+
+	return buf;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2015-2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/* libFuzzer entry point for the configuration value parsers.
+ *
+ * The first input byte selects the parameter, the rest is the value
+ * passed to vzctl2_add_env_param_by_name(), i.e. the same path the
+ * config loader takes.
+ *
+ * libFuzzer build:
+ *   clang -g -fsanitize=fuzzer,address -DFUZZ_LIBFUZZER \
+ *	-I../include -I../lib fuzz_config.c config_params.c -lvzctl2
+ * Without -DFUZZ_LIBFUZZER the binary replays the files given
+ * on the command line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "libvzctl.h"
+#include "test.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	char *val;
+	const char *name;
+	vzctl_env_param_ptr env;
+
+	if (size < 1)
+		return 0;
+
+	name = config_params[data[0] % n_config_params].name;
+
+	val = malloc(size);
+	if (val == NULL)
+		return 0;
+	memcpy(val, data + 1, size - 1);
+	val[size - 1] = '\0';
+
+	env = vzctl2_alloc_env_param();
+	if (env != NULL) {
+		vzctl2_add_env_param_by_name(env, name, val);
+		vzctl2_free_env_param(env);
+	}
+	free(val);
+
+	return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+int main(int argc, char **argv)
+{
+	int i;
+	FILE *fp;
+	size_t n;
+	static uint8_t buf[1024 * 1024];
+
+	vzctl2_init_log("fuzz_config");
+	vzctl2_set_log_quiet(1);
+
+	for (i = 1; i < argc; i++) {
+		fp = fopen(argv[i], "r");
+		if (fp == NULL) {
+			fprintf(stderr, "Unable to open %s\n", argv[i]);
+			return 1;
+		}
+		n = fread(buf, 1, sizeof(buf), fp);
+		fclose(fp);
+
+		printf("(info) %s %zu bytes\n", argv[i], n);
+		LLVMFuzzerTestOneInput(buf, n);
+	}
+
+	return 0;
+}
+#endif
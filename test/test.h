@@ -69,6 +69,16 @@ do { \
 } while(0);
 
 
+struct config_param_sample {
+	const char *name;
+	const char *sample;
+	const char *sep;
+};
+
+extern struct config_param_sample config_params[];
+extern int n_config_params;
+char *gen_config_value(struct config_param_sample *p, int n);
+
 void test_vzctl();
 void test_config();
 void inc_failed();
@@ -1335,10 +1335,45 @@ void test_config_CAPABILITY(vzctl_env_handle_ptr h)
 	vzctl_env_param_ptr new_param;
 	vzctl_env_handle_ptr h_res = NULL;
 	const char *p = NULL;
+	const char *str = "NET_ADMIN:on,CHOWN:off SYS_TIME:on\tKILL:off KILL:on";
+	const char *res = "CHOWN:off KILL:on NET_ADMIN:on SYS_TIME:on";
+	const char *bad[] = {"CHOWN", "CHOWN:maybe", "FOO:on", ":on",
+		"CHOWN:on NET_ADMIN", NULL};
+	unsigned long capmask, setted_capmask;
 
 	TEST()
+	CHECK_PTR(new_param, vzctl2_alloc_env_param())
+	printf("(info) test_config_CAPABILITY incorrect\n");
+	for (i = 0; bad[i] != NULL; i++) {
+		if (vzctl2_add_env_param_by_name(new_param, "CAPABILITY", bad[i]) == 0)
+			TEST_ERR("vzctl2_add_env_param_by_name");
+	}
+	vzctl2_free_env_param(new_param);
+
+	printf("(info) test_config_CAPABILITY=%s\n", str);
+	CHECK_PTR(new_param, vzctl2_alloc_env_param())
+	CHECK_RET(vzctl2_add_env_param_by_name(new_param, "CAPABILITY", str))
+	CHECK_RET(vzctl2_env_get_cap(new_param, &capmask))
+	CHECK_RET(vzctl2_apply_param(h, new_param, VZCTL_SAVE))
+	vzctl2_free_env_param(new_param);
+
+	CHECK_PTR(h_res, vzctl2_env_open(ctid, VZCTL_CONF_SKIP_NON_EXISTS, &err))
+	CHECK_RET(vzctl2_env_get_param(h_res, "CAPABILITY", &p))
+	if (p == NULL || strcmp(p, res)) {
+		printf("\t(err) %s != %s\n", res, p);
+		TEST_ERR("vzctl2_env_get_param CAPABILITY");
+	}
+	CHECK_RET(vzctl2_env_get_cap(vzctl2_get_env_param(h_res), &setted_capmask))
+	if (capmask != setted_capmask) {
+		printf("\t(err) cap mask=%lx, setted cap mask=%lx\n",
+			capmask, setted_capmask);
+		TEST_ERR("vzctl2_env_get_cap")
+	}
+	vzctl2_env_close(h_res);
+
 	for (i = 0; i < 4; i++) {
-		unsigned long capmask = 0, old_capmask = 0, setted_capmask = 0;
+		unsigned long old_capmask = 0;
+
 		CHECK_PTR(h_res, vzctl2_env_open(ctid, VZCTL_CONF_SKIP_NON_EXISTS, &err))
 		CHECK_RET(vzctl2_env_get_cap(vzctl2_get_env_param(h_res), &old_capmask))
 		CHECK_RET(vzctl2_env_get_param(h_res, "CAPABILITY", &p))
@@ -1348,7 +1383,7 @@ void test_config_CAPABILITY(vzctl_env_handle_ptr h)
 		else if (i == 1)
 			capmask = i;
 		else if (i == 2)
-			capmask = rand_ul();
+			capmask = rand_ul() & 0xffffffff;
 		else
 			capmask = vzctl2_get_default_capmask();
 
@@ -1614,7 +1649,6 @@ void test_config()
 
 #if 0
 	test_config_DISK(h);
-	test_config_CAPABILITY(h);
 	test_config_UPTIME(h);
 #endif
 
@@ -1636,6 +1670,7 @@ void test_config()
 	test_config_layout(h);
 	test_config_APPLY_IPONLY(h);
 	test_config_FEATURES(h);
+	test_config_CAPABILITY(h);
 	test_config_netfilter(h);
 	test_config_NAME(h);
 	test_config_high_availability(h);
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/* Failure counters delta: the snapshot merge against the cursor.
+ * lib/failcnt.c is built into the binary, the counters are fed
+ * directly instead of being read from the host.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "failcnt.h"
+
+static int _nfailed;
+static int _ntest;
+
+void inc_failed()
+{
+	_nfailed++;
+}
+
+void inc_test()
+{
+	_ntest++;
+}
+
+struct failcnt_sample {
+	const char *ctid;
+	const char *name;
+	unsigned long long value;
+};
+
+/* Merge the samples, compare the reported deltas with the expected ones.
+ * Returns the number of deltas or -1.
+ */
+static int check_delta(struct vzctl_failcnt_cursor *c,
+		struct failcnt_sample *in, int nin,
+		struct vzctl_failcnt *expected, int nexp)
+{
+	struct failcnt_snap s = {};
+	struct vzctl_failcnt *d;
+	int i, n;
+
+	for (i = 0; i < nin; i++)
+		if (add_failcnt_entry(&s, in[i].ctid, in[i].name, in[i].value))
+			return -1;
+
+	if (merge_failcnt_snap(c, &s, &d, &n))
+		return -1;
+	if (n != nexp) {
+		printf("deltas %d != %d\n", n, nexp);
+		n = -1;
+	}
+	for (i = 0; n != -1 && i < n; i++) {
+		if (strcmp(d[i].ctid, expected[i].ctid) ||
+				strcmp(d[i].name, expected[i].name) ||
+				d[i].failcnt != expected[i].failcnt ||
+				d[i].delta != expected[i].delta)
+		{
+			printf("delta %d: %s %s %llu %llu\n", i, d[i].ctid,
+					d[i].name, d[i].failcnt, d[i].delta);
+			n = -1;
+		}
+	}
+	free(d);
+
+	return n;
+}
+
+void test_failcnt_delta()
+{
+	struct vzctl_failcnt_cursor *c;
+	struct failcnt_sample first[] = {
+		{"102", "numproc", 3},
+		{"101", "memory.oom_kill", 0},
+		{"101", "memory.failcnt", 5},
+		{"101", "kmemsize", 1},
+	};
+	struct vzctl_failcnt first_delta[] = {
+		{"101", "kmemsize", 1, 1},
+		{"101", "memory.failcnt", 5, 5},
+		{"102", "numproc", 3, 3},
+	};
+	/* 101 kmemsize is gone, 100 is new, 102 numproc was reset */
+	struct failcnt_sample second[] = {
+		{"102", "numproc", 1},
+		{"101", "memory.oom_kill", 2},
+		{"101", "memory.failcnt", 7},
+		{"100", "numproc", 4},
+		{"100", "kmemsize", 0},
+	};
+	struct vzctl_failcnt second_delta[] = {
+		{"100", "numproc", 4, 4},
+		{"101", "memory.failcnt", 7, 2},
+		{"101", "memory.oom_kill", 2, 2},
+		{"102", "numproc", 1, 1},
+	};
+	/* 101 kmemsize is back with the same value, it is new again */
+	struct failcnt_sample third[] = {
+		{"101", "kmemsize", 1},
+		{"101", "memory.failcnt", 7},
+		{"102", "numproc", 1},
+	};
+	struct vzctl_failcnt third_delta[] = {
+		{"101", "kmemsize", 1, 1},
+	};
+	TEST()
+
+	CHECK_PTR(c, vzctl2_failcnt_cursor_open())
+
+	CHECK_RET(check_delta(c, first, 4, first_delta, 3) != 3)
+	/* nothing changed */
+	CHECK_RET(check_delta(c, first, 4, NULL, 0) != 0)
+	CHECK_RET(check_delta(c, second, 5, second_delta, 4) != 4)
+	CHECK_RET(check_delta(c, third, 3, third_delta, 1) != 1)
+	/* all the counters are gone */
+	CHECK_RET(check_delta(c, NULL, 0, NULL, 0) != 0)
+	CHECK_RET(c->n != 0)
+
+	vzctl2_failcnt_cursor_close(c);
+}
+
+int main(int argc, char **argv)
+{
+	test_failcnt_delta();
+
+	if (_nfailed)
+		printf("FAILED:%d test:%d\n", _nfailed, _ntest);
+	else
+		printf("OK test:%d\n", _ntest);
+
+	return (_nfailed != 0);
+}
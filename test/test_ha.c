@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/* HA batch client tested against the shaman-stub script, lib/ha.c is
+ * built into the binary with SHAMAN_BIN pointing to the stub.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "test.h"
+#include "ha.h"
+
+static int _nfailed;
+static int _ntest;
+static char log_path[] = "/tmp/test_ha.XXXXXX";
+
+void inc_failed()
+{
+	_nfailed++;
+}
+
+void inc_test()
+{
+	_ntest++;
+}
+
+/* Library internals used by the built in ha.c */
+void logger(int log_level, int err_num, const char *format, ...)
+{
+	va_list ap;
+
+	if (log_level > 0)
+		return;
+	va_start(ap, format);
+	vfprintf(stdout, format, ap);
+	va_end(ap);
+	if (err_num)
+		fprintf(stdout, ": %s", strerror(err_num));
+	fprintf(stdout, "\n");
+}
+
+int stat_file(const char *file)
+{
+	struct stat st;
+
+	return stat(file, &st) == 0;
+}
+
+int env_wait(int pid, int timeout, int *retcode)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status))
+		return -1;
+	*retcode = WEXITSTATUS(status);
+	return 0;
+}
+
+int parse_int(const char *str, int *val)
+{
+	char *tail;
+
+	errno = 0;
+	*val = strtol(str, &tail, 10);
+	return (*tail != '\0' || errno == ERANGE);
+}
+
+/* Run the queued operations, compare the shaman calls with the expected log */
+static int commit(struct ha_batch *b, const char *mode, const char *rc,
+		const char *expected)
+{
+	char buf[4096];
+	FILE *fp;
+	int n;
+
+	setenv("SHAMAN_MODE", mode, 1);
+	setenv("SHAMAN_RC", rc, 1);
+	truncate(log_path, 0);
+
+	n = ha_batch_commit(b);
+
+	if ((fp = fopen(log_path, "r")) == NULL)
+		return -1;
+	buf[fread(buf, 1, sizeof(buf) - 1, fp)] = '\0';
+	fclose(fp);
+	if (strcmp(buf, expected)) {
+		printf("shaman calls:\n%sexpected:\n%s", buf, expected);
+		return -1;
+	}
+
+	return n;
+}
+
+static struct ha_op *get_op(struct ha_batch *b, int i)
+{
+	struct ha_op *op;
+
+	list_for_each(op, &b->ops, list)
+		if (i-- == 0)
+			return op;
+	return NULL;
+}
+
+void test_ha_batch()
+{
+	struct ha_batch b;
+	unsigned long prio = 5;
+	ctid_t ct1 = "101", ct2 = "102";
+	TEST()
+
+	ha_batch_init(&b);
+	CHECK_RET(ha_batch_queue(&b, HA_CMD_DEL_EVERYWHERE, ct1, NULL, NULL))
+	CHECK_RET(ha_batch_queue(&b, HA_CMD_ADD, ct1, &prio, "/vz/private/101"))
+	CHECK_RET(ha_batch_queue(&b, HA_CMD_DEL, ct2, NULL, NULL))
+
+	/* one call, the operations are submitted in order */
+	CHECK_RET(commit(&b, "", "", "batch\n"
+			"  del-everywhere ct-101 \n"
+			"  add ct-101 --prio 5 --path /vz/private/101\n"
+			"  del ct-102 \n") != 0)
+	CHECK_RET(get_op(&b, 0)->rc || get_op(&b, 1)->rc || get_op(&b, 2)->rc)
+
+	/* per-resource status, del-everywhere is not counted */
+	CHECK_RET(commit(&b, "", "del-everywhere ct-101 1;del ct-102 3",
+			"batch\n"
+			"  del-everywhere ct-101 \n"
+			"  add ct-101 --prio 5 --path /vz/private/101\n"
+			"  del ct-102 \n") != 1)
+	CHECK_RET(get_op(&b, 0)->rc != 1 || get_op(&b, 1)->rc ||
+			get_op(&b, 2)->rc != 3)
+
+	/* exit code 2: add is retried as set in the second batch */
+	CHECK_RET(commit(&b, "", "add ct-101 2",
+			"batch\n"
+			"  del-everywhere ct-101 \n"
+			"  add ct-101 --prio 5 --path /vz/private/101\n"
+			"  del ct-102 \n"
+			"batch\n"
+			"  set ct-101 --prio 5 --path /vz/private/101\n") != 0)
+	CHECK_RET(get_op(&b, 1)->rc)
+
+	/* oversized reply lines are skipped */
+	CHECK_RET(commit(&b, "garbage", "", "batch\n"
+			"  del-everywhere ct-101 \n"
+			"  add ct-101 --prio 5 --path /vz/private/101\n"
+			"  del ct-102 \n") != 0)
+	ha_batch_free(&b);
+}
+
+void test_ha_fallback()
+{
+	struct ha_batch b;
+	unsigned long prio = 5;
+	ctid_t ct1 = "101", ct2 = "102";
+	TEST()
+
+	ha_batch_init(&b);
+	CHECK_RET(ha_batch_queue(&b, HA_CMD_SET, ct1, &prio, "/vz/private/101"))
+	CHECK_RET(ha_batch_queue(&b, HA_CMD_DEL, ct2, NULL, NULL))
+
+	/* no batch support: one call per resource with the same retry */
+	CHECK_RET(commit(&b, "nobatch", "set ct-101 2;del ct-102 1",
+			"batch\n"
+			"set ct-101 --prio 5 --path /vz/private/101\n"
+			"add ct-101 --prio 5 --path /vz/private/101\n"
+			"del ct-102\n") != 1)
+	CHECK_RET(get_op(&b, 0)->rc || get_op(&b, 1)->rc != 1)
+	ha_batch_free(&b);
+}
+
+int main(int argc, char **argv)
+{
+	int fd;
+
+	if ((fd = mkstemp(log_path)) == -1) {
+		printf("FAILED: unable to create %s\n", log_path);
+		return 1;
+	}
+	close(fd);
+	setenv("SHAMAN_LOG", log_path, 1);
+
+	test_ha_batch();
+	test_ha_fallback();
+
+	unlink(log_path);
+
+	if (_nfailed)
+		printf("FAILED:%d test:%d\n", _nfailed, _ntest);
+	else
+		printf("OK test:%d\n", _ntest);
+
+	return (_nfailed != 0);
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/* Node side network helpers tested in a private network namespace:
+ * a bridge uplink br0 with the veth port vt0, the packets sent on the
+ * uplink are captured on the vt1 peer. Needs root and iproute2.
+ *
+ * The library sources under test are built into the binary as they
+ * are not exported by libvzctl2.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <netpacket/packet.h>
+#include <sys/socket.h>
+#include <sys/mount.h>
+
+#include "test.h"
+#include "net.h"
+#include "arpsend.h"
+
+static int _nfailed;
+static int _ntest;
+
+void inc_failed()
+{
+	_nfailed++;
+}
+
+void inc_test()
+{
+	_ntest++;
+}
+
+/* Library internals used by the built in sources */
+void logger(int log_level, int err_num, const char *format, ...)
+{
+	va_list ap;
+
+	if (log_level > 0)
+		return;
+	va_start(ap, format);
+	vfprintf(stdout, format, ap);
+	va_end(ap);
+	if (err_num)
+		fprintf(stdout, ": %s", strerror(err_num));
+	fprintf(stdout, "\n");
+}
+
+int get_netaddr(const char *ip, unsigned int *addr)
+{
+	int family = strchr(ip, ':') ? AF_INET6 : AF_INET;
+
+	return inet_pton(family, ip, addr) == 1 ? family : -1;
+}
+
+static int setup_netns(void)
+{
+	if (unshare(CLONE_NEWNET | CLONE_NEWNS) ||
+			mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) ||
+			mount("sysfs", "/sys", "sysfs", 0, NULL))
+		return -1;
+
+	return system("ip link add br0 type bridge && "
+			"ip link add vt0 type veth peer name vt1 && "
+			"ip link set vt0 master br0 && "
+			"ip link set br0 up && ip link set vt0 up && "
+			"ip link set vt1 up && "
+			"ip addr add 192.0.2.1/24 dev br0") ? -1 : 0;
+}
+
+static int open_sniffer(const char *dev)
+{
+	struct sockaddr_ll sll = {
+		.sll_family = AF_PACKET,
+		.sll_protocol = htons(ETH_P_ARP),
+		.sll_ifindex = if_nametoindex(dev),
+	};
+	int fd;
+
+	fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, htons(ETH_P_ARP));
+	if (fd == -1)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&sll, sizeof(sll))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Wait for the ARP packet with the given op and sender address */
+static int wait_arp(int fd, int op, const char *spa)
+{
+	struct {
+		struct arphdr hdr;
+		unsigned char sha[ETH_ALEN];
+		unsigned char spa[4];
+		unsigned char tha[ETH_ALEN];
+		unsigned char tpa[4];
+	} __attribute__((packed)) p;
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	unsigned char addr[4];
+
+	inet_pton(AF_INET, spa, addr);
+	while (poll(&pfd, 1, 1000) == 1) {
+		if (recv(fd, &p, sizeof(p), 0) != sizeof(p))
+			continue;
+		if (p.hdr.ar_op == htons(op) && !memcmp(p.spa, addr, 4))
+			return 0;
+	}
+
+	return -1;
+}
+
+void test_arpsend()
+{
+	struct arpsend_ctx arp;
+	struct vzctl_ip_param ip = {.ip = "192.0.2.10"};
+	list_head_t ips;
+	int fd;
+	TEST()
+
+	list_head_init(&ips);
+	list_add_tail(&ip.list, &ips);
+	CHECK_RET((fd = open_sniffer("vt1")) == -1)
+
+	arpsend_init(&arp);
+	CHECK_RET(arpsend_add_node_devs(&arp))
+	CHECK_RET(list_empty(&arp.devs))
+	CHECK_RET(strcmp(((struct arpsend_dev *)arp.devs.next)->name, "br0"))
+	CHECK_RET(arpsend_add_ips(&arp, &ips))
+	CHECK_RET(arpsend_open(&arp))
+
+	/* nobody owns the address: the probe is sent, no conflicts */
+	CHECK_RET(arpsend_run(&arp, ARPSEND_DETECT, 200) != 0)
+	CHECK_RET(wait_arp(fd, ARPOP_REQUEST, "0.0.0.0"))
+	CHECK_RET(arpsend_run(&arp, ARPSEND_REPLY, 0))
+	CHECK_RET(wait_arp(fd, ARPOP_REPLY, "192.0.2.10"))
+	arpsend_free(&arp);
+
+	/* the uplink is gone: nothing can be sent */
+	arpsend_init(&arp);
+	CHECK_RET(arpsend_add_node_devs(&arp))
+	CHECK_RET(arpsend_add_ips(&arp, &ips))
+	CHECK_RET(system("ip link del br0"))
+	CHECK_RET(arpsend_run(&arp, ARPSEND_REPLY, 0) != -1)
+	arpsend_free(&arp);
+	close(fd);
+}
+
+int main(int argc, char **argv)
+{
+	if (getuid() != 0) {
+		printf("SKIPPED: test_net needs root\n");
+		return 0;
+	}
+
+	if (setup_netns()) {
+		printf("FAILED: unable to set up the network namespace\n");
+		return 1;
+	}
+
+	test_arpsend();
+
+	if (_nfailed)
+		printf("FAILED:%d test:%d\n", _nfailed, _ntest);
+	else
+		printf("OK test:%d\n", _ntest);
+
+	return (_nfailed != 0);
+}
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2017, Parallels International GmbH
+ *
+ * This file is part of OpenVZ libraries. OpenVZ is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either version
+ * 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/> or write to Free Software Foundation,
+ * 51 Franklin Street, Fifth Floor Boston, MA 02110, USA.
+ *
+ * Our contact details: Parallels International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+/* The tc class model of the native shaping: list and rate parsing and
+ * the tc batch generated for the installed vs wanted class sets.
+ * lib/tc_batch.c is built into the binary, it is not exported by
+ * libvzctl2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "test.h"
+#include "tc_batch.h"
+
+#define TEST_HZ		1000
+#define TEST_MARK	160
+#define TEST_CLASS	0x2711
+
+static int _nfailed;
+static int _ntest;
+
+void inc_failed()
+{
+	_nfailed++;
+}
+
+void inc_test()
+{
+	_ntest++;
+}
+
+/* Library internals used by the built in tc_batch.c */
+void logger(int log_level, int err_num, const char *format, ...)
+{
+	va_list ap;
+
+	if (log_level > 0)
+		return;
+	va_start(ap, format);
+	vfprintf(stdout, format, ap);
+	va_end(ap);
+	fprintf(stdout, "\n");
+}
+
+static void init_shape(struct tc_shape *s)
+{
+	memset(s, 0, sizeof(*s));
+	strcpy(s->devs[s->ndevs++], "eth0");
+	strcpy(s->devs[s->ndevs++], "eth1");
+	/* root classes 1:2 and 1:3 exist on eth0 */
+	s->roots[0] = (1U << 1) | (1U << 2);
+	s->tc_class = TEST_CLASS;
+	s->mark = TEST_MARK;
+}
+
+static struct tc_class_ent *add_ent(struct tc_class_ent *ents, int *n,
+		int dev, int net_class, unsigned int rate, unsigned int ceil)
+{
+	struct tc_class_ent *e = &ents[(*n)++];
+
+	memset(e, 0, sizeof(*e));
+	e->dev = dev;
+	e->net_class = net_class;
+	e->rate = rate;
+	e->ceil = ceil;
+
+	return e;
+}
+
+/* Compare the generated batch, returns the number of commands or -1 */
+static int check_batch(struct tc_shape *s, const char *expected)
+{
+	struct tc_batch b = {};
+	int n;
+
+	n = build_tc_batch(s, &b, TEST_HZ);
+	if (n != -1 && strcmp(b.buf != NULL ? b.buf : "", expected)) {
+		printf("tc batch:\n%sexpected:\n%s", b.buf, expected);
+		n = -2;
+	}
+	free(b.buf);
+
+	return n;
+}
+
+void test_parse_tc_list()
+{
+	struct tc_shape s;
+	struct tc_rate_ent e[TC_MAX_ENTS];
+	TEST()
+
+	init_shape(&s);
+	CHECK_RET(parse_tc_list(&s, NULL, e, TC_MAX_ENTS) != 0)
+
+	/* '*' is expanded to the devices without an explicit entry */
+	CHECK_RET(parse_tc_list(&s, "eth0:1:100 *:2:50 eth1:2:70,*:1:10",
+				e, TC_MAX_ENTS) != 4)
+	CHECK_RET(strcmp(e[0].dev, "eth0") || e[0].net_class != 1 ||
+			e[0].val != 100 || !e[0].has_val)
+	CHECK_RET(strcmp(e[1].dev, "eth1") || e[1].net_class != 2 ||
+			e[1].val != 70)
+	CHECK_RET(strcmp(e[2].dev, "eth0") || e[2].net_class != 2 ||
+			e[2].val != 50)
+	CHECK_RET(strcmp(e[3].dev, "eth1") || e[3].net_class != 1 ||
+			e[3].val != 10)
+
+	/* the value is optional, the first entry for a class wins */
+	CHECK_RET(parse_tc_list(&s, "eth0:3 eth0:3:20", e, TC_MAX_ENTS) != 1)
+	CHECK_RET(e[0].has_val)
+
+	CHECK_RET(parse_tc_list(&s, "eth0:1 eth1:1", e, 1) != -1)
+	CHECK_RET(parse_tc_list(&s, "eth0", e, TC_MAX_ENTS) != -1)
+	CHECK_RET(parse_tc_list(&s, ":1", e, TC_MAX_ENTS) != -1)
+	CHECK_RET(parse_tc_list(&s, "eth0:x", e, TC_MAX_ENTS) != -1)
+	CHECK_RET(parse_tc_list(&s, "eth0:0", e, TC_MAX_ENTS) != -1)
+	CHECK_RET(parse_tc_list(&s, "eth0:16", e, TC_MAX_ENTS) != -1)
+	CHECK_RET(parse_tc_list(&s, "eth0:1:abc", e, TC_MAX_ENTS) != -1)
+	CHECK_RET(parse_tc_list(&s, "eth0:1:10x", e, TC_MAX_ENTS) != -1)
+	CHECK_RET(parse_tc_list(&s, "abcdefghijklmnopq:1", e,
+				TC_MAX_ENTS) != -1)
+}
+
+void test_parse_tc_rate()
+{
+	const char *str = "class htb 2:2711 parent 1:2 prio 1 rate 8Mbit "
+		"ceil 1500Kbit burst 1600b cburst 1600b";
+	unsigned int v;
+	TEST()
+
+	CHECK_RET(parse_tc_rate(str, " rate ", &v) || v != 8000)
+	CHECK_RET(parse_tc_rate(str, " ceil ", &v) || v != 1500)
+	CHECK_RET(parse_tc_rate(" rate 1.5Gbit", " rate ", &v) || v != 1500000)
+	CHECK_RET(parse_tc_rate(" rate 2Tbit", " rate ", &v) || v != 2000000000)
+	CHECK_RET(parse_tc_rate(" rate 1500bit", " rate ", &v) || v != 2)
+	CHECK_RET(parse_tc_rate(" rate 1000 ", " rate ", &v) != -1)
+	CHECK_RET(parse_tc_rate(" rate Mbit", " rate ", &v) != -1)
+	CHECK_RET(parse_tc_rate(str, " mpu ", &v) != -1)
+}
+
+void test_rate_eq()
+{
+	TEST()
+
+	CHECK_RET(!tc_rate_eq(8000, 8000))
+	CHECK_RET(!tc_rate_eq(8009, 8000))
+	CHECK_RET(!tc_rate_eq(7991, 8000))
+	CHECK_RET(tc_rate_eq(8010, 8000))
+	CHECK_RET(tc_rate_eq(7990, 8000))
+	/* 1Gbit is shown as 1049Mbit for 1048576Kbit */
+	CHECK_RET(!tc_rate_eq(1049000, 1048576))
+	CHECK_RET(!tc_rate_eq(1, 0))
+	CHECK_RET(tc_rate_eq(2, 0))
+}
+
+void test_build_tc_batch()
+{
+	struct tc_shape s;
+	struct tc_class_ent *e;
+	TEST()
+
+	/* class and all its filters are added */
+	init_shape(&s);
+	add_ent(s.want, &s.nwant, 0, 1, 1000, 2000);
+	CHECK_RET(check_batch(&s,
+		"class add dev eth0 parent 2: classid 2:2711 htb rate 1000Kbit "
+			"prio 1 maxburst 10 ceil 2000Kbit\n"
+		"filter add dev eth0 protocol ip parent 1:0 prio 1 handle 161 fw "
+			"classid 1:2\n"
+		"filter add dev eth0 protocol ip parent 2:0 prio 1 handle 161 fw "
+			"classid 2:2711\n"
+		"filter add dev eth0 protocol ipv6 parent 1:0 prio 2 handle 161 fw "
+			"classid 1:2\n"
+		"filter add dev eth0 protocol ipv6 parent 2:0 prio 2 handle 161 fw "
+			"classid 2:2711\n") != 1)
+
+	/* no root class to attach to */
+	init_shape(&s);
+	add_ent(s.want, &s.nwant, 1, 1, 1000, 2000);
+	CHECK_RET(check_batch(&s, "") != -1)
+
+	/* installed as wanted, the rate is within the tc rounding */
+	init_shape(&s);
+	add_ent(s.want, &s.nwant, 0, 1, 1048576, 1048576);
+	e = add_ent(s.cur, &s.ncur, 0, 1, 1049000, 1049000);
+	e->filters = TC_ALL_FILTERS;
+	CHECK_RET(check_batch(&s, "") != 0)
+
+	/* rate changed, the class is changed in place */
+	init_shape(&s);
+	add_ent(s.want, &s.nwant, 0, 2, 3000, 4000);
+	e = add_ent(s.cur, &s.ncur, 0, 2, 1000, 4000);
+	e->filters = TC_ALL_FILTERS;
+	CHECK_RET(check_batch(&s,
+		"class change dev eth0 parent 3: classid 3:2711 htb rate 3000Kbit "
+			"prio 1 maxburst 10 ceil 4000Kbit\n") != 1)
+
+	/* mpu is not read back, it is always reapplied */
+	init_shape(&s);
+	e = add_ent(s.want, &s.nwant, 0, 2, 100000, 100000);
+	e->mpu = 1000;
+	e = add_ent(s.cur, &s.ncur, 0, 2, 100000, 100000);
+	e->filters = TC_ALL_FILTERS;
+	CHECK_RET(check_batch(&s,
+		"class change dev eth0 parent 3: classid 3:2711 htb rate 100000Kbit "
+			"prio 1 maxburst 12 ceil 100000Kbit mpu 1000\n") != 1)
+
+	/* the lost ipv6 filters are added back */
+	init_shape(&s);
+	add_ent(s.want, &s.nwant, 0, 1, 1000, 2000);
+	e = add_ent(s.cur, &s.ncur, 0, 1, 1000, 2000);
+	e->filters = TC_FILTER_BIT(0, 0) | TC_FILTER_BIT(0, 1);
+	CHECK_RET(check_batch(&s,
+		"filter add dev eth0 protocol ipv6 parent 1:0 prio 2 handle 161 fw "
+			"classid 1:2\n"
+		"filter add dev eth0 protocol ipv6 parent 2:0 prio 2 handle 161 fw "
+			"classid 2:2711\n") != 1)
+
+	/* class is deleted with the filters that are installed */
+	init_shape(&s);
+	e = add_ent(s.cur, &s.ncur, 1, 3, 1000, 2000);
+	e->filters = TC_FILTER_BIT(0, 0) | TC_FILTER_BIT(1, 1);
+	CHECK_RET(check_batch(&s,
+		"filter del dev eth1 protocol ip parent 1:0 prio 1 handle 163 fw\n"
+		"filter del dev eth1 protocol ipv6 parent 4:0 prio 2 handle 163 fw\n"
+		"class del dev eth1 classid 4:2711\n") != 1)
+}
+
+int main(int argc, char **argv)
+{
+	test_parse_tc_list();
+	test_parse_tc_rate();
+	test_rate_eq();
+	test_build_tc_batch();
+
+	if (_nfailed)
+		printf("FAILED:%d test:%d\n", _nfailed, _ntest);
+	else
+		printf("OK test:%d\n", _ntest);
+
+	return (_nfailed != 0);
+}
@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -61,6 +62,95 @@ void test_misc()
 	CHECK_RET(!vzctl2_get_normalized_uuid("", buf, 1))
 }
 
+void test_host_caps()
+{
+	struct vzctl_host_caps caps, fake = {};
+	TEST()
+
+	CHECK_RET(vzctl2_get_host_caps(&caps))
+
+	snprintf(fake.kver, sizeof(fake.kver), "2.6.18");
+	snprintf(fake.arch, sizeof(fake.arch), "x86_64");
+	fake.tech = VZ_T_X86_64 | VZ_T_NFS;
+	vzctl2_set_host_caps(&fake);
+	CHECK_RET(vzctl2_check_tech(VZ_T_I386 | VZ_T_NFS))
+	CHECK_RET(!vzctl2_check_tech(VZ_T_EXT4))
+
+	vzctl2_set_host_caps(NULL);
+	CHECK_RET(vzctl2_get_host_caps(&fake))
+	CHECK_RET(strcmp(caps.kver, fake.kver))
+}
+
+static int task_fn(void *data)
+{
+	*(int *)data = 42;
+	return 3;
+}
+
+/* more than the pipe buffer */
+#define TASK_BIG_RES	(1 << 20)
+
+static int task_big_fn(void *data)
+{
+	memset(data, 0x5a, TASK_BIG_RES);
+	return 0;
+}
+
+void test_exec_tasks()
+{
+	char *ok[] = {"/bin/sh", "-c", "echo done >&2", NULL};
+	char *fail[] = {"/bin/false", NULL};
+	char *slow[] = {"/bin/sleep", "10", NULL};
+	struct vzctl_exec_task t[3] = {
+		{.argv = ok},
+		{.argv = fail},
+		{.argv = slow, .timeout = 1},
+	};
+	struct vzctl_exec_task ft;
+	struct rlimit rl, lim;
+	static char big[TASK_BIG_RES];
+	int fd, ret, res = 0;
+	TEST()
+
+	CHECK_RET(vzctl2_exec_tasks(t, 1, 0))
+	CHECK_RET(strcmp(t[0].err, "done\n"))
+	CHECK_RET(!vzctl2_exec_tasks(t, 3, 2))
+	CHECK_RET(t[0].status != 0 || t[1].status != 1)
+	CHECK_RET(!t[2].timedout || t[2].status != -1)
+
+	/* function task: the result is copied back from the child */
+	memset(&ft, 0, sizeof(ft));
+	ft.fn = task_fn;
+	ft.data = ft.res = &res;
+	ft.res_size = sizeof(res);
+	CHECK_RET(!vzctl2_exec_tasks(&ft, 1, 0))
+	CHECK_RET(ft.status != 3 || res != 42)
+
+	/* the result is read while the child is writing it */
+	memset(&ft, 0, sizeof(ft));
+	ft.fn = task_big_fn;
+	ft.data = ft.res = big;
+	ft.res_size = sizeof(big);
+	ft.timeout = 10;
+	CHECK_RET(vzctl2_exec_tasks(&ft, 1, 0))
+	CHECK_RET(ft.timedout || big[0] != 0x5a || big[TASK_BIG_RES - 1] != 0x5a)
+
+	/* the script helpers run on the same runner */
+	CHECK_RET(vzctl2_exec_script(fail, NULL, EXEC_QUIET) != 1)
+	CHECK_RET(vzctl2_exec_script(ok, NULL, 0))
+
+	/* no free descriptors: the task can not be started */
+	CHECK_RET(getrlimit(RLIMIT_NOFILE, &rl))
+	fd = dup(0);
+	close(fd);
+	lim = rl;
+	lim.rlim_cur = fd;
+	CHECK_RET(setrlimit(RLIMIT_NOFILE, &lim))
+	ret = vzctl2_exec_tasks(t, 1, 0);
+	setrlimit(RLIMIT_NOFILE, &rl);
+	CHECK_RET(!ret || t[0].pid != 0 || t[0].status == 0)
+}
+
 void test_lock()
 {
 	int fd, tmp, err;
@@ -151,6 +241,89 @@ void test_env_register()
 	vzctl2_env_close(h);
 }
 
+/* The registration link of ctid points to path/ve.conf */
+static int check_reg_link(const char *id, const char *path)
+{
+	char buf[PATH_MAX];
+	char link[PATH_MAX];
+	char conf[PATH_MAX];
+	char *p;
+
+	vzctl2_get_env_conf_path(id, buf, sizeof(buf));
+	if ((p = realpath(buf, NULL)) == NULL)
+		return -1;
+	snprintf(link, sizeof(link), "%s", p);
+	free(p);
+	snprintf(buf, sizeof(buf), "%s/" VZCTL_VE_CONF, path);
+	if ((p = realpath(buf, NULL)) == NULL)
+		return -1;
+	snprintf(conf, sizeof(conf), "%s", p);
+	free(p);
+
+	return strcmp(link, conf) ? -1 : 0;
+}
+
+/* A failed entry of the batch does not affect the others and leaves
+ * no registration link or .owner behind
+ */
+void test_env_register_batch()
+{
+	int err, i, ok;
+	const char *path;
+	char copy[] = "/tmp/test_reg_copy.XXXXXX";
+	char empty[] = "/tmp/test_reg_empty.XXXXXX";
+	char cmd[PATH_MAX * 2];
+	char buf[PATH_MAX];
+	struct vzctl_env_handle *h;
+	struct vzctl_reg_batch_param p[4] = {};
+
+	TEST()
+
+	CHECK_PTR(h, vzctl2_env_open(ctid, 0, &err))
+	vzctl2_env_get_ve_private_path(vzctl2_get_env_param(h), &path);
+	CHECK_RET(mkdtemp(copy) == NULL)
+	CHECK_RET(mkdtemp(empty) == NULL)
+	/* a second private area that claims the same id */
+	snprintf(cmd, sizeof(cmd), "cp %s/" VZCTL_VE_CONF " %s/", path, copy);
+	CHECK_RET(system(cmd))
+
+	p[0].path = path;
+	SET_CTID(p[0].param.ctid, ctid);
+	p[1].path = "/nonexistent";
+	p[2].path = empty;
+	p[3].path = copy;
+	SET_CTID(p[3].param.ctid, ctid);
+
+	vzctl2_env_unregister(NULL, ctid, 0);
+	CHECK_RET(vzctl2_env_register_batch(p, 4, 0, 0) != 3)
+
+	CHECK_RET(p[1].err == 0 || p[1].ctid[0] != '\0')
+	CHECK_RET(p[2].err == 0 || p[2].ctid[0] != '\0')
+	/* exactly one of the claims wins and is registered in full */
+	CHECK_RET((p[0].err == 0) == (p[3].err == 0))
+	ok = p[0].err == 0 ? 0 : 3;
+	CHECK_RET(strcmp(p[ok].ctid, ctid))
+	CHECK_RET(check_reg_link(ctid, p[ok].path))
+	snprintf(buf, sizeof(buf), "%s/" VZCTL_VE_OWNER, p[ok].path);
+	CHECK_RET(access(buf, F_OK))
+	for (i = 2; i < 4; i++) {
+		if (i == ok)
+			continue;
+		snprintf(buf, sizeof(buf), "%s/" VZCTL_VE_OWNER, p[i].path);
+		if (access(buf, F_OK) == 0)
+			TEST_ERR("the failed entry is left half-registered");
+	}
+
+	if (ok != 0) {
+		vzctl2_env_unregister(NULL, ctid, 0);
+		CHECK_RET(vzctl2_env_register(path, &p[0].param, 0))
+	}
+	snprintf(cmd, sizeof(cmd), "rm -rf %s %s", copy, empty);
+	system(cmd);
+
+	vzctl2_env_close(h);
+}
+
 static int stdredir(int rdfd, int wrfd)
 {
 	int lenr, lenw, lentotal, lenremain, n;
@@ -480,6 +653,14 @@ void test_disk_add(vzctl_env_handle_ptr h, struct vzctl_disk_param *param)
 	CHECK_RET(vzctl2_env_resize_disk(h, param->uuid, param->size, 0))
 	CHECK_RET(check_disk_param(h, param))
 
+	/* 2.1 - batch resize */
+	struct vzctl_disk_resize_param rp = {};
+	memcpy(rp.uuid, param->uuid, sizeof(rp.uuid));
+	rp.size = param->size = param->size + 1024000;
+	CHECK_RET(vzctl2_env_resize_disks(h, &rp, 1, 0, NULL, NULL))
+	CHECK_RET(rp.state != VZCTL_RESIZE_DONE)
+	CHECK_RET(check_disk_param(h, param))
+
 	/* 3 enable/disable */
 	for (i = 0; i < 1; i++) {
 		param->path = NULL;
@@ -581,6 +762,26 @@ void test_get_total_meminfo()
 	printf("Toral mem limit: %lu usage: %lu\n", limit, usage);
 }
 
+void test_get_node_meminfo()
+{
+	struct vzctl_node_meminfo info;
+	struct vzctl_env_meminfo_stat *cts = NULL;
+	int i, n = 0;
+
+	TEST()
+	CHECK_RET(vzctl2_get_node_meminfo(&info, sizeof(info), &cts, &n))
+
+	printf("Node RAM: %llu limit: %llu usage: %llu ovr: %2.2f cts: %d\n",
+			info.ram_total, info.limit, info.usage,
+			info.overcommit, info.ncts);
+	for (i = 0; i < n; i++)
+		printf("\t%s limit: %llu usage: %llu\n",
+				cts[i].ctid, cts[i].limit, cts[i].usage);
+	free(cts);
+	if (n != info.ncts)
+		TEST_ERR("n != info.ncts")
+}
+
 static void do_env_destroy(ctid_t ctid)
 {
 	int err;
@@ -696,16 +897,65 @@ int create(ctid_t id)
 	return 0;
 }
 
+/* Read up to size - 1 bytes of file into buf, returns the length or -1 */
+static int read_test_file(const char *file, char *buf, int size)
+{
+	int fd, n;
+
+	if ((fd = open(file, O_RDONLY)) == -1)
+		return -1;
+	n = read(fd, buf, size - 1);
+	close(fd);
+	if (n >= 0)
+		buf[n] = '\0';
+
+	return n;
+}
+
+/* Check the preserved file in the CT root, write it if data is set */
+static int check_preserved_file(vzctl_env_handle_ptr h, const char *data)
+{
+	char path[PATH_MAX];
+	char buf[64];
+	const char *root;
+	FILE *fp;
+	int ret = 0;
+
+	if (vzctl2_env_mount(h, 0))
+		return -1;
+	vzctl2_env_get_ve_root_path(vzctl2_get_env_param(h), &root);
+	snprintf(path, sizeof(path), "%s/root/preserve.txt", root);
+	if (data != NULL) {
+		if ((fp = fopen(path, "w")) == NULL ||
+				fputs(data, fp) == EOF || fclose(fp))
+			ret = -1;
+	} else if (read_test_file(path, buf, sizeof(buf)) == -1 ||
+			strcmp(buf, "preserved\n"))
+		ret = -1;
+	vzctl2_env_umount(h, 0);
+
+	return ret;
+}
+
 void test_reinstall()
 {
 	int err;
 	char cmd[1024];
+	char dd[PATH_MAX];
+	char dd_before[8192];
+	char dd_after[8192];
+	const char *prvt;
 	vzctl_env_handle_ptr h;
 	struct vzctl_env_param *env = vzctl2_alloc_env_param();
 	struct vzctl_env_create_param create_param = {
 	};
 	struct vzctl_reinstall_param reinstall_param = {
 		.skipbackup = 1,
+		.preserve_paths = "/var/lib/rpm /root/preserve.txt",
+	};
+	struct vzctl_reinstall_param bad_param = {
+		.skipbackup = 1,
+		.preserve_paths = "/root/preserve.txt /root/../etc",
 	};
 
 	TEST()
@@ -720,8 +970,22 @@ void test_reinstall()
 	snprintf(cmd, sizeof(cmd), "vzctl exec %d useradd test", veid);
 	system(cmd);
 	vzctl2_env_stop(h, M_HALT, 0);
+	CHECK_RET(check_preserved_file(h, "preserved\n"))
+
+	/* failed reinstall: the temporary snapshot of the old image is
+	 * rolled back and deleted, the CT is left as is
+	 */
+	vzctl2_env_get_ve_private_path(vzctl2_get_env_param(h), &prvt);
+	snprintf(dd, sizeof(dd), "%s/root.hdd/DiskDescriptor.xml", prvt);
+	CHECK_RET(read_test_file(dd, dd_before, sizeof(dd_before)) == -1)
+	CHECK_RET(vzctl2_env_reinstall(h, &bad_param) == 0)
+	CHECK_RET(read_test_file(dd, dd_after, sizeof(dd_after)) == -1)
+	if (strcmp(dd_before, dd_after))
+		TEST_ERR("the temporary snapshot is left after a failed reinstall");
+	CHECK_RET(check_preserved_file(h, NULL))
 
 	CHECK_RET(vzctl2_env_reinstall(h, &reinstall_param))
+	CHECK_RET(check_preserved_file(h, NULL))
 
 	vzctl2_env_close(h);
 }
@@ -842,9 +1106,12 @@ void test_vzctl()
 
 	test_ctid();
 	test_misc();
+	test_host_caps();
+	test_exec_tasks();
 
 //	test_create();
 	test_get_total_meminfo();
+	test_get_node_meminfo();
 	test_lock();
 	test_vzlimits();
 	test_mount();
@@ -866,5 +1133,6 @@ void test_vzctl()
 
 	test_env_stop();
 	test_env_register();
+	test_env_register_batch();
 //	test_reinstall();
 }